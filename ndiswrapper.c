@@ -23,22 +23,61 @@
  *
  */
 
+#define _GNU_SOURCE     /* O_TMPFILE */
 #include <stdlib.h>
+#include <stddef.h>     /* offsetof */
 #include <stdio.h>
+#include <stdarg.h>     /* va_start va_arg va_end */
+#include <errno.h>
 #include <fcntl.h>
-#include <ctype.h>      /* toupper tolower */
 #include <sys/types.h>  /* size_t */
 #include <sys/stat.h>   /* stat */
 #include <dirent.h>     /* opendir closedir readdir */
 #include <regex.h>      /* regexec regfree regcomp */
 #include <string.h>     /* strcat strcpy strcmp strcasecmp strncasecmp strchr strrchr strlen strncpy */
+#include <time.h>       /* clock_gettime */
+#include <limits.h>     /* PATH_MAX */
+#include <sys/time.h>   /* gettimeofday */
 
 #ifdef _WIN32
 #include <io.h>       /* open close read write mkdir rmdir */
+#include <process.h>  /* getpid */
+#include <sys/locking.h> /* _locking */
 #else /* _WIN32 */
-#include <unistd.h>   /* open close read write symlink mkdir rmdir */
+#include <unistd.h>   /* open close read write symlink mkdir rmdir linkat */
+#include <sys/uio.h>  /* writev */
+#include <sys/wait.h> /* waitpid */
+#include <sys/mman.h> /* mmap munmap */
+#include <sys/socket.h> /* socket bind listen accept connect */
+#include <sys/un.h>   /* sockaddr_un */
+#include <signal.h>   /* sigaction */
+#include <sys/file.h> /* flock */
+#include <sys/resource.h> /* getrusage */
+#include <pthread.h>  /* pthread_create pthread_join pthread_mutex_* pthread_cond_* */
+#define HAVE_PTHREAD 1
 #endif /* !_WIN32 */
 
+/* io_uring backend, raw system calls (no liburing) */
+#if defined (__linux__) && defined (__has_include)
+#if __has_include (<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/syscall.h>  /* syscall __NR_io_uring_* */
+#include <linux/io_uring.h>
+#endif
+#endif /* __linux__ */
+
+/* deflated members of the driver archives (make ZLIB=no without it) */
+#ifdef HAVE_ZLIB
+#include <zlib.h>       /* inflateInit2 inflateSetDictionary inflate crc32 */
+#endif /* HAVE_ZLIB */
+
+/* CRC32C instructions, when the target has them */
+#if defined (__SSE4_2__) && defined (__x86_64__)
+#include <nmmintrin.h>  /* _mm_crc32_u64 _mm_crc32_u8 */
+#elif defined (__ARM_FEATURE_CRC32) && defined (__aarch64__)
+#include <arm_acle.h>   /* __crc32cd __crc32cb */
+#endif /* __SSE4_2__ */
+
 
 #define LINEBUFFER    512
 #define STRBUFFER     256
@@ -46,51 +85,745 @@
 #define WRAP_PCI_BUS      5
 #define WRAP_PCMCIA_BUS   8
 #define WRAP_USB_BUS      15
+/* not a bus of ndiswrapper, the IDs are only parsed */
+#define WRAP_SDIO_BUS     -1
+
+/* def_hwid_t : optional parts of an ID */
+#define HWID_SUBSYS   0x01
+#define HWID_REV      0x02
+#define HWID_CC       0x04
+#define HWID_MI       0x08
+#define HWID_FN       0x10
+#define HWID_NAMED    0x20    /* PCMCIA : manufacturer and product names */
 
 #define CONFDIR     "/etc/ndiswrapper"
 #define ICASE       1
 #define SCASE       0
 
+/* --trace : events kept per thread, the oldest ones are overwritten */
+#define TRACE_EVENTS  16384
+
+/* io_uring : files per batch, two batches are in flight */
+#define URING_BATCH   64
+#define URING_SLOTS   (2 * URING_BATCH)
+#define URING_ENTRIES 512
+/* io_uring : submissions taking no entry before giving up */
+#define URING_RETRIES 16
+
+/* hash_data : initial value */
+#define HASH_INIT   14695981039346656037ULL
+
+/* manifest : "crc32c size name" per file of a driver directory */
+#define MANIFEST    "manifest"
+
+/* parse cache : <driver>.inf.cache, next to the INF */
+#define CACHE_MAGIC   "NDWCACHE"
+#define CACHE_VERSION 2
+#define CACHE_ORDER   0x01020304
+
+/* copy workers : default number, largest number, queued jobs */
+#define COPY_JOBS     2
+#define COPY_WORKERS  16
+#define COPY_QUEUE    64
+
+/* driver archives : signatures, MSZIP history */
+#define ZIP_EOCD      0x06054b50
+#define ZIP_CENTRAL   0x02014b50
+#define ZIP_LOCAL     0x04034b50
+#define CAB_MAGIC     "MSCF"
+#define CAB_HISTORY   32768
+
+/* claim of a driver : attempts when the claim is released meanwhile */
+#define CLAIM_TRIES   3
+
+/* daemon : largest request */
+#define FRAME_MAX   (64 * 1024)
+
+/* daemon : seconds a client has to send its request */
+#define FRAME_TIMEOUT 5
+
+/* archive output : size of the write buffer */
+#define OUTBUFFER   (256 * 1024)
+#define TARBLOCK    512
+
 /* regexec : must be a multiple of 3 */
 #define OVECCOUNT   30
 
-/* patterns */
-#define PS1 "([^,]*),([^,]*),([^,]*),([^,]*),(.*)"
-#define PS2 "ndi\\\\params\\\\(.+)"
-#define PS3 "(.+)\\\\.*"
-#define PS4 "PCI\\\\VEN_([0-9A-Za-z]+)&DEV_([0-9A-Za-z]+)&SUBSYS_([0-9A-Za-z]{4})([^[:space:]]{4})"
-#define PS5 "PCI\\\\VEN_([0-9A-Za-z]+)&DEV_([0-9A-Za-z]+)"
-#define PS6 "USB\\\\VID_([0-9A-Za-z]+)&PID_([0-9A-Za-z]+)"
-
 /* this is required on windows */
 #ifndef O_BINARY
 #define O_BINARY (0)
 #endif /* O_BINARY */
 
+
+/* keys handled by the parser, classified when a line is tokenized */
+typedef enum inf_key {
+  KEY_NONE = 0,
+  KEY_OTHER,
+  KEY_ADDREG,
+  KEY_COPYFILES,
+  KEY_BUSTYPE,
+  KEY_DRIVERVER,
+  KEY_PROVIDER,
+  KEY_CLASSGUID
+} inf_key_t;
+
+/* part of a line, always followed by a '\0' */
+typedef struct def_slice_s {
+  const char *s;
+  unsigned int len;
+} def_slice_t;
+
+typedef struct def_line_s {
+  const char *text;       /* trimmed line without comment */
+  def_slice_t key;        /* before '=', empty when there is no key */
+  def_slice_t val;        /* after '=', or the whole line */
+  inf_key_t kclass;
+  unsigned int nfields;
+  def_slice_t *field;     /* comma separated parts of val */
+  const char **rfield;    /* fields with %strings% resolved, on first use */
+} def_line_t;
+
 /* Use structure for replace Perl hash */
 typedef struct def_section_s {
   char name[STRBUFFER];
-  char **data;
+  def_line_t *data;
   unsigned int datalen;
+  /*
+   * body of the section in inf_text, split into data on first use,
+   * or its range of lines when it comes from the parse cache
+   */
+  size_t start;
+  size_t end;
+  int loaded;
+  int cached;             /* start and end are lines of the parse cache */
 } def_section_t;
 
+/*
+ * Parse cache : a header, the tables and a pool of strings. Offsets are
+ * in the pool, a line is its text and the copy split in fields, as made
+ * by tokenize(). A section the install did not use is kept as its range
+ * in the INF, and split on first use like without the cache.
+ */
+typedef struct def_cache_head_s {
+  char magic[8];
+  unsigned int version;
+  unsigned int order;
+  unsigned long long inf_size;
+  unsigned long long inf_hash;  /* hash_data() of the INF */
+  unsigned int nb_sections;
+  unsigned int nb_lines;
+  unsigned int nb_fields;
+  unsigned int nb_strings;
+  unsigned int pool_size;
+  unsigned int pad;
+} def_cache_head_t;
+
+typedef struct def_cache_sect_s {
+  unsigned int name;
+  unsigned int name_len;
+  unsigned int line;        /* first line */
+  unsigned int nb_lines;
+  unsigned int raw;         /* not split, start and end are in the INF */
+  unsigned int start;
+  unsigned int end;
+  unsigned int pad;
+} def_cache_sect_t;
+
+typedef struct def_cache_line_s {
+  unsigned int text;
+  unsigned int len;
+  unsigned int voff;        /* value, from text */
+  unsigned int key;         /* length of the key + 1, 0 without '=' */
+  unsigned int field;       /* first field */
+  unsigned int nb_fields;
+} def_cache_line_t;
+
+typedef struct def_cache_field_s {
+  unsigned int off;         /* from the copy of text */
+  unsigned int len;
+} def_cache_field_t;
+
+typedef struct def_cache_str_s {
+  unsigned int key;
+  unsigned int val;
+} def_cache_str_t;
+
+typedef struct def_cache_s {
+  char *map;
+  size_t size;
+  const def_cache_head_t *head;
+  const def_cache_sect_t *sect;
+  const def_cache_line_t *line;
+  const def_cache_field_t *field;
+  const def_cache_str_t *str;
+  const char *pool;
+} def_cache_t;
+
 typedef struct def_strver_s {
-  char key[STRBUFFER];
-  char val[STRBUFFER];
+  const char *key;          /* interned */
+  char *val;
 } def_strver_t;
 
+/*
+ * key and value table, sized to the INF : the entries in order of
+ * insertion, and an index of them hashed by the atom of their key
+ */
+typedef struct def_strtab_s {
+  def_strver_t *tab;
+  unsigned int nb;
+  unsigned int size;
+  unsigned int *slot;       /* entry + 1, 0 if free */
+  unsigned int slots;
+} def_strtab_t;
+
+/* list of strings, sized to its content */
+typedef struct def_strlist_s {
+  char **tab;
+  unsigned int nb;
+  unsigned int size;
+} def_strlist_t;
+
+/*
+ * Hardware ID of an INF model :
+ * PCI\VEN_vvvv&DEV_dddd[&SUBSYS_ssssvvvv][&REV_rr][&CC_ccss[pp]]
+ * USB\VID_vvvv&PID_pppp[&REV_rrrr][&MI_ii]
+ * SD\VID_vvvv&PID_pppp[&FN_f]
+ * PCMCIA\Manufacturer-Product-cccc (only the CRC is kept)
+ */
+typedef struct def_hwid_s {
+  int bus;
+  unsigned int flags;
+  unsigned short vendor;
+  unsigned short device;
+  unsigned int subsys;      /* subsystem device << 16 | subsystem vendor */
+  unsigned int rev;
+  unsigned int cc;          /* class code, as written */
+  unsigned int mi;          /* USB interface, SDIO function */
+  unsigned int crc;
+} def_hwid_t;
+
+/* a model : its install section and its hardware ID */
+typedef struct def_model_s {
+  const char *section;
+  const char *id;
+  def_hwid_t hw;
+} def_model_t;
+
+/* --compact : a hardware ID and the conf of its install section */
+typedef struct def_idmap_s {
+  char id[32];              /* VVVV:DDDD[:SSSS:SSSS].B */
+  const char *conf;         /* interned */
+  unsigned int seq;         /* the last one of an ID wins */
+} def_idmap_t;
+
+/* -q, -l and the daemon : an installed driver */
+typedef struct def_installed_s {
+  char *name;
+  int fd;
+  char *map;                /* idmap of a compact install, or NULL */
+  size_t size;
+} def_installed_t;
+
 typedef struct def_fixlist_s {
   char n[20];
   char m[20];
 } def_fixlist_t;
 
+/* parameter fix-up, built-in or from --rules, chained by parameter */
+typedef struct def_rule_s {
+  char *param;
+  char *from;               /* NULL : any value */
+  char *to;
+  struct def_rule_s *next;  /* exact values first */
+} def_rule_t;
+
+/* --stats : timed phases and hot-path counters */
+typedef enum stats_phase {
+  PHASE_LOADINF = 0,
+  PHASE_INITSTRINGS,
+  PHASE_PARSEVERSION,
+  PHASE_PARSEMFR,
+  PHASE_PARSEDEVICE,
+  PHASE_COPY,
+  PHASE_PCIFUZZ,
+  PHASE_MAX
+} stats_phase_t;
+
+typedef enum stats_counter {
+  COUNT_SECTIONS = 0,
+  COUNT_LOADED,
+  COUNT_LINES,
+  COUNT_GETSECTION,
+  COUNT_REGEX,
+  COUNT_PROBES,
+  COUNT_FILES,
+  COUNT_BYTES,
+  COUNT_CONFS,
+  COUNT_UNCHANGED,
+  COUNT_REMOVED,
+  COUNT_SUBMITS,
+  COUNT_ALLOCS,
+  COUNT_ALLOC_BYTES,
+  COUNT_MAX
+} stats_counter_t;
+
+typedef enum stats_mode {
+  STATS_NONE = 0,
+  STATS_TEXT,
+  STATS_JSON
+} stats_mode_t;
+
+/* --trace : an event, and the events of a thread */
+typedef struct def_trace_ev_s {
+  unsigned long long ts;
+  const char *name;         /* static string */
+  char ph;                  /* 'B'egin, 'E'nd or 'i'nstant */
+  char arg[47];             /* section, device or file, truncated */
+} def_trace_ev_t;
+
+typedef struct def_trace_ring_s {
+  def_trace_ev_t ev[TRACE_EVENTS];
+  unsigned long long nb;    /* events recorded */
+  unsigned int tid;
+  int busy;                 /* owned by a running thread */
+  struct def_trace_ring_s *next;
+} def_trace_ring_t;
+
+/* install output : directory tree or archive stream */
+typedef enum out_format {
+  OUT_DIR = 0,
+  OUT_TAR,
+  OUT_CPIO
+} out_format_t;
+
+/*
+ * Interned string : equal strings share the same atom, and atoms equal
+ * when ignoring case share the same fold atom.
+ */
+typedef struct def_atom_s {
+  struct def_atom_s *fold;
+  struct def_section_s *section;  /* first section with this name */
+  const struct def_rule_s *rule;  /* fix-ups of this parameter name */
+  inf_key_t kclass;
+  unsigned int hash;              /* hash of the case-folded string */
+  unsigned int len;
+  char str[1];
+} def_atom_t;
+
+typedef struct def_atompool_s {
+  def_atom_t **slot;
+  unsigned int size;
+  unsigned int count;
+} def_atompool_t;
+
+#define ATOM(s)     ((def_atom_t *) ((s) - offsetof (def_atom_t, str)))
+#define ATOM_FIND   0
+#define ATOM_ADD    1
+#define ATOM_FOLD   2
+
+/* file names of a package directory */
+typedef struct def_dircache_s {
+  char dir[STRBUFFER];
+  def_atompool_t names;
+} def_dircache_t;
+
+typedef struct def_nameset_s {
+  char **slot;
+  unsigned int size;
+  unsigned int count;
+} def_nameset_t;
+
+typedef struct def_outfile_s {
+  FILE *f;
+  char *buf;
+  size_t len;
+  char name[STRBUFFER];
+} def_outfile_t;
+
+/* growable memory buffer, reused between files */
+typedef struct def_buf_s {
+  char *data;
+  size_t len;
+  size_t size;
+} def_buf_t;
+
+#ifdef _WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif /* _WIN32 */
+
+/* update : what is done at the end for a changed name */
+typedef enum pending_type {
+  PENDING_DATA = 0,         /* write data */
+  PENDING_FILE,             /* rename the staged copy of a package file */
+  PENDING_LINK              /* symbolic link to data */
+} pending_type_t;
+
+/* update : file written at the end, if its content changed */
+typedef struct def_pending_s {
+  char name[STRBUFFER];
+  char *data;
+  size_t len;
+  int mod;
+  pending_type_t type;
+} def_pending_t;
+
+/* package archive : a member, and a folder (data stream) of a cabinet */
+typedef struct def_member_s {
+  char *name;               /* '/' separated, relative to the archive */
+  unsigned long offset;     /* zip : local header, cab : in its folder */
+  unsigned long csize;      /* zip */
+  unsigned long size;
+  unsigned long crc;        /* zip : CRC-32 */
+  int method;               /* zip : 0 stored, 8 deflated */
+  unsigned int folder;      /* cab */
+} def_member_t;
+
+typedef struct def_folder_s {
+  unsigned long offset;     /* first data block */
+  unsigned int nb_blocks;
+  int type;                 /* 0 stored, 1 MSZIP */
+  char *data;               /* uncompressed on first use */
+  size_t size;
+} def_folder_t;
+
+typedef struct def_archive_s {
+  char *map;                /* NULL : the package is a directory */
+  size_t size;
+  unsigned int reserve;     /* cab : reserved bytes of a data block */
+  def_member_t *member;
+  unsigned int nb_members;
+  def_folder_t *folder;
+  unsigned int nb_folders;
+  char base[STRBUFFER];     /* directory of the INF in the archive */
+  char inf[PATH_MAX];       /* "archive/member" of the INF */
+} def_archive_t;
+
+/* manifest : a file written to the driver directory */
+typedef struct def_sum_s {
+  char *name;               /* relative to the driver directory */
+  unsigned long long size;
+  unsigned int crc;
+  unsigned int seq;         /* the last write of a file wins */
+} def_sum_t;
+
+/* -c : a file of an installed driver to verify */
+typedef struct def_check_s {
+  unsigned int drv;         /* index in installed */
+  char *name;               /* in the manifest */
+  unsigned long long size;
+  unsigned int crc;
+  const char *error;        /* NULL : verified */
+} def_check_t;
+
+#ifdef HAVE_PTHREAD
+/* copy workers : a package file, opened, to write as dst in dfd */
+typedef struct def_copyjob_s {
+  int src;
+  int dfd;
+  char name[STRBUFFER];     /* for the manifest */
+  char dst[STRBUFFER];
+  int mod;
+} def_copyjob_t;
+
+typedef struct def_copyq_s {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;       /* a job was queued, or the queue closed */
+  pthread_cond_t room;        /* a job was taken */
+  def_copyjob_t jobs[COPY_QUEUE];
+  unsigned int head;
+  unsigned int nb;
+  pthread_t workers[COPY_WORKERS];
+  unsigned int nb_workers;
+  int closed;
+} def_copyq_t;
+#endif /* HAVE_PTHREAD */
+
+#ifdef HAVE_IO_URING
+/* io_uring : a file (open, write, close) or a symbolic link to create */
+typedef struct def_uring_op_s {
+  char name[STRBUFFER];
+  const char *rel;        /* name relative to dfd, inside name */
+  int dfd;
+  char *data;             /* content, or target of the link */
+  size_t len;
+  int mod;
+  int symlink;
+} def_uring_op_t;
+
+typedef struct def_uring_s {
+  int fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned int tail;          /* local tail, published on submit */
+  unsigned int queued;        /* entries not submitted yet */
+  unsigned int half;          /* batch being filled */
+  unsigned int nb_op;         /* operations in that batch */
+  unsigned int inflight[2];   /* completions expected per batch */
+  int res;
+  def_uring_op_t op[URING_SLOTS];
+} def_uring_t;
+#endif /* HAVE_IO_URING */
+
+/* -s : how a searched device ID is supported by an INF */
+typedef enum search_match {
+  SEARCH_NONE = 0,
+  SEARCH_FUZZY,
+  SEARCH_EXACT
+} search_match_t;
+
+typedef struct def_search_s {
+  char id[20];              /* VVVV:DDDD[:SSSS:SSSS], upper case */
+  char vd[10];              /* VVVV:DDDD */
+  int subsys;
+  search_match_t match;     /* in the INF being scanned */
+} def_search_t;
+
+typedef struct def_found_s {
+  search_match_t match;
+  unsigned int id;
+  char *path;
+  char *info;
+} def_found_t;
+
+/* --present : a device found in sysfs */
+typedef struct def_present_s {
+  int bus;
+  char vd[10];              /* VVVV:DDDD, upper case */
+} def_present_t;
+
+typedef struct def_stats_s {
+  unsigned long long ns[PHASE_MAX];
+  unsigned long long max[PHASE_MAX];
+  unsigned long long calls[PHASE_MAX];
+  unsigned long long count[COUNT_MAX];
+} def_stats_t;
+
+/*
+ * Directory relative file operations : paths are resolved from an open
+ * directory. Windows has no *at() calls, a directory fd is there an
+ * index in a table of paths.
+ */
+#ifdef _WIN32
+#define AT_FDCWD            (-100)
+#define AT_SYMLINK_NOFOLLOW 0
+#define AT_REMOVEDIR        1
+#define AT_DIRS             8
+
+static char *at_dirs[AT_DIRS];
+
+static const char *
+at_path (int dfd, const char *name, char *buf, size_t size)
+{
+  if (dfd == AT_FDCWD || dfd < 0 || dfd >= AT_DIRS || !at_dirs[dfd]
+      || name[0] == '/' || name[0] == '\\' || (name[0] && name[1] == ':'))
+    return name;
+  snprintf (buf, size, "%s/%s", at_dirs[dfd], name);
+  return buf;
+}
+#endif /* _WIN32 */
+
+static inline int
+dir_open (int dfd, const char *name)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+  const char *path = at_path (dfd, name, buf, sizeof (buf));
+  struct stat st;
+  int i;
+
+  if (stat (path, &st) < 0 || !S_ISDIR (st.st_mode))
+    return -1;
+  for (i = 0; i < AT_DIRS; i++)
+    if (!at_dirs[i])
+    {
+      at_dirs[i] = strdup (path);
+      return at_dirs[i] ? i : -1;
+    }
+  return -1;
+#else /* _WIN32 */
+  return openat (dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif /* !_WIN32 */
+}
+
+static inline void
+dir_close (int *fd)
+{
+  if (*fd == -1)
+    return;
+#ifdef _WIN32
+  free (at_dirs[*fd]);
+  at_dirs[*fd] = NULL;
+#else /* _WIN32 */
+  close (*fd);
+#endif /* !_WIN32 */
+  *fd = -1;
+}
+
+static inline DIR *
+dir_read (int dfd, const char *name)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+
+  return opendir (at_path (dfd, name, buf, sizeof (buf)));
+#else /* _WIN32 */
+  DIR *d;
+  int fd;
+
+  if ((fd = openat (dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return NULL;
+  if (!(d = fdopendir (fd)))
+    close (fd);
+  return d;
+#endif /* !_WIN32 */
+}
+
+static inline int
+my_openat (int dfd, const char *name, int flags, int mod)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+
+  return open (at_path (dfd, name, buf, sizeof (buf)), flags, mod);
+#else /* _WIN32 */
+  return openat (dfd, name, flags, mod);
+#endif /* !_WIN32 */
+}
+
+static inline int
+my_fstatat (int dfd, const char *name, struct stat *st, int flags)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+
+  (void) flags;
+  return stat (at_path (dfd, name, buf, sizeof (buf)), st);
+#else /* _WIN32 */
+  return fstatat (dfd, name, st, flags);
+#endif /* !_WIN32 */
+}
+
+static inline int
+my_unlinkat (int dfd, const char *name, int flags)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+  const char *path = at_path (dfd, name, buf, sizeof (buf));
+
+  return flags & AT_REMOVEDIR ? rmdir (path) : unlink (path);
+#else /* _WIN32 */
+  return unlinkat (dfd, name, flags);
+#endif /* !_WIN32 */
+}
+
+static inline int
+my_mkdirat (int dfd, const char *name)
+{
+#ifdef _WIN32
+  char buf[STRBUFFER];
+
+  return mkdir (at_path (dfd, name, buf, sizeof (buf)));
+#else /* _WIN32 */
+  return mkdirat (dfd, name, 0777);
+#endif /* !_WIN32 */
+}
+
+static inline int
+my_lockfd (int fd)
+{
+  /* released when the process exits, even killed */
+#ifdef _WIN32
+  return _locking (fd, _LK_NBLCK, 1);
+#else /* _WIN32 */
+  return flock (fd, LOCK_EX | LOCK_NB);
+#endif /* !_WIN32 */
+}
+
 static inline int
-my_mkdir (const char *path)
+my_renameat (int olddfd, const char *oldname, int newdfd, const char *newname)
 {
 #ifdef _WIN32
-  return mkdir (path);
+  char buf1[STRBUFFER], buf2[STRBUFFER];
+
+  return rename (at_path (olddfd, oldname, buf1, sizeof (buf1)),
+                 at_path (newdfd, newname, buf2, sizeof (buf2)));
+#else /* _WIN32 */
+  return renameat (olddfd, oldname, newdfd, newname);
+#endif /* !_WIN32 */
+}
+
+static inline ssize_t
+my_writev (int fd, const struct iovec *iov, int iovcnt)
+{
+#ifdef _WIN32
+  ssize_t done = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+  {
+    if (write (fd, iov[i].iov_base, iov[i].iov_len)
+        != (ssize_t) iov[i].iov_len)
+      return -1;
+    done += iov[i].iov_len;
+  }
+  return done;
+#else /* _WIN32 */
+  return writev (fd, iov, iovcnt);
+#endif /* !_WIN32 */
+}
+
+static inline char *
+my_mmap (int dfd, const char *name, size_t *size)
+{
+  struct stat st;
+  char *map = NULL;
+  int fd;
+
+  if ((fd = my_openat (dfd, name, O_RDONLY | O_BINARY, 0)) == -1)
+    return NULL;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+  {
+    *size = st.st_size;
+#ifdef _WIN32
+    map = malloc (*size);
+    if (map && read (fd, map, *size) != (ssize_t) *size)
+    {
+      free (map);
+      map = NULL;
+    }
+#else /* _WIN32 */
+    map = mmap (NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+#endif /* !_WIN32 */
+  }
+  close (fd);
+  return map;
+}
+
+static inline void
+my_munmap (char *map, size_t size)
+{
+  if (!map)
+    return;
+#ifdef _WIN32
+  free (map);
 #else /* _WIN32 */
-  return mkdir (path, 0777);
+  munmap (map, size);
 #endif /* !_WIN32 */
 }
 
@@ -101,1600 +834,6562 @@ static char alt_install_file[STRBUFFER];
 static unsigned int alt_install = 0;
 static unsigned int nb_driver = 0;
 static def_section_t **sections;
+static unsigned int sections_size = 0;
+static char *inf_text = NULL;
+static size_t inf_size = 0;
 
-static def_strver_t strings[LINEBUFFER];
-static def_strver_t version[STRBUFFER];
-static def_strver_t fuzzlist[STRBUFFER];
-static def_strver_t buslist[STRBUFFER];
-static unsigned int nb_strings = 0;
-static unsigned int nb_version = 0;
-static unsigned int nb_fuzzlist = 0;
-static unsigned int nb_buslist = 0;
+static def_strtab_t strings;
+static def_strtab_t version;
+static def_strtab_t fuzzlist;
+static def_strtab_t buslist;
 
 static def_fixlist_t param_fixlist[5];
+static def_rule_t **rules = NULL;
+static unsigned int nb_rules = 0;
 
 static char driver_name[STRBUFFER];
 static char instdir[STRBUFFER];
+/* open directories : configuration, driver (confdir/driver) and package */
+static int conf_fd = -1;
+static int drv_fd = -1;
+static int pkg_fd = -1;
 static char classguid[STRBUFFER];
 static char sys_files[STRBUFFER] = "";
+static char provider_string[STRBUFFER];
+static def_atompool_t inf_atoms;
+static def_cache_t inf_cache;
+static int cache_enable = 1;
+static const char *key_type, *key_default, *key_driverdesc;
+static def_dircache_t *dircache = NULL;
+static unsigned int nb_dircache = 0;
+static def_nameset_t unresolved;
 static int bus;
 
+static out_format_t out_format = OUT_DIR;
+static int out_update = 0;
+static int out_stage = 0;
+static char claim_name[STRBUFFER + 8];
+static int claim_fd = -1;
+static def_pending_t *out_pending = NULL;
+static unsigned int nb_pending = 0;
+static unsigned int pending_size = 0;
+static int out_uring = 0;
+static def_search_t *search = NULL;
+static unsigned int nb_search = 0;
+static const char *sysfs_root = NULL;
+static def_present_t *present = NULL;
+static unsigned int nb_present = 0;
+static int out_compact = 0;
+static def_installed_t *installed = NULL;
+static unsigned int nb_installed = 0;
+static volatile sig_atomic_t daemon_stop = 0;
+static def_idmap_t *idmap = NULL;
+static unsigned int nb_idmap = 0;
+static unsigned int idmap_size = 0;
+#ifdef HAVE_IO_URING
+static def_uring_t uring = { .fd = -1 };
+#endif /* HAVE_IO_URING */
+static unsigned int copy_jobs = COPY_JOBS;
+static unsigned int copy_errors = 0;
+#ifdef HAVE_PTHREAD
+static def_copyq_t copyq = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .ready = PTHREAD_COND_INITIALIZER,
+  .room = PTHREAD_COND_INITIALIZER
+};
+static pthread_mutex_t sums_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t checks_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* HAVE_PTHREAD */
+static unsigned int crc32c_table[8][256];
+static def_archive_t arc;
+static def_sum_t *sums = NULL;
+static unsigned int nb_sums = 0;
+static unsigned int sums_size = 0;
+static def_check_t *checks = NULL;
+static unsigned int nb_checks = 0;
+static unsigned int checks_size = 0;
+static unsigned int next_check = 0;
+static const char *out_name = NULL;
+static int out_fd = -1;
+static char *out_buf = NULL;
+static size_t out_len = 0;
+static unsigned long out_ino = 0;
+static unsigned long out_mtime = 0;
+static def_nameset_t out_names;
+static def_outfile_t alt_manifest;
+
+/* conf files : per device part, and header parts rendered once per INF */
+static def_buf_t conf_buf;
+static def_buf_t conf_head;
+static def_buf_t conf_tail;
+
+static stats_mode_t stats_mode = STATS_NONE;
+static def_stats_t stats;
+static int trace_on = 0;
+static const char *trace_name = NULL;
+static unsigned long long trace_t0 = 0;
+static def_trace_ring_t *trace_rings = NULL;
+static unsigned int trace_tids = 0;
+static __thread def_trace_ring_t *trace_self = NULL;
+
+static const char *stats_phase_names[PHASE_MAX] = {
+  "loadinf", "initStrings", "parseVersion", "parseMfr",
+  "parseDevice", "copy", "processPCIFuzz"
+};
+
+static const char *stats_counter_names[COUNT_MAX] = {
+  "sections", "sections_loaded", "lines", "getSection", "regex",
+  "probes", "files_copied", "bytes_copied", "confs_written",
+  "files_unchanged", "files_removed", "uring_submits", "allocs",
+  "alloc_bytes"
+};
+
 
 /*
- * Hashing processing
- * ------------------
- * - getString    : get "strings" value from a key
- * - getVersion   : get "version" value from a key
- * - getFuzzlist  : get "fuzz" value from a key
- * - getBuslist   : get "bus" value from key
- * - getFixlist   : get "fix" value from a defined value (main init)
- * - def_strings  : put a key and value to the strings table
- * - def_version  : put a key and value to the version table
- * - def_fuzzlist : put a key and value to the fuzzlist table
- * - def_buslist  : put a key and value to the buslist table
+ * Statistics
+ * ----------
+ * - stats_now      : monotonic clock in nanoseconds
+ * - stats_start    : start timing a phase
+ * - stats_stop     : stop timing a phase and account for it
+ * - stats_alloc    : count an allocation and its size
+ * - stats_malloc   : malloc, counted
+ * - stats_calloc   : calloc, counted
+ * - stats_realloc  : realloc, counted
+ * - stats_strdup   : strdup, counted
+ * - stats_strndup  : strndup, counted
+ * - stats_peak_rss : peak resident memory in kilobytes
+ * - stats_print    : report timings, counters and memory (text or JSON)
+ * - trace_ring     : get a ring of events for the calling thread
+ * - trace_event    : record an event in the ring of the thread
+ * - trace_begin    : record the beginning of a span (--trace)
+ * - trace_end      : record the end of a span (--trace)
+ * - trace_mark     : record an instant event (--trace)
+ * - trace_release  : give the ring of a thread which ends to the next one
+ * - trace_json     : write a JSON string
+ * - trace_write    : write the events as a Chrome trace (JSON)
+ *
+ * The rings are only written by their thread, and read once all the
+ * threads are joined; when --trace is not given, an event is a test.
  *
  */
 
-static char *
-getString (char *s)
+static unsigned long long
+stats_now (void)
 {
-  unsigned int i = 0;
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
 
-  do
-  {
-    if (!strcmp (strings[i].key, s))
-    {
-      strcpy (s, strings[i].val);
-      break;
-    }
-    i++;
-  }
-  while (i < nb_strings && i < sizeof (strings) / sizeof (strings[0]));
-  return s;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else /* CLOCK_MONOTONIC */
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long) tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif /* !CLOCK_MONOTONIC */
 }
 
-static char *
-getVersion (char *s)
+static inline unsigned long long
+stats_start (void)
 {
-  unsigned int i = 0;
+  return stats_mode != STATS_NONE ? stats_now () : 0;
+}
 
-  do
-  {
-    if (!strcmp (version[i].key, s))
-    {
-      strcpy (s, version[i].val);
-      break;
-    }
-    i++;
-  }
-  while (i < nb_version && i < sizeof (version) / sizeof (version[0]));
-  return s;
+static inline void
+stats_stop (stats_phase_t phase, unsigned long long start)
+{
+  unsigned long long delta;
+
+  if (stats_mode == STATS_NONE)
+    return;
+
+  delta = stats_now () - start;
+  stats.ns[phase] += delta;
+  stats.calls[phase]++;
+  if (delta > stats.max[phase])
+    stats.max[phase] = delta;
 }
 
-static char *
-getFuzzlist (char *s)
+static void
+stats_alloc (size_t size)
 {
-  unsigned int i = 0;
+  /* counted with or without --stats, threads allocate too */
+  __atomic_add_fetch (&stats.count[COUNT_ALLOCS], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&stats.count[COUNT_ALLOC_BYTES], size,
+                      __ATOMIC_RELAXED);
+}
 
-  do
-  {
-    if (!strcmp (fuzzlist[i].key, s))
-    {
-      strcpy (s, fuzzlist[i].val);
-      break;
-    }
-    i++;
-  }
-  while (i < nb_fuzzlist && i < sizeof (fuzzlist) / sizeof (fuzzlist[0]));
-  return s;
+static void *
+stats_malloc (size_t size)
+{
+  stats_alloc (size);
+  return malloc (size);
 }
 
-static char *
-getBuslist (char *s)
+static void *
+stats_calloc (size_t nmemb, size_t size)
 {
-  unsigned int i = 0;
+  stats_alloc (nmemb * size);
+  return calloc (nmemb, size);
+}
 
-  do
-  {
-    if (!strcmp (buslist[i].key, s))
-    {
-      strcpy (s, buslist[i].val);
-      break;
-    }
-    i++;
-  }
-  while (i < nb_buslist && i < sizeof (buslist) / sizeof (buslist[0]));
-  return s;
+static void *
+stats_realloc (void *ptr, size_t size)
+{
+  stats_alloc (size);
+  return realloc (ptr, size);
 }
 
 static char *
-getFixlist (char *s)
+stats_strdup (const char *str)
 {
-  unsigned int i = 0;
+  stats_alloc (strlen (str) + 1);
+  return strdup (str);
+}
 
-  do
-  {
-    if (!strcmp (param_fixlist[i].n, s))
-    {
-      strcpy (s, param_fixlist[i].m);
-      break;
-    }
-    i++;
-  }
-  while (i < sizeof (param_fixlist) / sizeof (param_fixlist[0]));
-  return s;
+static char *
+stats_strndup (const char *str, size_t n)
+{
+  stats_alloc (strnlen (str, n) + 1);
+  return strndup (str, n);
 }
 
-static void
-def_strings (const char *key, const char *val)
+static unsigned long
+stats_peak_rss (void)
 {
-  unsigned int i = 0;
+#ifdef _WIN32
+  return 0;
+#else /* _WIN32 */
+  struct rusage ru;
 
-  do
-  {
-    if (!strcmp (strings[i].key, key))
-    {
-      strcpy (strings[i].val, val);
-      break;
-    }
-    if (i == nb_strings)
-    {
-      strcpy (strings[i].key, key);
-      strcpy (strings[i].val, val);
-      nb_strings++;
-      break;
-    }
-    i++;
-  }
-  while (i <= nb_strings && i < sizeof (strings) / sizeof (strings[0]));
+  /* kilobytes on Linux */
+  return getrusage (RUSAGE_SELF, &ru) == 0 ? (unsigned long) ru.ru_maxrss : 0;
+#endif /* !_WIN32 */
 }
 
 static void
-def_version (const char *key, const char *val)
+stats_print (void)
 {
-  unsigned int i = 0;
+  unsigned int i;
 
-  do
+  if (stats_mode == STATS_JSON)
   {
-    if (!strcmp (version[i].key, key))
-    {
-      strcpy (version[i].val, val);
-      break;
-    }
-    if (i == nb_version)
-    {
-      strcpy (version[i].key, key);
-      strcpy (version[i].val, val);
-      nb_version++;
-      break;
-    }
-    i++;
+    fprintf (stderr, "{\"timings\":{");
+    for (i = 0; i < PHASE_MAX; i++)
+      fprintf (stderr, "%s\"%s\":{\"calls\":%llu,\"total_us\":%llu,"
+               "\"max_us\":%llu}", i ? "," : "", stats_phase_names[i],
+               stats.calls[i], stats.ns[i] / 1000, stats.max[i] / 1000);
+    fprintf (stderr, "},\"counters\":{");
+    for (i = 0; i < COUNT_MAX; i++)
+      fprintf (stderr, "%s\"%s\":%llu", i ? "," : "",
+               stats_counter_names[i], stats.count[i]);
+    fprintf (stderr, "},\"memory\":{\"peak_rss_kb\":%lu}}\n",
+             stats_peak_rss ());
+  }
+  else if (stats_mode == STATS_TEXT)
+  {
+    fprintf (stderr, "Timings:%21s %12s %12s\n", "calls", "total(us)", "max(us)");
+    for (i = 0; i < PHASE_MAX; i++)
+      fprintf (stderr, "  %-20s %6llu %12llu %12llu\n", stats_phase_names[i],
+               stats.calls[i], stats.ns[i] / 1000, stats.max[i] / 1000);
+    fprintf (stderr, "Counters:\n");
+    for (i = 0; i < COUNT_MAX; i++)
+      fprintf (stderr, "  %-20s %12llu\n",
+               stats_counter_names[i], stats.count[i]);
+    fprintf (stderr, "Memory:\n  %-20s %12lu\n", "peak_rss_kb",
+             stats_peak_rss ());
   }
-  while (i <= nb_version && i < sizeof (version) / sizeof (version[0]));
 }
 
-static void
-def_fuzzlist (const char *key, const char *val)
+static def_trace_ring_t *
+trace_ring (void)
 {
-  unsigned int i = 0;
+  def_trace_ring_t *r;
+
+  /* the ring of a thread which ended is reused, else one is pushed */
+  for (r = __atomic_load_n (&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    if (!__atomic_exchange_n (&r->busy, 1, __ATOMIC_ACQ_REL))
+      return r;
+  if (!(r = stats_calloc (1, sizeof (def_trace_ring_t))))
+    return NULL;
+  r->busy = 1;
+  r->tid = __atomic_add_fetch (&trace_tids, 1, __ATOMIC_RELAXED);
+  r->next = __atomic_load_n (&trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&trace_rings, &r->next, r, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return r;
+}
 
-  do
-  {
-    if (!strcmp (fuzzlist[i].key, key))
-    {
-      strcpy (fuzzlist[i].val, val);
-      break;
-    }
-    if (i == nb_fuzzlist)
-    {
-      strcpy (fuzzlist[i].key, key);
-      strcpy (fuzzlist[i].val, val);
-      nb_fuzzlist++;
-      break;
-    }
-    i++;
-  }
-  while (i <= nb_fuzzlist && i < sizeof (fuzzlist) / sizeof (fuzzlist[0]));
+static void
+trace_event (char ph, const char *name, const char *arg)
+{
+  def_trace_ev_t *ev;
+  size_t i;
+
+  if (!trace_self && !(trace_self = trace_ring ()))
+    return;
+  ev = &trace_self->ev[trace_self->nb++ % TRACE_EVENTS];
+  ev->ts = stats_now ();
+  ev->name = name;
+  ev->ph = ph;
+  for (i = 0; arg && arg[i] && i < sizeof (ev->arg) - 1; i++)
+    ev->arg[i] = arg[i];
+  ev->arg[i] = '\0';
+}
+
+static inline void
+trace_begin (const char *name, const char *arg)
+{
+  if (trace_on)
+    trace_event ('B', name, arg);
+}
+
+static inline void
+trace_end (const char *name)
+{
+  if (trace_on)
+    trace_event ('E', name, NULL);
+}
+
+static inline void
+trace_mark (const char *name, const char *arg)
+{
+  if (trace_on)
+    trace_event ('i', name, arg);
+}
+
+static inline void
+trace_release (void)
+{
+  if (!trace_self)
+    return;
+  __atomic_store_n (&trace_self->busy, 0, __ATOMIC_RELEASE);
+  trace_self = NULL;
 }
 
 static void
-def_buslist (const char *key, const char *val)
+trace_json (FILE *f, const char *str)
 {
-  unsigned int i = 0;
+  for (; *str; str++)
+    if (*str == '"' || *str == '\\')
+      fprintf (f, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      fprintf (f, "\\u%04x", (unsigned char) *str);
+    else
+      fputc (*str, f);
+}
+
+static int
+trace_write (void)
+{
+  def_trace_ring_t *r, *next;
+  const def_trace_ev_t *ev;
+  unsigned long long i, ts;
+  int n = 0, res = 1;
+  FILE *f;
 
-  do
+  if (!trace_on)
+    return 1;
+  if (!(f = fopen (trace_name, "w")))
   {
-    if (!strcmp (buslist[i].key, key))
-    {
-      strcpy (buslist[i].val, val);
-      break;
-    }
-    if (i == nb_buslist)
+    printf ("Unable to create %s\n", trace_name);
+    res = -1;
+  }
+
+  for (r = trace_rings; r; r = next)
+  {
+    /* the last TRACE_EVENTS events of the thread */
+    i = r->nb > TRACE_EVENTS ? r->nb - TRACE_EVENTS : 0;
+    for (; f && i < r->nb; i++)
     {
-      strcpy (buslist[i].key, key);
-      strcpy (buslist[i].val, val);
-      nb_buslist++;
-      break;
+      ev = &r->ev[i % TRACE_EVENTS];
+      ts = ev->ts - trace_t0;
+      fprintf (f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+               "\"pid\":1,\"tid\":%u%s", n++ ? ",\n" : "{\"traceEvents\":[\n",
+               ev->name, ev->ph, ts / 1000, ts % 1000, r->tid,
+               ev->ph == 'i' ? ",\"s\":\"t\"" : "");
+      if (ev->arg[0])
+      {
+        fputs (",\"args\":{\"name\":\"", f);
+        trace_json (f, ev->arg);
+        fputs ("\"}", f);
+      }
+      fputc ('}', f);
     }
-    i++;
+    next = r->next;
+    free (r);
   }
-  while (i <= nb_buslist && i < sizeof (buslist) / sizeof (buslist[0]));
+  trace_rings = NULL;
+  trace_self = NULL;
+
+  if (f)
+  {
+    fprintf (f, "%s\n],\"displayTimeUnit\":\"ms\"}\n",
+             n ? "" : "{\"traceEvents\":[");
+    if (fclose (f) != 0)
+      res = -1;
+  }
+  return res;
 }
 
+
 /*
- * Others
- * ------
- * - regex      : regular expressions
- * - getSection : get a section pointer
- * - unisort    : sort and unify a table
- * - usage      : help
+ * Hashing processing
+ * ------------------
+ * - strlist_add  : append a copy of a string to a list
+ * - strlist_free : release a list
+ * - def_rule     : put a fix-up to the rules, replacing the same one
+ * - def_idmap    : put an ID and its conf to the ID map
+ * - idmap_cmp    : compare the IDs of two entries
+ * - idmap_order  : order of the ID map, then order of insertion
+ * - idmap_sort   : sort the ID map, keeping the last conf of an ID
+ * - getIdmap     : get the conf of an ID from the n first, sorted, entries
+ * - hash_str     : FNV-1a hash of a string
+ * - hash_data    : 64 bits FNV-1a hash of a memory block, incremental
+ * - crc32c_init  : build the CRC32C tables
+ * - crc32c       : CRC32C of a memory block, incremental
+ * - nameset_get  : get the stored copy of a name, adding it if needed
+ * - nameset_add  : remember a name, return 0 if already known
+ * - nameset_has  : test if a name is known
+ * - nameset_free : forget all names
+ * - fold_char    : ASCII lower case
+ * - hash_fold    : FNV-1a hash of a case-folded string
+ * - atom_grow    : grow the atom table
+ * - atom_lookup  : find (or add) an atom, or its fold atom
+ * - intern       : get the interned copy of a string
+ * - atompool_free: release all atoms
+ * - strtab_get   : get the entry of the atom of a key, NULL if undefined
+ * - strtab_grow  : grow the index of a table
+ * - strtab_put   : put a key and value to a table, replacing the value
+ * - strtab_free  : release a table
+ * - strtab_subst : replace a key by its value, if defined
+ * - getString    : get "strings" value from a key
+ * - lookupString : get "strings" value from a key, NULL if undefined
+ * - getVersion   : get "version" value from a key
+ * - getFuzzlist  : get "fuzz" value from a key
+ * - getBuslist   : get "bus" value from key
+ * - getRule      : get the fix-up of a parameter value, NULL if none
+ * - def_strings  : put a key and value to the strings table
+ * - def_version  : put a key and value to the version table
+ * - def_fuzzlist : put a key and value to the fuzzlist table
+ * - def_buslist  : put a key and value to the buslist table
  *
  */
 
 static int
-regex (const char *str_request, const char *str_regex,
-       char rmatch[][STRBUFFER], int icase)
+strlist_add (def_strlist_t *l, const char *str)
 {
-  int err, match, start, end, res = 0;
-  unsigned int i;
-  char *text = NULL;
-  size_t nmatch = 0;
-  size_t size;
-  regex_t preg;
-  regmatch_t *pmatch = NULL;
+  char **tab;
 
-  err = regcomp (&preg, str_regex,
-                 icase ? REG_EXTENDED | REG_ICASE : REG_EXTENDED);
-  if (err == 0)
+  if (l->nb == l->size)
   {
-    nmatch = preg.re_nsub;
-    pmatch = malloc (sizeof (*pmatch) * OVECCOUNT);
-    if (pmatch)
-    {
-      match = regexec (&preg, str_request, OVECCOUNT, pmatch, 0);
-      regfree (&preg);
-      if (match == 0)
-      {
-        for (i = 0; i <= nmatch; i++)
-        {
-          start = pmatch[i].rm_so;
-          end = pmatch[i].rm_eo;
-          size = end - start;
-          text = malloc (sizeof (*text) * (size + 1));
-          if (text)
-          {
-            strncpy (text, &str_request[start], size);
-            text[size] = '\0';
-            strcpy (rmatch[i], text);
-            free (text);
-          }
-        }
-        res = 1;
-      }
-      free (pmatch);
-    }
+    l->size = l->size ? l->size * 2 : 16;
+    tab = stats_realloc (l->tab, l->size * sizeof (char *));
+    if (!tab)
+      return -1;
+    l->tab = tab;
   }
-  if (!res)
-    rmatch[0][0] = '\0';
-  return res;
+  if (!(l->tab[l->nb] = stats_strdup (str)))
+    return -1;
+  l->nb++;
+  return 1;
 }
 
-static def_section_t *
-getSection (const char *needle)
+static void
+strlist_free (def_strlist_t *l)
 {
   unsigned int i;
 
-  for (i = 0; i < nb_sections; i++)
-    if (!strcasecmp (sections[i]->name, needle))
-      return sections[i];
-  return NULL;
+  for (i = 0; i < l->nb; i++)
+    free (l->tab[i]);
+  free (l->tab);
+  memset (l, 0, sizeof (*l));
 }
 
-static void
-unisort (char tab[][STRBUFFER], unsigned int *last)
+static int
+def_rule (const char *param, const char *from, const char *to)
 {
-  unsigned int i, j;
-  int change = 1;
-  char tmp[STRBUFFER];
+  def_rule_t **tab, *rule, **r;
+  unsigned int i;
 
-  while (change)
+  for (i = 0; i < nb_rules && strcmp (rules[i]->param, param); i++)
+    ;
+  if (i == nb_rules)
   {
-    change = 0;
-    for (i = 0; i < *last - 1; i++)
-    {
-      for (j = 0; j < i; j++)
-        if (!strcmp (tab[i], tab[j]))
-        {
-          *last = *last - 1;
-          strcpy (tab[i], tab[*last]);
-          change = 1;
-        }
+    tab = stats_realloc (rules, (nb_rules + 1) * sizeof (def_rule_t *));
+    if (!tab)
+      return -1;
+    rules = tab;
+    rules[nb_rules++] = NULL;
+  }
 
-      if (strcmp (tab[i + 1], tab[i]) < 0)
-      {
-        strcpy (tmp, tab[i]);
-        strcpy (tab[i], tab[i + 1]);
-        strcpy (tab[i + 1], tmp);
-        change = 1;
-      }
+  /* a later rule for the same value replaces the previous one */
+  for (r = &rules[i]; *r; r = &(*r)->next)
+    if (from ? (*r)->from && !strcmp ((*r)->from, from) : !(*r)->from)
+    {
+      free ((*r)->to);
+      (*r)->to = stats_strdup (to);
+      return (*r)->to ? 1 : -1;
     }
+
+  rule = stats_calloc (1, sizeof (def_rule_t));
+  if (!rule)
+    return -1;
+  rule->param = stats_strdup (param);
+  rule->from = from ? stats_strdup (from) : NULL;
+  rule->to = stats_strdup (to);
+  if (!rule->param || !rule->to || (from && !rule->from))
+  {
+    free (rule->param);
+    free (rule->from);
+    free (rule->to);
+    free (rule);
+    return -1;
+  }
+  /* exact values are tried before the any value one */
+  if (from)
+  {
+    rule->next = rules[i];
+    rules[i] = rule;
   }
+  else
+    *r = rule;
+  return 1;
 }
 
-static void
-usage (void)
+static int
+def_idmap (const char *id, const char *conf)
 {
-  printf ("Usage: ndiswrapper OPTION [-o]\n\n");
-  printf ("Manage ndis drivers for ndiswrapper.\n");
-  printf ("-i inffile    Install driver described by 'inffile'\n");
-  printf ("  Optionally with:\n");
-  printf ("  -a          Use alternate output format\n");
-/*
-  printf ("-d devid driver   Use installed 'driver' for 'devid'\n");
-*/
-  printf ("-e driver     Remove 'driver'\n");
-/*
-  printf ("-l            List installed drivers\n");
-  printf ("-m            Write configuration for modprobe\n");
-  printf ("-da           Write module alias configuration for all devices\n");
-  printf ("-di           Write module install configuration for all devices\n");
-  printf ("-v            Report version information\n");
-  printf ("\n\nwhere 'devid' is either PCIID or USBID of the form XXXX:XXXX\n");
-*/
-  printf ("\nOptional:\n");
-  printf ("-o output_dir   Use alternate install directory 'output_dir'\n");
-  printf ("                (default: '/etc/ndiswrapper')\n");
-}
+  def_idmap_t *tab;
 
-/*
- * Strings processing
- * ------------------
- * - uc           : string to upper case
- * - ul           : string to lower case
- * - trim         : remove spaces at the left and the right
- * - stripquotes  : remove quotes
- * - remComment   : remove INF comments
- * - substStr     : substitute a string from the strings table
- * - getKeyVal    : split a line for get the key and the value
- *
- */
+  if (nb_idmap == idmap_size)
+  {
+    idmap_size = idmap_size ? idmap_size * 2 : STRBUFFER;
+    tab = stats_realloc (idmap, idmap_size * sizeof (def_idmap_t));
+    if (!tab)
+      return -1;
+    idmap = tab;
+  }
+  snprintf (idmap[nb_idmap].id, sizeof (idmap[0].id), "%s", id);
+  idmap[nb_idmap].conf = conf;
+  idmap[nb_idmap].seq = nb_idmap;
+  nb_idmap++;
+  return 1;
+}
 
-static char *
-uc (char *data)
+static int
+idmap_cmp (const void *a, const void *b)
 {
-  int i;
-
-  for (i = 0; data[i] != '\0'; i++)
-    data[i] = toupper (data[i]);
-  return data;
+  return strcmp (((const def_idmap_t *) a)->id, ((const def_idmap_t *) b)->id);
 }
 
-static char *
-lc (char *data)
+static int
+idmap_order (const void *a, const void *b)
 {
-  int i;
+  const def_idmap_t *ia = a, *ib = b;
+  int res = idmap_cmp (a, b);
 
-  for (i = 0; data[i] != '\0'; i++)
-    data[i] = tolower (data[i]);
-  return data;
+  if (res)
+    return res;
+  return ia->seq < ib->seq ? -1 : ia->seq > ib->seq;
 }
 
-static char *
-trim (char *s)
+static void
+idmap_sort (void)
 {
-  char *ptr, *copy;
-  copy = s;
-
-  ptr = strchr (s, '\0');
-  while (ptr > s && (*(ptr-1) == ' '
-         || *(ptr-1) == '\t'
-         || *(ptr-1) == '\r'
-         || *(ptr-1) == '\n'))
-    ptr--;
+  unsigned int i, n;
 
-  *ptr = '\0';
-  ptr = s;
-  while (*ptr == ' ' || *ptr == '\t')
-    ptr++;
-
-  do
+  qsort (idmap, nb_idmap, sizeof (def_idmap_t), idmap_order);
+  for (i = 0, n = 0; i < nb_idmap; i++)
   {
-    *(copy++) = *ptr;
+    if (n && !idmap_cmp (&idmap[n - 1], &idmap[i]))
+      n--;
+    idmap[n++] = idmap[i];
   }
-  while (*(ptr++));
-
-  return s;
+  nb_idmap = n;
 }
 
-static char *
-stripquotes (char *s)
+static const char *
+getIdmap (const char *id, unsigned int n)
 {
-  char *start, *end, *copy;
+  def_idmap_t key;
+  const def_idmap_t *found;
 
-  start = strchr (s, '"');
-  if (!start)
-    return s;
+  snprintf (key.id, sizeof (key.id), "%s", id);
+  found = bsearch (&key, idmap, n, sizeof (def_idmap_t), idmap_cmp);
+  return found ? found->conf : NULL;
+}
 
-  end = strchr (start + 1, '"');
-  if (!end)
-    return s;
+static unsigned int
+hash_str (const char *s)
+{
+  unsigned int h = 2166136261U;
 
-  *end = '\0';
-  copy = strdup (start + 1);
-  strcpy (s, copy);
-  free (copy);
-  return s;
+  while (*s)
+    h = (h ^ (unsigned char) *s++) * 16777619U;
+  return h;
 }
 
-static char *
-remComment (char *s)
+static unsigned long long
+hash_data (unsigned long long h, const void *data, size_t len)
 {
-  char *comment;
-  comment = strchr (s, ';');
-  if (comment)
-    *comment = '\0';
-  return s;
+  const unsigned char *p = data;
+
+  while (len--)
+    h = (h ^ *p++) * 1099511628211ULL;
+  return h;
 }
 
-static char *
-substStr (char *s)
+static void
+crc32c_init (void)
 {
-  char *lbracket, *rbracket;
+  unsigned int i, k, crc;
 
-  lbracket = strchr (s,'%');
-  rbracket = strrchr (s,'%');
-  if (lbracket && rbracket
-      && lbracket != rbracket && s[rbracket-lbracket+1] == '\0')
+  /* Castagnoli polynomial, reflected */
+  for (i = 0; i < 256; i++)
   {
-    strncpy (s, lbracket + 1, rbracket - lbracket - 1);
-    s[rbracket - lbracket - 1] = '\0';
-    getString (s);
+    crc = i;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    crc32c_table[0][i] = crc;
   }
-  return s;
+  /* slicing by 8 : table k is the CRC of a byte followed by k zeros */
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8)
+        ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
 }
 
-static void
-getKeyVal (const char *line, char tmp[2][STRBUFFER])
+static unsigned int
+crc32c (unsigned int crc, const void *data, size_t len)
 {
-  char *ptr;
-  ptr = strchr (line, '=');
-  if (ptr)
+  const unsigned char *p = data;
+#if defined (__SSE4_2__) && defined (__x86_64__)
+  unsigned long long c = ~crc;
+  unsigned long long v;
+
+  for (; len >= 8; p += 8, len -= 8)
   {
-    strncpy (tmp[0], line, ptr - line);
-    tmp[0][ptr - line] = '\0';
-    strcpy (tmp[1], ptr + 1);
-    trim (tmp[0]);
-    trim (tmp[1]);
+    memcpy (&v, p, 8);
+    c = _mm_crc32_u64 (c, v);
   }
-  else
+  crc = c;
+  while (len--)
+    crc = _mm_crc32_u8 (crc, *p++);
+  return ~crc;
+#elif defined (__ARM_FEATURE_CRC32) && defined (__aarch64__)
+  unsigned long long v;
+
+  crc = ~crc;
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy (&v, p, 8);
+    crc = __crc32cd (crc, v);
+  }
+  while (len--)
+    crc = __crc32cb (crc, *p++);
+  return ~crc;
+#else
+  unsigned int lo, hi;
+
+  crc = ~crc;
+  /* 8 bytes per step, the tables are little endian */
+  for (; len >= 8; p += 8, len -= 8)
   {
-    tmp[0][0] = '\0';
-    tmp[1][0] = '\0';
+    lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+    hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+    crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+      ^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+      ^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF]
+      ^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
   }
+  while (len--)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+#endif /* !__SSE4_2__ */
 }
 
-/*
- * Files processing
- * ----------------
- * - finddir      : depend of copy_file
- * - findfile     : depend of copy_file
- * - copy         : copy file processing
- * - copy_file    : search the real name of the file
- * - copyfiles    : search files for the copy
- * - file_exists  : test if a file exists
- * - rmtree       : remove a dir
- *
- */
-
-static int
-finddir (char *file)
+static const char *
+nameset_get (def_nameset_t *set, const char *name)
 {
-  unsigned int i = 0;
-  int res = -1;
-  char sp[2][STRBUFFER], *ptr1, *ptr2;
-  def_section_t *sourcedisksfiles = NULL;
+  unsigned int i, size, mask;
+  char **slot;
 
-  sourcedisksfiles = getSection ("sourcedisksfiles");
-  if (!sourcedisksfiles)
+  if (set->count * 2 >= set->size)
   {
-    file[0] = '\0';
-    return -1;
+    size = set->size ? set->size * 2 : 256;
+    slot = stats_calloc (size, sizeof (char *));
+    if (!slot)
+      return NULL;
+    mask = size - 1;
+    for (i = 0; i < set->size; i++)
+      if (set->slot[i])
+      {
+        unsigned int j = hash_str (set->slot[i]) & mask;
+        while (slot[j])
+          j = (j + 1) & mask;
+        slot[j] = set->slot[i];
+      }
+    free (set->slot);
+    set->slot = slot;
+    set->size = size;
   }
 
-  for (i = 0; i < sourcedisksfiles->datalen; i++)
-  {
-    ptr1 = sourcedisksfiles->data[i];
-    ptr2 = strchr (sourcedisksfiles->data[i], '=');
-    if (!ptr2)
-      continue;
-
-    strncpy (sp[0], ptr1, ptr2 - ptr1);
-    sp[0][ptr2 - ptr1] = '\0';
-    trim (sp[0]);
-    ptr2 = strrchr (ptr1, ',');
-    if (!ptr2)
-      continue;
-
-    strcpy (sp[1], ptr2 + 1);
-    trim (sp[1]);
-    if (res == -1
-        && sp[0][0] != '\0'
-        && sp[1][0] != '\0'
-        && !strcasecmp (sp[0], file))
-    {
-      strcpy (file, sp[1]);
-      res = 1;
-    }
-  }
-  if (res == -1)
-    file[0] = '\0';
-  return res;
+  mask = set->size - 1;
+  for (i = hash_str (name) & mask; set->slot[i]; i = (i + 1) & mask)
+    if (!strcmp (set->slot[i], name))
+      return set->slot[i];
+  set->slot[i] = stats_strdup (name);
+  if (!set->slot[i])
+    return NULL;
+  set->count++;
+  return set->slot[i];
 }
 
 static int
-findfile (const char *dir, char *file)
+nameset_add (def_nameset_t *set, const char *name)
 {
-  char path[STRBUFFER];
-  DIR *d;
-  struct dirent *dp;
+  unsigned int count = set->count;
 
-  snprintf (path, sizeof (path), "%s/%s", instdir, dir);
-  if (!(d = opendir (path)))
-  {
-    printf ("Unable to open %s\n", instdir);
-    file[0] = '\0';
+  if (!nameset_get (set, name))
     return -1;
-  }
-
-  while ((dp = readdir(d)))
-    if (!strcasecmp (file, dp->d_name))
-    {
-      closedir (d);
-      strcpy (file, dp->d_name);
-      return 1;
-    }
-
-  closedir (d);
-  file[0] = '\0';
-  return -1;
+  return set->count != count;
 }
 
 static int
-copy (const char *file_src, const char *file_dst, int mod)
+nameset_has (const def_nameset_t *set, const char *name)
 {
-  int infile = 0;
-  int outfile = 1;
-  int nbytes;
-  char rwbuf[1024];
+  unsigned int i, mask;
 
-  if ((infile = open (file_src, O_RDONLY | O_BINARY)) == -1)
-  {
-    printf ("Unable to open %s file read-only!\n", file_src);
-    return -1;
-  }
+  if (!set->size)
+    return 0;
+  mask = set->size - 1;
+  for (i = hash_str (name) & mask; set->slot[i]; i = (i + 1) & mask)
+    if (!strcmp (set->slot[i], name))
+      return 1;
+  return 0;
+}
 
-  if ((outfile =
-       open (file_dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mod)) == -1)
-  {
-    printf ("Unable to open %s file for create/write/appending!\n", file_dst);
-    return -1;
-  }
+static void
+nameset_free (def_nameset_t *set)
+{
+  unsigned int i;
 
-  while ((nbytes = read (infile, rwbuf, 1024)) > 0)
-    write (outfile, rwbuf, nbytes);
+  for (i = 0; i < set->size; i++)
+    free (set->slot[i]);
+  free (set->slot);
+  memset (set, 0, sizeof (*set));
+}
 
-  close (infile);
-  close (outfile);
-  return 1;
+static inline unsigned char
+fold_char (unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
 }
 
-static void
-copy_file (char *file)
+static unsigned int
+hash_fold (const char *s, size_t len)
+{
+  unsigned int h = 2166136261U;
+
+  while (len--)
+    h = (h ^ fold_char (*s++)) * 16777619U;
+  return h;
+}
+
+static int
+atom_grow (def_atompool_t *pool)
+{
+  unsigned int i, j, size, mask;
+  def_atom_t **slot;
+
+  size = pool->size ? pool->size * 2 : 1024;
+  slot = stats_calloc (size, sizeof (def_atom_t *));
+  if (!slot)
+    return -1;
+  mask = size - 1;
+  for (i = 0; i < pool->size; i++)
+    if (pool->slot[i])
+    {
+      for (j = pool->slot[i]->hash & mask; slot[j]; j = (j + 1) & mask)
+        ;
+      slot[j] = pool->slot[i];
+    }
+  free (pool->slot);
+  pool->slot = slot;
+  pool->size = size;
+  return 0;
+}
+
+static def_atom_t *
+atom_lookup (def_atompool_t *pool, const char *s, size_t len, int add)
+{
+  unsigned int i, mask, hash;
+  def_atom_t *atom, *fold = NULL;
+
+  if (add == ATOM_ADD && pool->count * 2 >= pool->size && atom_grow (pool) < 0)
+    return NULL;
+  if (!pool->size)
+    return NULL;
+
+  hash = hash_fold (s, len);
+  mask = pool->size - 1;
+  for (i = hash & mask; (atom = pool->slot[i]); i = (i + 1) & mask)
+  {
+    stats.count[COUNT_PROBES]++;
+    if (atom->hash != hash || atom->len != len)
+      continue;
+    if (!memcmp (atom->str, s, len))
+      return add == ATOM_FOLD ? atom->fold : atom;
+    if (!fold && !strncasecmp (atom->str, s, len))
+      fold = atom->fold;
+  }
+  if (add == ATOM_FOLD)
+    return fold;
+  if (add != ATOM_ADD)
+    return NULL;
+
+  atom = stats_calloc (1, sizeof (def_atom_t) + len);
+  if (!atom)
+    return NULL;
+  atom->hash = hash;
+  atom->len = len;
+  atom->fold = fold ? fold : atom;
+  memcpy (atom->str, s, len);
+  pool->slot[i] = atom;
+  pool->count++;
+  return atom;
+}
+
+static const char *
+intern (const char *s)
+{
+  def_atom_t *atom = atom_lookup (&inf_atoms, s, strlen (s), ATOM_ADD);
+
+  return atom ? atom->str : NULL;
+}
+
+static void
+atompool_free (def_atompool_t *pool)
+{
+  unsigned int i;
+
+  for (i = 0; i < pool->size; i++)
+    free (pool->slot[i]);
+  free (pool->slot);
+  memset (pool, 0, sizeof (*pool));
+}
+
+static def_strver_t *
+strtab_get (const def_strtab_t *t, const char *key)
+{
+  const def_atom_t *atom;
+  unsigned int i, mask;
+
+  /* a key never interned is in no table */
+  if (!t->slots
+      || !(atom = atom_lookup (&inf_atoms, key, strlen (key), ATOM_FIND)))
+    return NULL;
+  mask = t->slots - 1;
+  for (i = atom->hash & mask; t->slot[i]; i = (i + 1) & mask)
+  {
+    stats.count[COUNT_PROBES]++;
+    if (t->tab[t->slot[i] - 1].key == atom->str)
+      return &t->tab[t->slot[i] - 1];
+  }
+  return NULL;
+}
+
+static int
+strtab_grow (def_strtab_t *t)
+{
+  unsigned int i, j, size, mask;
+  unsigned int *slot;
+
+  size = t->slots ? t->slots * 2 : 32;
+  slot = stats_calloc (size, sizeof (unsigned int));
+  if (!slot)
+    return -1;
+  mask = size - 1;
+  for (i = 0; i < t->nb; i++)
+  {
+    for (j = ATOM (t->tab[i].key)->hash & mask; slot[j]; j = (j + 1) & mask)
+      ;
+    slot[j] = i + 1;
+  }
+  free (t->slot);
+  t->slot = slot;
+  t->slots = size;
+  return 0;
+}
+
+static int
+strtab_put (def_strtab_t *t, const char *key, const char *val)
+{
+  def_strver_t *e, *tab;
+  unsigned int i, mask;
+  char *v;
+
+  if ((e = strtab_get (t, key)))
+  {
+    if (!(v = stats_strdup (val)))
+      return -1;
+    free (e->val);
+    e->val = v;
+    return 1;
+  }
+
+  if (t->nb == t->size)
+  {
+    t->size = t->size ? t->size * 2 : 16;
+    tab = stats_realloc (t->tab, t->size * sizeof (def_strver_t));
+    if (!tab)
+      return -1;
+    t->tab = tab;
+  }
+  if ((t->nb + 1) * 2 > t->slots && strtab_grow (t) < 0)
+    return -1;
+  e = &t->tab[t->nb];
+  e->key = intern (key);
+  e->val = stats_strdup (val);
+  if (!e->key || !e->val)
+  {
+    free (e->val);
+    return -1;
+  }
+  mask = t->slots - 1;
+  for (i = ATOM (e->key)->hash & mask; t->slot[i]; i = (i + 1) & mask)
+    ;
+  t->slot[i] = ++t->nb;
+  return 1;
+}
+
+/* the keys are atoms : released with them */
+static void
+strtab_free (def_strtab_t *t)
+{
+  unsigned int i;
+
+  for (i = 0; i < t->nb; i++)
+    free (t->tab[i].val);
+  free (t->tab);
+  free (t->slot);
+  memset (t, 0, sizeof (*t));
+}
+
+/* the value replaces the key, cut to the size of the callers' buffers */
+static char *
+strtab_subst (const def_strtab_t *t, char *s)
+{
+  const def_strver_t *e = strtab_get (t, s);
+
+  if (e)
+    snprintf (s, STRBUFFER, "%s", e->val);
+  return s;
+}
+
+static char *
+getString (char *s)
+{
+  return strtab_subst (&strings, s);
+}
+
+static const char *
+lookupString (const char *s)
+{
+  const def_strver_t *e = strtab_get (&strings, s);
+
+  return e ? e->val : NULL;
+}
+
+static char *
+getVersion (char *s)
+{
+  return strtab_subst (&version, s);
+}
+
+static char *
+getFuzzlist (char *s)
+{
+  return strtab_subst (&fuzzlist, s);
+}
+
+static char *
+getBuslist (char *s)
+{
+  return strtab_subst (&buslist, s);
+}
+
+static const def_rule_t *
+getRule (const char *param, const char *val)
+{
+  const def_rule_t *rule;
+
+  /* the parameter is interned, its atom has its rules */
+  for (rule = ATOM (param)->rule; rule; rule = rule->next)
+  {
+    stats.count[COUNT_PROBES]++;
+    if (!rule->from || !strcmp (rule->from, val))
+      return rule;
+  }
+  return NULL;
+}
+
+static void
+def_strings (const char *key, const char *val)
+{
+  strtab_put (&strings, key, val);
+}
+
+static void
+def_version (const char *key, const char *val)
+{
+  strtab_put (&version, key, val);
+}
+
+static void
+def_fuzzlist (const char *key, const char *val)
+{
+  strtab_put (&fuzzlist, key, val);
+}
+
+static void
+def_buslist (const char *key, const char *val)
+{
+  strtab_put (&buslist, key, val);
+}
+
+/*
+ * Strings processing
+ * ------------------
+ * - swar_case    : ASCII case of the letters of a range, 8 bytes at once
+ * - swar_conv    : ASCII case of the letters of a range in a buffer
+ * - ucn          : buffer to upper case
+ * - uc           : string to upper case
+ * - lcn          : buffer to lower case
+ * - lc           : string to lower case
+ * - trimn        : remove spaces at the left and the right of a buffer
+ * - trim         : remove spaces at the left and the right
+ * - stripquotes  : remove quotes, in place
+ * - remCommentn  : remove INF comments of a buffer
+ * - remComment   : remove INF comments
+ * - initKeys     : intern the well-known keys with their class
+ * - setKey       : intern the key of a line and classify it
+ * - tokenize     : split a line into key, value and fields
+ * - resolveStr   : strip quotes and substitute a %string%, interned
+ * - lineField    : get a field with its %string% resolved
+ * - lineTail     : get the end of a line starting with a field
+ * - buf_grow     : make room in a buffer
+ * - buf_put      : append bytes to a buffer
+ * - buf_cat      : append a NULL terminated list of strings to a buffer
+ * - buf_free     : release a buffer
+ *
+ */
+
+/*
+ * ASCII case of 8 bytes at once : the 7 low bits of each byte plus an
+ * offset set the high bit from the first letter of the range and from
+ * the byte following the range, bytes which are not ASCII are kept.
+ */
+static inline unsigned long long
+swar_case (unsigned long long w, unsigned char first, unsigned char last)
+{
+  const unsigned long long ones = 0x0101010101010101ULL;
+  const unsigned long long high = 0x8080808080808080ULL;
+  unsigned long long low = w & ~high;
+  unsigned long long ge = low + ones * (0x80 - first);
+  unsigned long long gt = low + ones * (0x80 - last - 1);
+
+  return w ^ ((ge & ~gt & ~w & high) >> 2);
+}
+
+static char *
+swar_conv (char *data, size_t len, unsigned char first, unsigned char last)
+{
+  unsigned long long w;
+  size_t i;
+
+  for (i = 0; i + sizeof (w) <= len; i += sizeof (w))
+  {
+    memcpy (&w, data + i, sizeof (w));
+    w = swar_case (w, first, last);
+    memcpy (data + i, &w, sizeof (w));
+  }
+  for (; i < len; i++)
+    if ((unsigned char) data[i] >= first && (unsigned char) data[i] <= last)
+      data[i] ^= 0x20;
+  return data;
+}
+
+static char *
+ucn (char *data, size_t len)
+{
+  return swar_conv (data, len, 'a', 'z');
+}
+
+static char *
+uc (char *data)
+{
+  return ucn (data, strlen (data));
+}
+
+static char *
+lcn (char *data, size_t len)
+{
+  return swar_conv (data, len, 'A', 'Z');
+}
+
+static char *
+lc (char *data)
+{
+  return lcn (data, strlen (data));
+}
+
+static size_t
+trimn (char *s, size_t len)
+{
+  size_t start = 0;
+
+  while (len && (s[len - 1] == ' ' || s[len - 1] == '\t'
+                 || s[len - 1] == '\r' || s[len - 1] == '\n'))
+    len--;
+  while (start < len && (s[start] == ' ' || s[start] == '\t'))
+    start++;
+
+  len -= start;
+  if (start)
+    memmove (s, s + start, len);
+  s[len] = '\0';
+  return len;
+}
+
+static char *
+trim (char *s)
+{
+  trimn (s, strlen (s));
+  return s;
+}
+
+static char *
+stripquotes (char *s)
+{
+  char *start, *end;
+
+  start = strchr (s, '"');
+  if (!start)
+    return s;
+
+  end = strchr (start + 1, '"');
+  if (!end)
+    return s;
+
+  memmove (s, start + 1, end - start - 1);
+  s[end - start - 1] = '\0';
+  return s;
+}
+
+static size_t
+remCommentn (char *s, size_t len)
+{
+  char *comment = memchr (s, ';', len);
+
+  if (!comment)
+    return len;
+  *comment = '\0';
+  return comment - s;
+}
+
+static char *
+remComment (char *s)
+{
+  remCommentn (s, strlen (s));
+  return s;
+}
+
+static void
+initKeys (void)
+{
+  static const struct {
+    const char *name;
+    inf_key_t kclass;
+  } keys[] = {
+    { "AddReg",    KEY_ADDREG    },
+    { "CopyFiles", KEY_COPYFILES },
+    { "BusType",   KEY_BUSTYPE   },
+    { "DriverVer", KEY_DRIVERVER },
+    { "Provider",  KEY_PROVIDER  },
+    { "ClassGUID", KEY_CLASSGUID },
+  };
+  const char *key;
+  unsigned int i;
+
+  /* first in the pool, so they are the fold atoms of their variants */
+  for (i = 0; i < sizeof (keys) / sizeof (keys[0]); i++)
+    if ((key = intern (keys[i].name)))
+      ATOM (key)->kclass = keys[i].kclass;
+
+  /* parameters with fix-ups */
+  for (i = 0; i < nb_rules; i++)
+    if ((key = intern (rules[i]->param)))
+      ATOM (key)->rule = rules[i];
+
+  /* names compared by addReg() */
+  key_type = intern ("type");
+  key_default = intern ("default");
+  key_driverdesc = intern ("DriverDesc");
+}
+
+static int
+setKey (def_line_t *line, const char *key, size_t len)
+{
+  line->key.s = intern (key);
+  if (!line->key.s)
+    return -1;
+  line->key.len = len;
+  line->kclass = ATOM (line->key.s)->fold->kclass;
+  if (line->kclass == KEY_NONE)
+    line->kclass = KEY_OTHER;
+  return 0;
+}
+
+static int
+tokenize (def_line_t *line, const char *s, size_t len)
+{
+  unsigned int nfields = 1;
+  int quoted = 0;
+  size_t i, eq = len, voff = 0;
+  char *block, *text, *tok, *p, *end;
+  const char **rfield;
+  def_slice_t *field;
+
+  /* the key ends at the first '=' which is not after a comma */
+  for (i = 0; i < len; i++)
+  {
+    if (s[i] == '"')
+      quoted = !quoted;
+    else if (s[i] == ',' && !quoted)
+      break;
+    else if (s[i] == '=')
+    {
+      eq = i;
+      break;
+    }
+  }
+  if (eq < len)
+    for (voff = eq + 1; s[voff] == ' ' || s[voff] == '\t'; voff++)
+      ;
+  for (i = voff; i < len; i++)
+    if (s[i] == ',')
+      nfields++;
+
+  /*
+   * fields, resolved fields, text and a copy of text split in place,
+   * in a single block
+   */
+  block = stats_malloc (nfields * (sizeof (def_slice_t) + sizeof (char *))
+                  + 2 * (len + 1));
+  if (!block)
+    return -1;
+  field = (def_slice_t *) block;
+  rfield = (const char **) (field + nfields);
+  memset (rfield, 0, nfields * sizeof (char *));
+  text = (char *) (rfield + nfields);
+  tok = text + len + 1;
+  memcpy (text, s, len);
+  text[len] = '\0';
+  memcpy (tok, s, len);
+  tok[len] = '\0';
+
+  memset (line, 0, sizeof (*line));
+  line->text = text;
+  line->field = field;
+  line->rfield = rfield;
+  line->nfields = nfields;
+  line->kclass = KEY_NONE;
+  if (eq < len)
+  {
+    for (end = tok + eq; end > tok && (end[-1] == ' ' || end[-1] == '\t'); )
+      end--;
+    *end = '\0';
+    if (setKey (line, tok, end - tok) < 0)
+    {
+      free (block);
+      return -1;
+    }
+  }
+  line->val.s = text + voff;
+  line->val.len = len - voff;
+
+  for (p = tok + voff, i = 0; i < nfields; i++)
+  {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    field[i].s = p;
+    end = strchr (p, ',');
+    if (!end)
+      end = tok + len;
+    p = end + 1;
+    while (end > field[i].s && (end[-1] == ' ' || end[-1] == '\t'
+                                || end[-1] == '\r' || end[-1] == '\n'))
+      end--;
+    *end = '\0';
+    field[i].len = end - field[i].s;
+  }
+  return 0;
+}
+
+static const char *
+resolveStr (const char *s)
+{
+  char buf[STRBUFFER];
+  const char *val;
+  size_t len;
+
+  snprintf (buf, sizeof (buf), "%s", s);
+  stripquotes (buf);
+  len = strlen (buf);
+  if (len < 2 || buf[0] != '%' || buf[len - 1] != '%')
+    return intern (buf);
+
+  /* %token% */
+  buf[len - 1] = '\0';
+  val = lookupString (buf + 1);
+  if (val)
+    return intern (val);
+
+  if (nameset_add (&unresolved, buf + 1) > 0)
+    printf ("Unresolved string %%%s%% in inf\n", buf + 1);
+  return intern (buf + 1);
+}
+
+static const char *
+lineField (def_line_t *line, unsigned int n)
+{
+  if (!line->rfield[n])
+    line->rfield[n] = resolveStr (line->field[n].s);
+  return line->rfield[n];
+}
+
+static const char *
+lineTail (const def_line_t *line, unsigned int n)
+{
+  /* fields live in a copy of text which starts right after it */
+  const char *tok = line->val.s + line->val.len + 1;
+
+  return line->text + (line->field[n].s - tok);
+}
+
+static int
+buf_grow (def_buf_t *b, size_t len)
+{
+  size_t size;
+  char *data;
+
+  if (b->len + len <= b->size)
+    return 1;
+
+  size = b->size ? b->size : STRBUFFER * 4;
+  while (size < b->len + len)
+    size *= 2;
+  data = stats_realloc (b->data, size);
+  if (!data)
+    return -1;
+  b->data = data;
+  b->size = size;
+  return 1;
+}
+
+static int
+buf_put (def_buf_t *b, const char *data, size_t len)
+{
+  if (buf_grow (b, len) < 0)
+    return -1;
+  memcpy (b->data + b->len, data, len);
+  b->len += len;
+  return 1;
+}
+
+static int
+buf_cat (def_buf_t *b, ...)
+{
+  va_list ap;
+  const char *str;
+  int res = 1;
+
+  va_start (ap, b);
+  while (res > 0 && (str = va_arg (ap, const char *)))
+    res = buf_put (b, str, strlen (str));
+  va_end (ap);
+  return res;
+}
+
+static void
+buf_free (def_buf_t *b)
+{
+  free (b->data);
+  b->data = NULL;
+  b->len = 0;
+  b->size = 0;
+}
+
+/*
+ * Parse cache
+ * -----------
+ * - cache_close  : unmap the cache
+ * - cache_open   : map the cache of an INF if it matches its content
+ * - cache_lines  : get the lines of a section from the cache
+ * - cache_tables : serialize the sections, the lines and the strings
+ * - cache_build  : the cache of the loaded INF
+ *
+ * The lines point into the mapping, only the keys are interned again.
+ *
+ */
+
+static void
+cache_close (void)
+{
+  my_munmap (inf_cache.map, inf_cache.size);
+  memset (&inf_cache, 0, sizeof (inf_cache));
+}
+
+static int
+cache_open (int dfd, const char *name)
+{
+  def_cache_t *c = &inf_cache;
+  const def_cache_head_t *head;
+  unsigned long long size;
+
+  if (!(c->map = my_mmap (dfd, name, &c->size)))
+    return 0;
+  if (c->size < sizeof (def_cache_head_t))
+  {
+    cache_close ();
+    return 0;
+  }
+
+  head = (const def_cache_head_t *) c->map;
+  size = sizeof (def_cache_head_t)
+    + (unsigned long long) head->nb_sections * sizeof (def_cache_sect_t)
+    + (unsigned long long) head->nb_lines * sizeof (def_cache_line_t)
+    + (unsigned long long) head->nb_fields * sizeof (def_cache_field_t)
+    + (unsigned long long) head->nb_strings * sizeof (def_cache_str_t)
+    + head->pool_size;
+  if (memcmp (head->magic, CACHE_MAGIC, sizeof (head->magic))
+      || head->version != CACHE_VERSION || head->order != CACHE_ORDER
+      || size != c->size || !head->pool_size
+      || c->map[c->size - 1] != '\0' || head->inf_size != inf_size
+      || head->inf_hash != hash_data (HASH_INIT, inf_text, inf_size))
+  {
+    cache_close ();
+    return 0;
+  }
+
+  c->head = head;
+  c->sect = (const def_cache_sect_t *) (head + 1);
+  c->line = (const def_cache_line_t *) (c->sect + head->nb_sections);
+  c->field = (const def_cache_field_t *) (c->line + head->nb_lines);
+  c->str = (const def_cache_str_t *) (c->field + head->nb_fields);
+  c->pool = (const char *) (c->str + head->nb_strings);
+  return 1;
+}
+
+static void
+cache_lines (def_section_t *sec)
+{
+  const def_cache_t *c = &inf_cache;
+  const def_cache_line_t *cl;
+  const def_cache_field_t *cf;
+  def_line_t *line;
+  def_slice_t *field;
+  const char *text, *tok;
+  unsigned int i, j;
+  char *block;
+
+  if (sec->start > sec->end || sec->end > c->head->nb_lines)
+    return;
+  sec->data = stats_malloc ((sec->end - sec->start + 1) * sizeof (def_line_t));
+  if (!sec->data)
+    return;
+
+  for (i = sec->start; i < sec->end; i++)
+  {
+    cl = &c->line[i];
+    /* a line of the INF is cut to STRBUFFER, its fields are copied as is */
+    if (cl->len >= STRBUFFER
+        || cl->text + 2 * (unsigned long long) (cl->len + 1) > c->head->pool_size
+        || cl->voff > cl->len || cl->key > cl->voff + 1 || !cl->nb_fields
+        || cl->field + (unsigned long long) cl->nb_fields > c->head->nb_fields)
+      continue;
+
+    /* fields and resolved fields, the text stays in the mapping */
+    block = stats_malloc (cl->nb_fields * (sizeof (def_slice_t) + sizeof (char *)));
+    if (!block)
+      return;
+    field = (def_slice_t *) block;
+    line = &sec->data[sec->datalen];
+    memset (line, 0, sizeof (*line));
+    text = c->pool + cl->text;
+    tok = text + cl->len + 1;
+    line->text = text;
+    line->field = field;
+    line->rfield = (const char **) (field + cl->nb_fields);
+    memset (line->rfield, 0, cl->nb_fields * sizeof (char *));
+    line->nfields = cl->nb_fields;
+    line->kclass = KEY_NONE;
+    line->val.s = text + cl->voff;
+    line->val.len = cl->len - cl->voff;
+    for (j = 0; j < cl->nb_fields; j++)
+    {
+      cf = &c->field[cl->field + j];
+      field[j].s = cf->off + cf->len <= cl->len ? tok + cf->off : tok + cl->len;
+      field[j].len = cf->off + cf->len <= cl->len ? cf->len : 0;
+    }
+    if (cl->key && setKey (line, tok, cl->key - 1) < 0)
+    {
+      free (block);
+      continue;
+    }
+    sec->datalen++;
+    stats.count[COUNT_LINES]++;
+  }
+}
+
+static int
+cache_tables (def_cache_head_t *head, def_buf_t *tabs, def_buf_t *lines,
+              def_buf_t *fields, def_buf_t *pool)
+{
+  def_cache_sect_t cs;
+  def_cache_line_t cl;
+  def_cache_field_t cf;
+  def_cache_str_t cstr;
+  const def_section_t *sec;
+  const def_line_t *line;
+  const char *tok;
+  unsigned int i, j, k;
+
+  /* sections first, their lines and fields follow in separate tables */
+  for (i = 0; i < nb_sections; i++)
+  {
+    sec = sections[i];
+    cs.name = pool->len;
+    cs.name_len = strlen (sec->name);
+    cs.line = head->nb_lines;
+    cs.nb_lines = sec->datalen;
+    /* the install is not slowed down by the sections it does not use */
+    cs.raw = !sec->loaded;
+    cs.start = cs.raw ? sec->start : 0;
+    cs.end = cs.raw ? sec->end : 0;
+    cs.pad = 0;
+    if (buf_put (pool, sec->name, cs.name_len + 1) < 0
+        || buf_put (tabs, (const char *) &cs, sizeof (cs)) < 0)
+      return -1;
+
+    for (j = 0; j < sec->datalen; j++, head->nb_lines++)
+    {
+      line = &sec->data[j];
+      tok = line->val.s + line->val.len + 1;
+      cl.text = pool->len;
+      cl.voff = line->val.s - line->text;
+      cl.len = cl.voff + line->val.len;
+      cl.key = line->key.s ? line->key.len + 1 : 0;
+      cl.field = head->nb_fields;
+      cl.nb_fields = line->nfields;
+      /* text and its split copy are contiguous */
+      if (buf_put (pool, line->text, 2 * (cl.len + 1)) < 0
+          || buf_put (lines, (const char *) &cl, sizeof (cl)) < 0)
+        return -1;
+      for (k = 0; k < line->nfields; k++, head->nb_fields++)
+      {
+        cf.off = line->field[k].s - tok;
+        cf.len = line->field[k].len;
+        if (buf_put (fields, (const char *) &cf, sizeof (cf)) < 0)
+          return -1;
+      }
+    }
+  }
+  if (buf_put (tabs, lines->data, lines->len) < 0
+      || buf_put (tabs, fields->data, fields->len) < 0)
+    return -1;
+
+  for (i = 0; i < strings.nb; i++)
+  {
+    cstr.key = pool->len;
+    if (buf_put (pool, strings.tab[i].key, strlen (strings.tab[i].key) + 1) < 0)
+      return -1;
+    cstr.val = pool->len;
+    if (buf_put (pool, strings.tab[i].val, strlen (strings.tab[i].val) + 1) < 0
+        || buf_put (tabs, (const char *) &cstr, sizeof (cstr)) < 0)
+      return -1;
+  }
+  head->nb_strings = strings.nb;
+  head->pool_size = pool->len;
+  return 1;
+}
+
+static int
+cache_build (def_buf_t *b)
+{
+  def_buf_t tabs = { 0 }, lines = { 0 }, fields = { 0 }, pool = { 0 };
+  def_cache_head_t head;
+  int res;
+
+  memset (&head, 0, sizeof (head));
+  memcpy (head.magic, CACHE_MAGIC, sizeof (head.magic));
+  head.version = CACHE_VERSION;
+  head.order = CACHE_ORDER;
+  head.inf_size = inf_size;
+  head.inf_hash = hash_data (HASH_INIT, inf_text, inf_size);
+  head.nb_sections = nb_sections;
+
+  res = cache_tables (&head, &tabs, &lines, &fields, &pool);
+  if (res > 0 && (buf_put (b, (const char *) &head, sizeof (head)) < 0
+                  || buf_put (b, tabs.data, tabs.len) < 0
+                  || buf_put (b, pool.data, pool.len) < 0))
+    res = -1;
+  buf_free (&tabs);
+  buf_free (&lines);
+  buf_free (&fields);
+  buf_free (&pool);
+  return res;
+}
+
+/*
+ * Others
+ * ------
+ * - regex       : regular expressions
+ * - loadSection : split a section into lines on first use
+ * - getSection  : get a section pointer
+ * - unisort_cmp : order of unisort
+ * - unisort     : sort and unify a list
+ * - usage       : help
+ *
+ */
+
+static int
+regex (const char *str_request, const char *str_regex,
+       char rmatch[][STRBUFFER], int icase)
+{
+  int match, res = 0;
+  size_t i, nmatch, size;
+  regex_t preg;
+  regmatch_t pmatch[OVECCOUNT];
+
+  stats.count[COUNT_REGEX]++;
+  if (regcomp (&preg, str_regex,
+               icase ? REG_EXTENDED | REG_ICASE : REG_EXTENDED) == 0)
+  {
+    nmatch = preg.re_nsub;
+    match = regexec (&preg, str_request, OVECCOUNT, pmatch, 0);
+    regfree (&preg);
+    if (match == 0)
+    {
+      /* captures are copied, cut to the size of rmatch */
+      for (i = 0; i <= nmatch && i < OVECCOUNT; i++)
+      {
+        size = 0;
+        if (pmatch[i].rm_so >= 0)
+        {
+          size = pmatch[i].rm_eo - pmatch[i].rm_so;
+          if (size > STRBUFFER - 1)
+            size = STRBUFFER - 1;
+          memcpy (rmatch[i], str_request + pmatch[i].rm_so, size);
+        }
+        rmatch[i][size] = '\0';
+      }
+      res = 1;
+    }
+  }
+  if (!res)
+    rmatch[0][0] = '\0';
+  return res;
+}
+
+static void
+loadSection (def_section_t *sec)
+{
+  char s[STRBUFFER];
+  const char *line, *eol, *end;
+  size_t len;
+  unsigned int n = 1;
+
+  sec->loaded = 1;
+  stats.count[COUNT_LOADED]++;
+  if (sec->cached)
+  {
+    cache_lines (sec);
+    return;
+  }
+
+  line = inf_text + sec->start;
+  end = inf_text + sec->end;
+  for (eol = line; (eol = memchr (eol, '\n', end - eol)); eol++)
+    n++;
+  sec->data = stats_malloc (n * sizeof (def_line_t));
+  if (!sec->data)
+    return;
+
+  for (; line < end; line = eol + 1)
+  {
+    eol = memchr (line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    len = eol - line;
+    if (len > sizeof (s) - 1)
+      len = sizeof (s) - 1;
+    memcpy (s, line, len);
+    s[len] = '\0';
+
+    len = trimn (s, remCommentn (s, len));
+    if (len && !tokenize (&sec->data[sec->datalen], s, len))
+    {
+      sec->datalen++;
+      stats.count[COUNT_LINES]++;
+    }
+  }
+}
+
+static def_section_t *
+getSection (const char *needle)
+{
+  def_atom_t *atom;
+  def_section_t *sec;
+
+  stats.count[COUNT_GETSECTION]++;
+  atom = atom_lookup (&inf_atoms, needle, strlen (needle), ATOM_FOLD);
+  sec = atom ? atom->section : NULL;
+  if (!sec)
+    trace_mark ("getSection", needle);
+  else if (!sec->loaded)
+  {
+    trace_begin ("getSection", needle);
+    loadSection (sec);
+    trace_end ("getSection");
+  }
+  return sec;
+}
+
+static int
+unisort_cmp (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+static void
+unisort (def_strlist_t *l)
+{
+  unsigned int i, n;
+
+  qsort (l->tab, l->nb, sizeof (char *), unisort_cmp);
+  for (i = 0, n = 0; i < l->nb; i++)
+  {
+    if (n && !strcmp (l->tab[n - 1], l->tab[i]))
+      free (l->tab[i]);
+    else
+      l->tab[n++] = l->tab[i];
+  }
+  l->nb = n;
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: ndiswrapper OPTION [-o]\n\n");
+  printf ("Manage ndis drivers for ndiswrapper.\n");
+  printf ("-i inffile    Install driver described by 'inffile'\n");
+  printf ("              (or by the first INF of a .zip or .cab archive)\n");
+  printf ("-u inffile    Update an installed driver, only writing the files\n");
+  printf ("              which changed\n");
+  printf ("  Optionally with:\n");
+  printf ("  -a          Use alternate output format\n");
+  printf ("  --tar=file  Write the installed files as a tar archive\n");
+  printf ("  --cpio=file Write the installed files as a cpio (newc) archive\n");
+  printf ("              ('-' writes the archive to stdout)\n");
+  printf ("  --present   Only for the PCI and USB devices of this box\n");
+  printf ("  --sysfs=dir Same, reading the devices under 'dir' (not /sys)\n");
+  printf ("  --compact   One conf per install section and a sorted ID map\n");
+  printf ("              ('idmap') instead of one conf per device ID\n");
+/*
+  printf ("-d devid driver   Use installed 'driver' for 'devid'\n");
+*/
+  printf ("-e driver     Remove 'driver'\n");
+  printf ("-s dir id..   Find the INF files under 'dir' supporting the\n");
+  printf ("              device IDs 'id' (VVVV:DDDD[:SSSS:SSSS])\n");
+  printf ("-q id..       Find the installed confs of the device IDs 'id'\n");
+  printf ("-l            List installed drivers\n");
+  printf ("-c [driver]   Verify the files of 'driver', or of all the installed\n");
+  printf ("              drivers, against their manifest\n");
+  printf ("-D socket     Serve -i, -u, -e, -q, -l and -c requests on a Unix socket\n");
+  printf ("-C socket ... Send a request to the daemon, ie. -C socket -q id\n");
+/*
+  printf ("-m            Write configuration for modprobe\n");
+  printf ("-da           Write module alias configuration for all devices\n");
+  printf ("-di           Write module install configuration for all devices\n");
+  printf ("-v            Report version information\n");
+  printf ("\n\nwhere 'devid' is either PCIID or USBID of the form XXXX:XXXX\n");
+*/
+  printf ("\nOptional:\n");
+  printf ("-o output_dir   Use alternate install directory 'output_dir'\n");
+  printf ("                (default: '/etc/ndiswrapper')\n");
+  printf ("--io-uring      Create the installed files in batches with io_uring\n");
+  printf ("                (Linux, plain system calls when unavailable)\n");
+  printf ("--jobs=N        Copy the driver files with N background workers\n");
+  printf ("                (default: 2, 0 copies them while parsing)\n");
+  printf ("--no-cache      Neither read nor write the parse cache of INF files\n");
+  printf ("                (<driver>.inf.cache, next to the installed INF)\n");
+  printf ("--rules=file    Add parameter fix-ups, 'Param|Value=NewValue' per line\n");
+  printf ("                ('*' matches any value)\n");
+  printf ("--stats[=json]  Report timings and counters on stderr\n");
+  printf ("                (default format: text)\n");
+  printf ("--trace=file    Write a timeline of the install to 'file'\n");
+  printf ("                (Chrome trace JSON, for chrome://tracing)\n");
+}
+
+/*
+ * Archives
+ * --------
+ * - arc_u16     : little endian 16 bits value
+ * - arc_u32     : little endian 32 bits value
+ * - arc_add     : append a member to the archive index
+ * - arc_zip     : index the central directory of a zip archive
+ * - arc_cab     : index the folders and files of a cabinet
+ * - arc_close   : forget the package archive
+ * - arc_open    : index a package archive (0 if not an archive)
+ * - arc_find    : find a member case-insensitively
+ * - arc_lookup  : real name of a file or directory of the archive
+ * - arc_inflate : inflate a raw deflate stream
+ * - arc_folder  : uncompress a folder of a cabinet
+ * - arc_read    : uncompressed content of a member
+ *
+ * A driver archive (.zip, or .cab with MSZIP or stored folders) is read
+ * in place : the INF and the copied files are uncompressed in memory,
+ * names are relative to the directory of the INF, like in a package
+ * directory.
+ *
+ */
+
+static inline unsigned int
+arc_u16 (const char *p)
+{
+  const unsigned char *u = (const unsigned char *) p;
+
+  return u[0] | u[1] << 8;
+}
+
+static inline unsigned long
+arc_u32 (const char *p)
+{
+  const unsigned char *u = (const unsigned char *) p;
+
+  return u[0] | u[1] << 8 | u[2] << 16 | (unsigned long) u[3] << 24;
+}
+
+static def_member_t *
+arc_add (const char *name, size_t len)
+{
+  def_member_t *m;
+  size_t i;
+
+  /* a member every 64, the index is built once */
+  if (!(arc.nb_members % 64))
+  {
+    m = stats_realloc (arc.member, (arc.nb_members + 64) * sizeof (def_member_t));
+    if (!m)
+      return NULL;
+    arc.member = m;
+  }
+  m = &arc.member[arc.nb_members];
+  memset (m, 0, sizeof (*m));
+  if (!(m->name = stats_strndup (name, len)))
+    return NULL;
+  for (i = 0; i < len; i++)
+    if (m->name[i] == '\\')
+      m->name[i] = '/';
+  arc.nb_members++;
+  return m;
+}
+
+static int
+arc_zip (void)
+{
+  const char *p, *end = arc.map + arc.size, *eocd = NULL;
+  unsigned long nb, off, len;
+  unsigned int n, e, c, i;
+  def_member_t *m;
+
+  /* the end record is followed by a comment of up to 64KB */
+  if (arc.size < 22)
+    return -1;
+  for (off = arc.size - 22; ; off--)
+  {
+    if (arc_u32 (arc.map + off) == ZIP_EOCD)
+    {
+      eocd = arc.map + off;
+      break;
+    }
+    if (!off || arc.size - off >= 22 + 0xFFFF)
+      break;
+  }
+  if (!eocd)
+    return -1;
+
+  nb = arc_u16 (eocd + 10);
+  len = arc_u32 (eocd + 12);
+  off = arc_u32 (eocd + 16);
+  if (nb == 0xFFFF || off == 0xFFFFFFFF)
+  {
+    printf ("zip64 archives are not supported\n");
+    return -1;
+  }
+  if (off > arc.size || len > arc.size - off)
+    return -1;
+
+  for (p = arc.map + off, i = 0; i < nb; i++, p += 46 + n + e + c)
+  {
+    if (end - p < 46 || arc_u32 (p) != ZIP_CENTRAL)
+      return -1;
+    n = arc_u16 (p + 28);
+    e = arc_u16 (p + 30);
+    c = arc_u16 (p + 32);
+    if ((size_t) (end - p) < 46 + n + e + c)
+      return -1;
+    /* directories are implied by the names */
+    if (!n || p[46 + n - 1] == '/')
+      continue;
+    if (!(m = arc_add (p + 46, n)))
+      return -1;
+    m->method = arc_u16 (p + 10);
+    m->crc = arc_u32 (p + 16);
+    m->csize = arc_u32 (p + 20);
+    m->size = arc_u32 (p + 24);
+    m->offset = arc_u32 (p + 42);
+  }
+  return 1;
+}
+
+static int
+arc_cab (void)
+{
+  const char *p, *end = arc.map + arc.size, *nul;
+  unsigned int nb_files, flags, freserve = 0, i;
+  unsigned long off, hsize = 36;
+  def_member_t *m;
+
+  if (arc.size < 36 || memcmp (arc.map, CAB_MAGIC, 4))
+    return -1;
+  off = arc_u32 (arc.map + 16);
+  arc.nb_folders = arc_u16 (arc.map + 26);
+  nb_files = arc_u16 (arc.map + 28);
+  flags = arc_u16 (arc.map + 30);
+  /* the previous and next cabinets of a set */
+  if (flags & 0x0003)
+  {
+    printf ("Multi-cabinet sets are not supported\n");
+    return -1;
+  }
+  if (flags & 0x0004)
+  {
+    if (arc.size < 40)
+      return -1;
+    hsize = 40 + arc_u16 (arc.map + 36);
+    freserve = (unsigned char) arc.map[38];
+    arc.reserve = (unsigned char) arc.map[39];
+  }
+
+  if (!(arc.folder = stats_calloc (arc.nb_folders + 1, sizeof (def_folder_t)))
+      || hsize + arc.nb_folders * (8 + freserve) > arc.size)
+    return -1;
+  for (p = arc.map + hsize, i = 0; i < arc.nb_folders; i++, p += 8 + freserve)
+  {
+    arc.folder[i].offset = arc_u32 (p);
+    arc.folder[i].nb_blocks = arc_u16 (p + 4);
+    arc.folder[i].type = arc_u16 (p + 6) & 0x000F;
+  }
+
+  if (off > arc.size)
+    return -1;
+  for (p = arc.map + off, i = 0; i < nb_files; i++, p = nul + 1)
+  {
+    /* size, offset, folder, date, time, attributes and name */
+    if (end - p < 17 || !(nul = memchr (p + 16, '\0', end - p - 16)))
+      return -1;
+    /* the files continued from or to another cabinet use special folders */
+    if (arc_u16 (p + 8) >= arc.nb_folders)
+    {
+      printf ("Files spanning cabinets are not supported\n");
+      return -1;
+    }
+    if (!(m = arc_add (p + 16, nul - p - 16)))
+      return -1;
+    m->size = arc_u32 (p);
+    m->offset = arc_u32 (p + 4);
+    m->folder = arc_u16 (p + 8);
+  }
+  return 1;
+}
+
+static void
+arc_close (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < arc.nb_members; i++)
+    free (arc.member[i].name);
+  free (arc.member);
+  for (i = 0; arc.folder && i < arc.nb_folders; i++)
+    free (arc.folder[i].data);
+  free (arc.folder);
+  my_munmap (arc.map, arc.size);
+  memset (&arc, 0, sizeof (arc));
+}
+
+static int
+arc_open (const char *path)
+{
+  const char *ext = strrchr (path, '.');
+  const char *inf;
+  char *slash;
+  unsigned int i;
+  size_t len;
+  int res;
+
+  if (!ext || (strcasecmp (ext, ".zip") && strcasecmp (ext, ".cab")))
+    return 0;
+
+  arc.map = my_mmap (AT_FDCWD, path, &arc.size);
+  res = !arc.map ? -1 : strcasecmp (ext, ".zip") ? arc_cab () : arc_zip ();
+  if (res < 0)
+  {
+    printf ("Unable to read the archive %s\n", path);
+    arc_close ();
+    return -1;
+  }
+
+  /* the first INF of the archive describes the driver */
+  for (i = 0; i < arc.nb_members; i++)
+  {
+    inf = arc.member[i].name;
+    len = strlen (inf);
+    if (len > 4 && !strcasecmp (inf + len - 4, ".inf"))
+      break;
+  }
+  if (i == arc.nb_members)
+  {
+    printf ("No INF file in %s\n", path);
+    arc_close ();
+    return -1;
+  }
+
+  snprintf (arc.base, sizeof (arc.base), "%s", inf);
+  slash = strrchr (arc.base, '/');
+  *(slash ? slash : arc.base) = '\0';
+  snprintf (arc.inf, sizeof (arc.inf), "%s/%s", path, inf);
+  return 1;
+}
+
+static def_member_t *
+arc_find (const char *name)
+{
+  char path[PATH_MAX];
+  unsigned int i;
+
+  snprintf (path, sizeof (path), "%s%s%s",
+            arc.base, arc.base[0] ? "/" : "", name);
+  for (i = 0; i < arc.nb_members; i++)
+    if (!strcasecmp (arc.member[i].name, path))
+      return &arc.member[i];
+  return NULL;
+}
+
+static int
+arc_lookup (const char *dir, char *file)
+{
+  char path[PATH_MAX];
+  const char *name;
+  unsigned int i;
+  size_t len, flen = strlen (file);
+
+  len = snprintf (path, sizeof (path), "%s%s%s%s%s", arc.base,
+                  arc.base[0] ? "/" : "", dir, dir[0] ? "/" : "", file);
+  for (i = 0; i < arc.nb_members && len < sizeof (path); i++)
+  {
+    name = arc.member[i].name;
+    /* a member, or a directory holding members */
+    if (!strncasecmp (name, path, len)
+        && (name[len] == '\0' || name[len] == '/'))
+    {
+      memcpy (file, name + len - flen, flen);
+      return 1;
+    }
+  }
+  file[0] = '\0';
+  return -1;
+}
+
+static int
+arc_inflate (const char *dict, size_t dlen, const char *in, size_t inlen,
+             char *out, size_t outlen)
+{
+#ifdef HAVE_ZLIB
+  z_stream zs;
+  int res;
+
+  /* raw deflate data, no zlib header */
+  memset (&zs, 0, sizeof (zs));
+  if (inflateInit2 (&zs, -MAX_WBITS) != Z_OK)
+    return -1;
+  res = dlen ? inflateSetDictionary (&zs, (const Bytef *) dict, dlen) : Z_OK;
+  zs.next_in = (Bytef *) in;
+  zs.avail_in = inlen;
+  zs.next_out = (Bytef *) out;
+  zs.avail_out = outlen;
+  if (res == Z_OK)
+    res = inflate (&zs, Z_FINISH);
+  inflateEnd (&zs);
+  return res == Z_STREAM_END && zs.total_out == outlen ? 1 : -1;
+#else /* HAVE_ZLIB */
+  (void) dict;
+  (void) dlen;
+  (void) in;
+  (void) inlen;
+  (void) out;
+  (void) outlen;
+  printf ("Deflated members need zlib, not built in\n");
+  return -1;
+#endif /* !HAVE_ZLIB */
+}
+
+static int
+arc_folder (def_folder_t *f)
+{
+  const char *p, *end = arc.map + arc.size;
+  unsigned int i, clen, ulen, hist;
+  size_t size = 0;
+
+  if (f->data)
+    return 1;
+  if (f->type > 1)
+  {
+    printf ("LZX and Quantum cabinets are not supported\n");
+    return -1;
+  }
+
+  /* a data block : checksum, sizes, reserved bytes and data */
+  if (f->offset > arc.size)
+    return -1;
+  for (p = arc.map + f->offset, i = 0; i < f->nb_blocks; i++)
+  {
+    if ((size_t) (end - p) < 8 + arc.reserve
+        || (size_t) (end - p) < 8 + arc.reserve + arc_u16 (p + 4))
+      return -1;
+    size += arc_u16 (p + 6);
+    p += 8 + arc.reserve + arc_u16 (p + 4);
+  }
+  if (!(f->data = stats_malloc (size + 1)))
+    return -1;
+
+  for (p = arc.map + f->offset, i = 0; i < f->nb_blocks; i++)
+  {
+    clen = arc_u16 (p + 4);
+    ulen = arc_u16 (p + 6);
+    p += 8 + arc.reserve;
+    hist = f->size < CAB_HISTORY ? f->size : CAB_HISTORY;
+    if (f->type == 0 && clen == ulen)
+      memcpy (f->data + f->size, p, ulen);
+    /* MSZIP : "CK", then a deflate stream using the previous output */
+    else if (f->type == 0 || clen < 2 || p[0] != 'C' || p[1] != 'K'
+             || arc_inflate (f->data + f->size - hist, hist, p + 2, clen - 2,
+                             f->data + f->size, ulen) < 0)
+    {
+      free (f->data);
+      f->data = NULL;
+      f->size = 0;
+      return -1;
+    }
+    f->size += ulen;
+    p += clen;
+  }
+  return 1;
+}
+
+static char *
+arc_read (const char *name, size_t *len)
+{
+  const def_member_t *m;
+  const char *p;
+  def_folder_t *f;
+  char *data;
+  int res = -1;
+
+  if (!(m = arc_find (name)))
+  {
+    printf ("Unable to open %s file read-only!\n", name);
+    return NULL;
+  }
+  if (!(data = stats_malloc (m->size + 1)))
+    return NULL;
+
+  if (arc.folder)
+  {
+    f = &arc.folder[m->folder];
+    if (arc_folder (f) > 0 && m->offset <= f->size
+        && m->size <= f->size - m->offset)
+    {
+      memcpy (data, f->data + m->offset, m->size);
+      res = 1;
+    }
+  }
+  else if (m->offset <= arc.size - 30
+           && arc_u32 (p = arc.map + m->offset) == ZIP_LOCAL
+           && 30 + arc_u16 (p + 26) + arc_u16 (p + 28) + m->csize
+              <= arc.size - m->offset)
+  {
+    p += 30 + arc_u16 (p + 26) + arc_u16 (p + 28);
+    if (m->method == 0 && m->csize == m->size)
+    {
+      memcpy (data, p, m->size);
+      res = 1;
+    }
+    else if (m->method == 8)
+      res = arc_inflate (NULL, 0, p, m->csize, data, m->size);
+#ifdef HAVE_ZLIB
+    if (res > 0 && crc32 (0, (const Bytef *) data, m->size) != m->crc)
+      res = -1;
+#endif /* HAVE_ZLIB */
+  }
+
+  if (res < 0)
+  {
+    printf ("Unable to uncompress %s\n", m->name);
+    free (data);
+    return NULL;
+  }
+  data[m->size] = '\0';
+  *len = m->size;
+  return data;
+}
+
+/*
+ * Output
+ * ------
+ * - sum_add       : record the size and CRC32C of a written file
+ * - sum_order     : order of the manifest, then order of the writes
+ * - sum_free      : forget the written files
+ * - copy_fd       : copy the content of an open file, with its CRC32C
+ * - copy          : copy file processing
+ * - copy_worker   : copy the queued files (background thread)
+ * - copy_queue    : queue the copy of a package file
+ * - copy_join     : wait for the queued copies and stop the workers
+ * - out_flush     : write the archive buffer
+ * - out_write     : buffered write to the archive stream
+ * - out_pad       : pad an archive entry to its alignment
+ * - out_header    : write a tar or cpio entry header
+ * - uring_init    : set up the io_uring backend (-1 if unavailable)
+ * - uring_sqe     : get the next submission entry of an operation
+ * - uring_complete : handle the completions available
+ * - uring_submit  : submit the queued entries
+ * - uring_reap    : handle completions until a batch is complete
+ * - uring_wait    : complete all operations in flight
+ * - uring_queue   : queue a file or a symbolic link creation
+ * - uring_copy    : queue the copy of a package file
+ * - uring_exit    : complete all operations and release the backend
+ * - out_open      : open the install output (directory or archive)
+ * - out_dirfd     : get the open directory a name is relative to
+ * - out_hashfile  : hash the content of a file
+ * - out_samefile  : test if an installed file is a copy of a file
+ * - out_samedata  : test if an installed file holds a memory content
+ * - out_mkdir     : create a directory
+ * - out_link      : give a name to an O_TMPFILE file
+ * - out_stagename : temporary name of a file, renamed over it
+ * - out_publish   : write a file in a directory atomically
+ * - out_pending_get : get the pending change of a name (update)
+ * - out_defer     : keep a file in memory until the update is complete
+ * - out_aside     : stage the copy of a changed package file (update)
+ * - out_discard   : remove the staged copies not committed (update)
+ * - out_commit    : write the kept files which changed, rename the
+ *                   staged copies, replace the links (update)
+ * - out_close     : terminate and flush the install output
+ * - out_writev    : write a file from memory chunks
+ * - out_data      : write a file from memory
+ * - out_member    : copy a member of the package archive
+ * - out_copy      : copy a file
+ * - out_symlink   : create a symbolic link
+ * - out_exists    : test if a file was already written
+ * - out_manifest  : write the manifest of the driver directory
+ * - out_prune     : remove the driver files not written (update)
+ * - out_fopen     : open a file buffered in memory
+ * - out_fclose    : close and write a file buffered in memory
+ * - alt_record    : append an entry to the alternate install list
+ *
+ * Names are relative to the configuration directory, ie "driver/file".
+ * With --io-uring, files and links of a directory install are created in
+ * batches, two batches are in flight while the INF is processed.
+ * Otherwise package files are copied by background workers while the
+ * INF is parsed (--jobs), install() waits for them before the links.
+ * The CRC32C of the files is computed as they are written, for the
+ * manifest of the driver directory (checked by -c).
+ * When updating (-u), files of the installed tree are only written if
+ * their content changed, and files no longer produced are removed.
+ *
+ */
+
+static void
+sum_add (const char *name, unsigned long long size, unsigned int crc)
+{
+  size_t len = strlen (driver_name);
+  def_sum_t *tab;
+
+  /* files of the driver directory, but the manifest itself */
+  if (strncmp (name, driver_name, len) || name[len] != '/'
+      || !strcmp (name + len + 1, MANIFEST))
+    return;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&sums_lock);
+#endif /* HAVE_PTHREAD */
+  if (nb_sums == sums_size)
+  {
+    sums_size = sums_size ? sums_size * 2 : 64;
+    tab = stats_realloc (sums, sums_size * sizeof (def_sum_t));
+    if (!tab)
+      sums_size = nb_sums;
+    else
+      sums = tab;
+  }
+  if (nb_sums < sums_size && (sums[nb_sums].name = stats_strdup (name + len + 1)))
+  {
+    sums[nb_sums].size = size;
+    sums[nb_sums].crc = crc;
+    sums[nb_sums].seq = nb_sums;
+    nb_sums++;
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&sums_lock);
+#endif /* HAVE_PTHREAD */
+}
+
+static int
+sum_order (const void *a, const void *b)
+{
+  const def_sum_t *s1 = a;
+  const def_sum_t *s2 = b;
+  int res = strcmp (s1->name, s2->name);
+
+  if (res)
+    return res;
+  return s1->seq < s2->seq ? -1 : s1->seq > s2->seq;
+}
+
+static void
+sum_free (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < nb_sums; i++)
+    free (sums[i].name);
+  free (sums);
+  sums = NULL;
+  nb_sums = 0;
+  sums_size = 0;
+}
+
+static int
+copy_fd (int infile, int outfile, unsigned long long *bytes,
+         unsigned int *crc)
+{
+  char rwbuf[64 * 1024];
+  ssize_t nbytes, n, done;
+
+  while ((nbytes = read (infile, rwbuf, sizeof (rwbuf))) > 0)
+    for (*crc = crc32c (*crc, rwbuf, nbytes), done = 0; done < nbytes;
+         done += n)
+    {
+      n = write (outfile, rwbuf + done, nbytes - done);
+      if (n <= 0)
+        return -1;
+      *bytes += n;
+    }
+  return nbytes < 0 ? -1 : 1;
+}
+
+static int
+copy (int sfd, const char *file_src, int dfd, const char *file_dst, int mod,
+      const char *name)
+{
+  int infile = 0;
+  int outfile = 1;
+  int res;
+  unsigned int crc = 0;
+  unsigned long long t, bytes = 0;
+
+  t = stats_start ();
+  trace_begin ("copy", file_src);
+  if ((infile = my_openat (sfd, file_src, O_RDONLY | O_BINARY, 0)) == -1)
+  {
+    printf ("Unable to open %s file read-only!\n", file_src);
+    copy_errors++;
+    trace_end ("copy");
+    stats_stop (PHASE_COPY, t);
+    return -1;
+  }
+
+  if ((outfile = my_openat (dfd, file_dst,
+                            O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                            mod)) == -1)
+  {
+    printf ("Unable to open %s file for create/write/appending!\n", file_dst);
+    copy_errors++;
+    close (infile);
+    trace_end ("copy");
+    stats_stop (PHASE_COPY, t);
+    return -1;
+  }
+
+  if ((res = copy_fd (infile, outfile, &bytes, &crc)) < 0)
+  {
+    printf ("Unable to write %s file!\n", file_dst);
+    copy_errors++;
+  }
+  else
+  {
+    sum_add (name, bytes, crc);
+    stats.count[COUNT_FILES]++;
+  }
+  stats.count[COUNT_BYTES] += bytes;
+
+  close (infile);
+  close (outfile);
+  trace_end ("copy");
+  stats_stop (PHASE_COPY, t);
+  return res;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+copy_worker (void *arg)
+{
+  def_copyjob_t job;
+  unsigned long long t, bytes;
+  unsigned int crc;
+  int outfile, res;
+
+  (void) arg;
+  pthread_mutex_lock (&copyq.lock);
+  for (;;)
+  {
+    while (!copyq.nb && !copyq.closed)
+      pthread_cond_wait (&copyq.ready, &copyq.lock);
+    /* closed, and nothing left to copy */
+    if (!copyq.nb)
+      break;
+    job = copyq.jobs[copyq.head];
+    copyq.head = (copyq.head + 1) % COPY_QUEUE;
+    copyq.nb--;
+    pthread_cond_signal (&copyq.room);
+    pthread_mutex_unlock (&copyq.lock);
+
+    t = stats_start ();
+    trace_begin ("copy", job.dst);
+    bytes = 0;
+    crc = 0;
+    res = -1;
+    if ((outfile = my_openat (job.dfd, job.dst,
+                              O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                              job.mod)) == -1)
+      printf ("Unable to open %s file for create/write/appending!\n",
+              job.dst);
+    else
+    {
+      if ((res = copy_fd (job.src, outfile, &bytes, &crc)) < 0)
+        printf ("Unable to write %s file!\n", job.dst);
+      else
+        sum_add (job.name, bytes, crc);
+      close (outfile);
+    }
+    close (job.src);
+    trace_end ("copy");
+
+    /* the statistics are shared with the parser */
+    pthread_mutex_lock (&copyq.lock);
+    if (res < 0)
+      copy_errors++;
+    else
+      stats.count[COUNT_FILES]++;
+    stats.count[COUNT_BYTES] += bytes;
+    stats_stop (PHASE_COPY, t);
+  }
+  pthread_mutex_unlock (&copyq.lock);
+  trace_release ();
+  return NULL;
+}
+
+static int
+copy_queue (const char *src, int dfd, const char *name, const char *rel,
+            int mod)
+{
+  def_copyjob_t *job;
+  int infile;
+
+  if ((infile = my_openat (pkg_fd, src, O_RDONLY | O_BINARY, 0)) == -1)
+  {
+    printf ("Unable to open %s file read-only!\n", src);
+    return -1;
+  }
+  /* the file is read ahead while the job waits for a worker */
+  posix_fadvise (infile, 0, 0, POSIX_FADV_WILLNEED);
+
+  pthread_mutex_lock (&copyq.lock);
+  /* workers are started with the first job of an install */
+  while (copyq.nb_workers < copy_jobs && copyq.nb_workers < COPY_WORKERS)
+  {
+    if (pthread_create (&copyq.workers[copyq.nb_workers], NULL,
+                        copy_worker, NULL) != 0)
+    {
+      copy_jobs = copyq.nb_workers;
+      break;
+    }
+    copyq.nb_workers++;
+  }
+  if (!copyq.nb_workers)
+  {
+    pthread_mutex_unlock (&copyq.lock);
+    close (infile);
+    return copy (pkg_fd, src, dfd, rel, mod, name);
+  }
+
+  while (copyq.nb == COPY_QUEUE)
+    pthread_cond_wait (&copyq.room, &copyq.lock);
+  job = &copyq.jobs[(copyq.head + copyq.nb) % COPY_QUEUE];
+  job->src = infile;
+  job->dfd = dfd;
+  snprintf (job->name, sizeof (job->name), "%s", name);
+  snprintf (job->dst, sizeof (job->dst), "%s", rel);
+  job->mod = mod;
+  copyq.nb++;
+  pthread_cond_signal (&copyq.ready);
+  pthread_mutex_unlock (&copyq.lock);
+  return 1;
+}
+#endif /* HAVE_PTHREAD */
+
+static int
+copy_join (void)
+{
+  int res;
+#ifdef HAVE_PTHREAD
+  unsigned int i;
+
+  if (copyq.nb_workers)
+  {
+    pthread_mutex_lock (&copyq.lock);
+    copyq.closed = 1;
+    pthread_cond_broadcast (&copyq.ready);
+    pthread_mutex_unlock (&copyq.lock);
+    for (i = 0; i < copyq.nb_workers; i++)
+      pthread_join (copyq.workers[i], NULL);
+    copyq.nb_workers = 0;
+    copyq.closed = 0;
+  }
+#endif /* HAVE_PTHREAD */
+
+  /* a failed copy, in a worker or not, fails the install */
+  res = copy_errors ? -1 : 1;
+  copy_errors = 0;
+  return res;
+}
+
+static int
+out_flush (void)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < out_len)
+  {
+    n = write (out_fd, out_buf + done, out_len - done);
+    if (n <= 0)
+    {
+      printf ("Unable to write to %s\n", out_name);
+      return -1;
+    }
+    done += n;
+  }
+  out_len = 0;
+  return 1;
+}
+
+static int
+out_write (const void *data, size_t len)
+{
+  size_t n;
+
+  while (len > 0)
+  {
+    if (out_len == OUTBUFFER && out_flush () < 0)
+      return -1;
+    n = OUTBUFFER - out_len;
+    if (n > len)
+      n = len;
+    memcpy (out_buf + out_len, data, n);
+    out_len += n;
+    data = (const char *) data + n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int
+out_pad (unsigned long size, unsigned int align)
+{
+  static const char zero[TARBLOCK];
+  unsigned int pad;
+
+  pad = (align - size % align) % align;
+  return pad ? out_write (zero, pad) : 1;
+}
+
+static int
+out_header (const char *name, unsigned int mode,
+            unsigned long size, const char *link)
+{
+  char hdr[TARBLOCK];
+  const char *base = name;
+  unsigned int i, sum = 0;
+  size_t len;
+
+  len = strlen (name);
+  if (out_format == OUT_CPIO)
+  {
+    snprintf (hdr, sizeof (hdr), "070701%08lX%08X%08X%08X%08X%08lX%08lX"
+              "%08X%08X%08X%08X%08lX%08X", ++out_ino, mode, 0, 0,
+              S_ISDIR (mode) ? 2 : 1, out_mtime, size, 0, 0, 0, 0,
+              (unsigned long) len + 1, 0);
+    if (out_write (hdr, 110) < 0 || out_write (name, len + 1) < 0)
+      return -1;
+    return out_pad (110 + len + 1, 4);
+  }
+
+  /* ustar : split long names between the prefix and the name fields */
+  memset (hdr, 0, sizeof (hdr));
+  if (len > 100)
+  {
+    for (base = name + len - 100; *base && *base != '/'; base++)
+      ;
+    if (!*base || base - name > 155)
+    {
+      printf ("File name too long for tar: %s\n", name);
+      return -1;
+    }
+    memcpy (hdr + 345, name, base - name);
+    base++;
+  }
+  memcpy (hdr, base, strlen (base));
+  snprintf (hdr + 100, 8, "%07o", mode & 07777);
+  snprintf (hdr + 108, 8, "%07o", 0);
+  snprintf (hdr + 116, 8, "%07o", 0);
+  snprintf (hdr + 124, 12, "%011lo", size);
+  snprintf (hdr + 136, 12, "%011lo", out_mtime);
+  memset (hdr + 148, ' ', 8);
+  hdr[156] = S_ISDIR (mode) ? '5' : link ? '2' : '0';
+  if (link)
+    strncpy (hdr + 157, link, 100);
+  memcpy (hdr + 257, "ustar", 6);
+  memcpy (hdr + 263, "00", 2);
+  strcpy (hdr + 265, "root");
+  strcpy (hdr + 297, "root");
+  for (i = 0; i < sizeof (hdr); i++)
+    sum += (unsigned char) hdr[i];
+  snprintf (hdr + 148, 8, "%06o", sum);
+  return out_write (hdr, sizeof (hdr));
+}
+
+#ifdef HAVE_IO_URING
+static int
+uring_init (void)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  static const int ops[] = {
+    IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_SYMLINKAT
+  };
+  int files[URING_SLOTS];
+  unsigned int i;
+  int ok = 1;
+
+  memset (&p, 0, sizeof (p));
+  uring.fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (uring.fd < 0)
+  {
+    uring.fd = -1;
+    return -1;
+  }
+
+  /* every operation must be known by the kernel */
+  probe = stats_calloc (1, sizeof (*probe) + IORING_OP_LAST * sizeof (probe->ops[0]));
+  if (!probe || syscall (__NR_io_uring_register, uring.fd,
+                         IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+    ok = 0;
+  for (i = 0; ok && i < sizeof (ops) / sizeof (ops[0]); i++)
+    if (ops[i] > probe->last_op
+        || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      ok = 0;
+  free (probe);
+
+  /* sparse table of direct descriptors, one per operation slot */
+  for (i = 0; i < URING_SLOTS; i++)
+    files[i] = -1;
+  if (ok && syscall (__NR_io_uring_register, uring.fd,
+                     IORING_REGISTER_FILES, files, URING_SLOTS) < 0)
+    ok = 0;
+
+  if (ok)
+  {
+    uring.sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    uring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && uring.cq_size > uring.sq_size)
+      uring.sq_size = uring.cq_size;
+    uring.sq_ring = mmap (NULL, uring.sq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring.fd,
+                          IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      uring.cq_ring = uring.sq_ring;
+    else
+      uring.cq_ring = mmap (NULL, uring.cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, uring.fd,
+                            IORING_OFF_CQ_RING);
+    uring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring.fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED
+        || uring.sqes == MAP_FAILED)
+      ok = 0;
+  }
+
+  if (!ok)
+  {
+    /* the rings are released with the file descriptor */
+    close (uring.fd);
+    uring.fd = -1;
+    return -1;
+  }
+
+  uring.sq_tail = (unsigned int *) ((char *) uring.sq_ring + p.sq_off.tail);
+  uring.sq_mask = (unsigned int *) ((char *) uring.sq_ring + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned int *) ((char *) uring.sq_ring + p.sq_off.array);
+  uring.cq_head = (unsigned int *) ((char *) uring.cq_ring + p.cq_off.head);
+  uring.cq_tail = (unsigned int *) ((char *) uring.cq_ring + p.cq_off.tail);
+  uring.cq_mask = (unsigned int *) ((char *) uring.cq_ring + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) ((char *) uring.cq_ring + p.cq_off.cqes);
+  uring.tail = *uring.sq_tail;
+  uring.sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  uring.queued = 0;
+  uring.half = 0;
+  uring.nb_op = 0;
+  uring.inflight[0] = 0;
+  uring.inflight[1] = 0;
+  uring.res = 1;
+  return 1;
+}
+
+static struct io_uring_sqe *
+uring_sqe (unsigned int slot, unsigned int step, int op)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  idx = uring.tail & *uring.sq_mask;
+  sqe = &uring.sqes[idx];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = op;
+  sqe->user_data = slot << 2 | step;
+  uring.sq_array[idx] = idx;
+  uring.tail++;
+  uring.queued++;
+  uring.inflight[slot / URING_BATCH]++;
+  return sqe;
+}
+
+static unsigned int
+uring_complete (void)
+{
+  struct io_uring_cqe *cqe;
+  def_uring_op_t *op;
+  unsigned int head, slot, step, n = 0;
+
+  for (head = *uring.cq_head;
+       head != __atomic_load_n (uring.cq_tail, __ATOMIC_ACQUIRE); head++, n++)
+  {
+    cqe = &uring.cqes[head & *uring.cq_mask];
+    slot = cqe->user_data >> 2;
+    step = cqe->user_data & 3;
+    op = &uring.op[slot];
+    /* a failed step cancels the next ones of the same file */
+    if ((cqe->res < 0 && cqe->res != -ECANCELED)
+        || (step == 1 && (size_t) cqe->res != op->len))
+    {
+      printf ("Unable to create file %s\n", op->name);
+      uring.res = -1;
+    }
+    uring.inflight[slot / URING_BATCH]--;
+    __atomic_store_n (uring.cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static int
+uring_submit (void)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int retries = 0;
+  int n;
+
+  __atomic_store_n (uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+  while (uring.queued > 0)
+  {
+    n = syscall (__NR_io_uring_enter, uring.fd, uring.queued, 0, 0, NULL, 0);
+    stats.count[COUNT_SUBMITS]++;
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;
+    if (n > 0)
+    {
+      uring.queued -= n;
+      retries = 0;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (++retries > URING_RETRIES)
+      break;
+    /* the kernel takes more entries once completions are reaped */
+    if (!uring_complete ()
+        && uring.inflight[0] + uring.inflight[1] > uring.queued)
+      syscall (__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS,
+               NULL, 0);
+  }
+  if (!uring.queued)
+    return 1;
+
+  /* the entries not taken are withdrawn, their files are not written */
+  printf ("Unable to submit %u io_uring operations\n", uring.queued);
+  for (; uring.queued > 0; uring.queued--)
+  {
+    sqe = &uring.sqes[--uring.tail & *uring.sq_mask];
+    uring.inflight[(sqe->user_data >> 2) / URING_BATCH]--;
+  }
+  __atomic_store_n (uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+  uring.res = -1;
+  return -1;
+}
+
+static void
+uring_reap (unsigned int half)
+{
+  unsigned int i;
+
+  /* wait until the batch is complete, handling any completion */
+  while (uring.inflight[half] > 0)
+    if (!uring_complete ()
+        && syscall (__NR_io_uring_enter, uring.fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      break;
+
+  for (i = half * URING_BATCH; i < (half + 1) * URING_BATCH; i++)
+  {
+    free (uring.op[i].data);
+    uring.op[i].data = NULL;
+  }
+}
+
+static int
+uring_wait (void)
+{
+  if (uring_submit () < 0)
+    return -1;
+  uring_reap (0);
+  uring_reap (1);
+  return uring.res;
+}
+
+static int
+uring_queue (int dfd, const char *name, const char *rel,
+             const struct iovec *iov, int iovcnt, int mod, int symlink)
+{
+  struct io_uring_sqe *sqe;
+  def_uring_op_t *op;
+  unsigned int slot;
+  size_t len = 0;
+  int i;
+
+  slot = uring.half * URING_BATCH + uring.nb_op;
+  op = &uring.op[slot];
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  /* the data must live until the batch is complete */
+  op->data = stats_malloc (len + 1);
+  if (!op->data)
+    return -1;
+  for (op->len = 0, i = 0; i < iovcnt; i++)
+  {
+    memcpy (op->data + op->len, iov[i].iov_base, iov[i].iov_len);
+    op->len += iov[i].iov_len;
+  }
+  op->data[op->len] = '\0';
+  snprintf (op->name, sizeof (op->name), "%s", name);
+  op->rel = op->name + (rel - name);
+  op->dfd = dfd;
+  op->mod = mod;
+  op->symlink = symlink;
+
+  if (symlink)
+  {
+    sqe = uring_sqe (slot, 3, IORING_OP_SYMLINKAT);
+    sqe->fd = dfd;
+    sqe->addr = (unsigned long) op->data;
+    sqe->addr2 = (unsigned long) op->rel;
+  }
+  else
+  {
+    /* open into the direct descriptor of the slot, write it, close it */
+    sqe = uring_sqe (slot, 0, IORING_OP_OPENAT);
+    sqe->fd = dfd;
+    sqe->addr = (unsigned long) op->rel;
+    /* no O_CLOEXEC : a direct descriptor is not a file descriptor */
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = mod;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_sqe (slot, 1, IORING_OP_WRITE);
+    sqe->fd = slot;
+    sqe->addr = (unsigned long) op->data;
+    sqe->len = op->len;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    sqe = uring_sqe (slot, 2, IORING_OP_CLOSE);
+    sqe->file_index = slot + 1;
+  }
+
+  /* a full batch is submitted, the other one is reused once complete */
+  if (++uring.nb_op == URING_BATCH)
+  {
+    /* a failed submission is in uring.res, the batch is reused anyway */
+    uring_submit ();
+    uring.half ^= 1;
+    uring.nb_op = 0;
+    uring_reap (uring.half);
+  }
+  return uring.res;
+}
+
+static int
+uring_copy (const char *src, int dfd, const char *name, const char *rel,
+            int mod)
+{
+  struct iovec iov;
+  struct stat st;
+  unsigned long long t;
+  char *data = NULL;
+  ssize_t nbytes = 0;
+  size_t len = 0;
+  int infile, res = -1;
+
+  /* the source is read here, its copy is written with the batch */
+  t = stats_start ();
+  trace_begin ("copy", src);
+  infile = my_openat (pkg_fd, src, O_RDONLY | O_BINARY, 0);
+  if (infile != -1 && fstat (infile, &st) == 0
+      && (data = stats_malloc (st.st_size + 1)))
+    while (len < (size_t) st.st_size
+           && (nbytes = read (infile, data + len, st.st_size - len)) > 0)
+      len += nbytes;
+  if (infile == -1 || !data || nbytes < 0)
+    printf ("Unable to open %s file read-only!\n", src);
+  else
+  {
+    iov.iov_base = data;
+    iov.iov_len = len;
+    res = uring_queue (dfd, name, rel, &iov, 1, mod, 0);
+  }
+  /* a file not queued is neither counted nor in the manifest */
+  if (res < 0)
+    copy_errors++;
+  else
+  {
+    sum_add (name, len, crc32c (0, data, len));
+    stats.count[COUNT_FILES]++;
+    stats.count[COUNT_BYTES] += len;
+  }
+  if (infile != -1)
+    close (infile);
+  free (data);
+  trace_end ("copy");
+  stats_stop (PHASE_COPY, t);
+  return res;
+}
+
+static int
+uring_exit (void)
+{
+  int res;
+
+  if (uring.fd == -1)
+    return 1;
+  if (uring_submit () < 0)
+    uring.res = -1;
+  uring_reap (0);
+  uring_reap (1);
+  res = uring.res;
+  munmap (uring.sqes, uring.sqes_size);
+  if (uring.cq_ring != uring.sq_ring)
+    munmap (uring.cq_ring, uring.cq_size);
+  munmap (uring.sq_ring, uring.sq_size);
+  close (uring.fd);
+  uring.fd = -1;
+  return res;
+}
+#endif /* HAVE_IO_URING */
+
+static int
+out_open (void)
+{
+  const char *epoch;
+
+  if (out_format == OUT_DIR)
+  {
+#ifdef HAVE_IO_URING
+    /* an update compares before writing, it stays synchronous */
+    if (out_uring && !out_update && uring_init () < 0)
+      printf ("io_uring is not available, using plain system calls\n");
+#endif /* HAVE_IO_URING */
+    return 1;
+  }
+
+  out_buf = stats_malloc (OUTBUFFER);
+  if (!out_buf)
+    return -1;
+
+  /* reproducible archives when SOURCE_DATE_EPOCH is set */
+  epoch = getenv ("SOURCE_DATE_EPOCH");
+  out_mtime = epoch ? strtoul (epoch, NULL, 10) : (unsigned long) time (NULL);
+
+  if (!strcmp (out_name, "-"))
+  {
+    /* the archive owns stdout, messages go to stderr */
+    fflush (stdout);
+    out_fd = dup (1);
+    dup2 (2, 1);
+  }
+  else
+    out_fd = open (out_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+
+  if (out_fd == -1)
+  {
+    printf ("Unable to open %s for writing!\n", out_name);
+    return -1;
+  }
+  return 1;
+}
+
+static int
+out_dirfd (const char *name, const char **rel)
+{
+  size_t len = strlen (driver_name);
+
+  /* most names are in the driver directory */
+  if (drv_fd != -1 && !strncmp (name, driver_name, len) && name[len] == '/')
+  {
+    *rel = name + len + 1;
+    return drv_fd;
+  }
+  *rel = name;
+  return conf_fd;
+}
+
+static int
+out_hashfile (int dfd, const char *name, unsigned long long *hash,
+              unsigned int *crc)
+{
+  char rwbuf[64 * 1024];
+  int fd, nbytes;
+
+  if ((fd = my_openat (dfd, name, O_RDONLY | O_BINARY, 0)) == -1)
+    return -1;
+  *hash = HASH_INIT;
+  while ((nbytes = read (fd, rwbuf, sizeof (rwbuf))) > 0)
+  {
+    *hash = hash_data (*hash, rwbuf, nbytes);
+    if (crc)
+      *crc = crc32c (*crc, rwbuf, nbytes);
+  }
+  close (fd);
+  return nbytes < 0 ? -1 : 1;
+}
+
+static int
+out_samefile (const char *src, int dfd, const char *name, unsigned int *crc)
+{
+  unsigned long long h1, h2;
+  struct stat st1, st2;
+
+  if (my_fstatat (pkg_fd, src, &st1, 0) < 0
+      || my_fstatat (dfd, name, &st2, AT_SYMLINK_NOFOLLOW) < 0
+      || !S_ISREG (st2.st_mode) || st1.st_size != st2.st_size)
+    return 0;
+  return out_hashfile (pkg_fd, src, &h1, crc) > 0
+    && out_hashfile (dfd, name, &h2, NULL) > 0 && h1 == h2;
+}
+
+static int
+out_samedata (int dfd, const char *name, const struct iovec *iov,
+              int iovcnt, size_t len)
+{
+  unsigned long long h1 = HASH_INIT, h2;
+  struct stat st;
+  int i;
+
+  if (my_fstatat (dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0
+      || !S_ISREG (st.st_mode) || (size_t) st.st_size != len)
+    return 0;
+  for (i = 0; i < iovcnt; i++)
+    h1 = hash_data (h1, iov[i].iov_base, iov[i].iov_len);
+  return out_hashfile (dfd, name, &h2, NULL) > 0 && h1 == h2;
+}
+
+static int
+out_mkdir (const char *name)
+{
+  char path[STRBUFFER];
+  const char *rel;
+  int dfd;
+
+  nameset_add (&out_names, name);
+  if (out_format == OUT_DIR)
+  {
+    dfd = out_dirfd (name, &rel);
+    if (my_mkdirat (dfd, rel) == 0)
+      return 1;
+    return out_update && errno == EEXIST ? 1 : -1;
+  }
+
+  if (out_format == OUT_TAR)
+  {
+    snprintf (path, sizeof (path), "%s/", name);
+    return out_header (path, S_IFDIR | 0755, 0, NULL);
+  }
+  return out_header (name, S_IFDIR | 0755, 0, NULL);
+}
+
+#ifdef O_TMPFILE
+static int
+out_link (int fd, int dfd, const char *name)
+{
+  char proc[32];
+
+  /* AT_EMPTY_PATH needs privileges, /proc does not */
+  if (linkat (fd, "", dfd, name, AT_EMPTY_PATH) == 0)
+    return 0;
+  if (errno == EEXIST)
+    return -1;
+  snprintf (proc, sizeof (proc), "/proc/self/fd/%d", fd);
+  return linkat (AT_FDCWD, proc, dfd, name, AT_SYMLINK_FOLLOW);
+}
+#endif /* O_TMPFILE */
+
+static int
+out_stagename (const char *rel, char *tmp, size_t size)
+{
+  const char *base = strrchr (rel, '/');
+  int n;
+
+  /* next to the file, hidden, and pruned if an update is killed */
+  base = base ? base + 1 : rel;
+  n = snprintf (tmp, size, "%.*s.%s.new", (int) (base - rel), rel, base);
+  return n > 0 && (size_t) n < size ? 1 : -1;
+}
+
+static int
+out_publish (int dfd, const char *name, const struct iovec *iov,
+             int iovcnt, size_t len, int mod)
+{
+  char tmp[STRBUFFER];
+  int fd, res = -1;
+#ifdef O_TMPFILE
+  char dir[STRBUFFER];
+  char *slash;
+#endif /* O_TMPFILE */
+
+  if (out_stagename (name, tmp, sizeof (tmp)) < 0)
+    return -1;
+
+#ifdef O_TMPFILE
+  /*
+   * Write an unnamed file in the destination directory, then link it
+   * to its name, or to a temporary name renamed over the installed
+   * file : readers never see a partial file.
+   */
+  snprintf (dir, sizeof (dir), "%s", name);
+  slash = strrchr (dir, '/');
+  if (slash)
+    *slash = '\0';
+  fd = openat (dfd, slash ? dir : ".", O_TMPFILE | O_WRONLY | O_BINARY, mod);
+  if (fd != -1)
+  {
+    if (my_writev (fd, iov, iovcnt) == (ssize_t) len)
+    {
+      res = out_link (fd, dfd, name);
+      if (res < 0 && errno == EEXIST)
+      {
+        /* left by a killed update */
+        my_unlinkat (dfd, tmp, 0);
+        res = out_link (fd, dfd, tmp);
+        if (res == 0 && (res = my_renameat (dfd, tmp, dfd, name)) < 0)
+          my_unlinkat (dfd, tmp, 0);
+      }
+    }
+    close (fd);
+    if (res == 0)
+      return 1;
+  }
+#endif /* O_TMPFILE */
+
+  /* no O_TMPFILE support in the kernel or the file system, or no /proc */
+  fd = my_openat (dfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mod);
+  if (fd == -1)
+    return -1;
+  res = my_writev (fd, iov, iovcnt) == (ssize_t) len ? 1 : -1;
+  close (fd);
+#ifdef _WIN32
+  /* rename does not replace a file */
+  if (res > 0)
+    my_unlinkat (dfd, name, 0);
+#endif /* _WIN32 */
+  if (res < 0 || my_renameat (dfd, tmp, dfd, name) < 0)
+  {
+    my_unlinkat (dfd, tmp, 0);
+    return -1;
+  }
+  return 1;
+}
+
+static def_pending_t *
+out_pending_get (const char *name, int known)
+{
+  def_pending_t *p;
+  unsigned int i;
+
+  /* the same conf may be produced more than once, the last one wins */
+  if (known)
+    for (i = 0; i < nb_pending; i++)
+      if (!strcmp (out_pending[i].name, name))
+        return &out_pending[i];
+
+  if (nb_pending == pending_size)
+  {
+    pending_size = pending_size ? pending_size * 2 : 64;
+    p = stats_realloc (out_pending, pending_size * sizeof (*out_pending));
+    if (!p)
+      return NULL;
+    out_pending = p;
+  }
+  p = &out_pending[nb_pending++];
+  snprintf (p->name, sizeof (p->name), "%s", name);
+  p->data = NULL;
+  p->len = 0;
+  p->type = PENDING_DATA;
+  return p;
+}
+
+static int
+out_defer (const char *name, const struct iovec *iov, int iovcnt,
+           size_t len, int mod)
+{
+  def_pending_t *p;
+  int k;
+
+  p = out_pending_get (name, nameset_add (&out_names, name) == 0);
+  if (!p)
+    return -1;
+
+  free (p->data);
+  p->type = PENDING_DATA;
+  p->data = stats_malloc (len ? len : 1);
+  if (!p->data)
+    return -1;
+  p->len = 0;
+  for (k = 0; k < iovcnt; k++)
+  {
+    memcpy (p->data + p->len, iov[k].iov_base, iov[k].iov_len);
+    p->len += iov[k].iov_len;
+  }
+  p->mod = mod;
+  return 1;
+}
+
+static int
+out_aside (const char *name, const char *rel, char *tmp, size_t size)
+{
+  def_pending_t *p;
+
+  /* renamed over the installed file by out_commit */
+  if (out_stagename (rel, tmp, size) < 0
+      || !(p = out_pending_get (name, 0)))
+  {
+    printf ("Unable to create file %s\n", name);
+    return -1;
+  }
+  p->type = PENDING_FILE;
+  return 1;
+}
+
+static void
+out_discard (void)
+{
+  char tmp[STRBUFFER];
+  const char *rel;
+  unsigned int i;
+  int dfd;
+
+  for (i = 0; i < nb_pending; i++)
+    if (out_pending[i].type == PENDING_FILE)
+    {
+      dfd = out_dirfd (out_pending[i].name, &rel);
+      if (out_stagename (rel, tmp, sizeof (tmp)) > 0)
+        my_unlinkat (dfd, tmp, 0);
+    }
+}
+
+static int
+out_commit (void)
+{
+  char tmp[STRBUFFER];
+  struct iovec iov;
+  const char *rel;
+  unsigned int i;
+  int dfd, res = 1;
+
+  for (i = 0; i < nb_pending; i++)
+  {
+    dfd = out_dirfd (out_pending[i].name, &rel);
+    if (out_pending[i].type == PENDING_FILE)
+    {
+      out_stagename (rel, tmp, sizeof (tmp));
+#ifdef _WIN32
+      /* rename does not replace a file */
+      my_unlinkat (dfd, rel, 0);
+#endif /* _WIN32 */
+      if (my_renameat (dfd, tmp, dfd, rel) < 0)
+      {
+        printf ("Unable to rename %s to %s\n", tmp, out_pending[i].name);
+        res = -1;
+      }
+      continue;
+    }
+#ifndef _WIN32
+    /* a new link, renamed over the installed one */
+    if (out_pending[i].type == PENDING_LINK)
+    {
+      out_stagename (rel, tmp, sizeof (tmp));
+      unlinkat (dfd, tmp, 0);
+      if (symlinkat (out_pending[i].data, dfd, tmp) < 0
+          || my_renameat (dfd, tmp, dfd, rel) < 0)
+      {
+        unlinkat (dfd, tmp, 0);
+        printf ("Unable to create link %s\n", out_pending[i].name);
+        res = -1;
+      }
+      continue;
+    }
+#endif /* !_WIN32 */
+    iov.iov_base = out_pending[i].data;
+    iov.iov_len = out_pending[i].len;
+    if (out_samedata (dfd, rel, &iov, 1, iov.iov_len))
+      stats.count[COUNT_UNCHANGED]++;
+    else if (out_publish (dfd, rel, &iov, 1, iov.iov_len,
+                          out_pending[i].mod) < 0)
+    {
+      printf ("Unable to create file %s\n", out_pending[i].name);
+      res = -1;
+    }
+  }
+  return res;
+}
+
+static int
+out_close (void)
+{
+  static const char zero[2 * TARBLOCK];
+  unsigned int i;
+  int res = 1;
+
+  if (out_format == OUT_DIR)
+  {
+    /* an install which failed did not wait for its copies */
+    res = copy_join ();
+#ifdef HAVE_IO_URING
+    if (uring_exit () < 0)
+      res = -1;
+#endif /* HAVE_IO_URING */
+    /* an update which failed leaves its staged copies */
+    out_discard ();
+  }
+  nameset_free (&out_names);
+  sum_free ();
+  for (i = 0; i < nb_pending; i++)
+    free (out_pending[i].data);
+  free (out_pending);
+  out_pending = NULL;
+  nb_pending = 0;
+  pending_size = 0;
+  if (out_format == OUT_DIR)
+    return res;
+
+  if (out_format == OUT_CPIO)
+  {
+    out_mtime = 0;
+    res = out_header ("TRAILER!!!", 0, 0, NULL);
+  }
+  else
+    res = out_write (zero, sizeof (zero));
+  if (res > 0)
+    res = out_flush ();
+  if (copy_errors)
+    res = -1;
+  copy_errors = 0;
+
+  if (out_fd != -1)
+    close (out_fd);
+  out_fd = -1;
+  free (out_buf);
+  out_buf = NULL;
+  out_len = 0;
+  return res;
+}
+
+static int
+out_writev (const char *name, const struct iovec *iov, int iovcnt, int mod)
+{
+  const char *rel;
+  size_t len = 0;
+  unsigned int crc = 0;
+  int dfd, i;
+
+  for (i = 0; i < iovcnt; i++)
+  {
+    len += iov[i].iov_len;
+    crc = crc32c (crc, iov[i].iov_base, iov[i].iov_len);
+  }
+  sum_add (name, len, crc);
+
+  if (out_format == OUT_DIR && out_update)
+    return out_defer (name, iov, iovcnt, len, mod);
+
+#ifdef HAVE_IO_URING
+  /* the writes of a file must not run concurrently, the last one wins */
+  if (uring.fd != -1 && nameset_has (&out_names, name) && uring_wait () < 0)
+    return -1;
+#endif /* HAVE_IO_URING */
+  nameset_add (&out_names, name);
+  if (out_format == OUT_DIR)
+  {
+    dfd = out_dirfd (name, &rel);
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1)
+      return uring_queue (dfd, name, rel, iov, iovcnt, mod, 0);
+#endif /* HAVE_IO_URING */
+    return out_publish (dfd, rel, iov, iovcnt, len, mod);
+  }
+
+  if (out_header (name, S_IFREG | mod, len, NULL) < 0)
+    return -1;
+  for (i = 0; i < iovcnt; i++)
+    if (out_write (iov[i].iov_base, iov[i].iov_len) < 0)
+      return -1;
+  return out_pad (len, out_format == OUT_TAR ? TARBLOCK : 4);
+}
+
+static int
+out_data (const char *name, const char *data, size_t len, int mod)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) data;
+  iov.iov_len = len;
+  return out_writev (name, &iov, 1, mod);
+}
+
+static int
+out_member (const char *src, const char *name, int mod)
+{
+  unsigned long long t;
+  char *data;
+  size_t len;
+  int res;
+
+  /* uncompressed in memory, then written like a conf */
+  t = stats_start ();
+  trace_begin ("copy", src);
+  if (!(data = arc_read (src, &len)))
+  {
+    /* reported once, and failing the install like a failed copy */
+    nameset_add (&out_names, name);
+    copy_errors++;
+    trace_end ("copy");
+    stats_stop (PHASE_COPY, t);
+    return -1;
+  }
+  res = out_data (name, data, len, mod);
+  free (data);
+  stats.count[COUNT_FILES]++;
+  stats.count[COUNT_BYTES] += len;
+  trace_end ("copy");
+  stats_stop (PHASE_COPY, t);
+  return res;
+}
+
+static int
+out_copy (const char *src, const char *name, int mod)
+{
+  char rwbuf[64 * 1024];
+  char tmp[STRBUFFER];
+  const char *rel;
+  unsigned long left;
+  unsigned long long t;
+  unsigned int crc = 0;
+  struct stat st;
+  int dfd, infile, nbytes, res;
+
+  /* the same file is referenced by every device using it */
+  if (nameset_has (&out_names, name))
+    return 1;
+  if (arc.map)
+    return out_member (src, name, mod);
+  nameset_add (&out_names, name);
+
+  if (out_format == OUT_DIR)
+  {
+    dfd = out_dirfd (name, &rel);
+    /* the source is read once, for the comparison and the manifest */
+    if (out_update && out_samefile (src, dfd, rel, &crc))
+    {
+      sum_add (name, my_fstatat (dfd, rel, &st, 0) == 0 ? st.st_size : 0,
+               crc);
+      stats.count[COUNT_UNCHANGED]++;
+      return 1;
+    }
+    /* a changed file is copied aside, the installed one stays in use */
+    if (out_update)
+    {
+      if (out_aside (name, rel, tmp, sizeof (tmp)) < 0)
+        return -1;
+      rel = tmp;
+    }
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1)
+      return uring_copy (src, dfd, name, rel, mod);
+#endif /* HAVE_IO_URING */
+#ifdef HAVE_PTHREAD
+    if (copy_jobs)
+      return copy_queue (src, dfd, name, rel, mod);
+#endif /* HAVE_PTHREAD */
+    return copy (pkg_fd, src, dfd, rel, mod, name);
+  }
+
+  t = stats_start ();
+  trace_begin ("copy", src);
+  if ((infile = my_openat (pkg_fd, src, O_RDONLY | O_BINARY, 0)) == -1
+      || fstat (infile, &st) < 0)
+  {
+    printf ("Unable to open %s file read-only!\n", src);
+    copy_errors++;
+    if (infile != -1)
+      close (infile);
+    trace_end ("copy");
+    stats_stop (PHASE_COPY, t);
+    return -1;
+  }
+
+  res = out_header (name, S_IFREG | mod, st.st_size, NULL);
+  for (left = st.st_size; res > 0 && left > 0; left -= nbytes)
+  {
+    nbytes = read (infile, rwbuf,
+                   left < sizeof (rwbuf) ? left : sizeof (rwbuf));
+    if (nbytes <= 0)
+    {
+      /* the file shrank, keep the archive consistent */
+      memset (rwbuf, 0, sizeof (rwbuf));
+      nbytes = left < sizeof (rwbuf) ? left : sizeof (rwbuf);
+    }
+    crc = crc32c (crc, rwbuf, nbytes);
+    res = out_write (rwbuf, nbytes);
+  }
+  if (res > 0)
+    res = out_pad (st.st_size, out_format == OUT_TAR ? TARBLOCK : 4);
+  close (infile);
+  sum_add (name, st.st_size, crc);
+
+  stats.count[COUNT_FILES]++;
+  stats.count[COUNT_BYTES] += st.st_size;
+  trace_end ("copy");
+  stats_stop (PHASE_COPY, t);
+  return res;
+}
+
+static int
+out_symlink (const char *target, const char *name)
+{
+  const char *rel;
+  int dfd;
+#ifdef _WIN32
+  char src[STRBUFFER];
+  char *slash;
+#else /* _WIN32 */
+  char link[STRBUFFER];
+  struct iovec iov;
+  def_pending_t *p;
+  ssize_t n;
+#endif /* !_WIN32 */
+  int known;
+
+  known = nameset_add (&out_names, name) == 0;
+  if (out_format == OUT_DIR)
+  {
+    dfd = out_dirfd (name, &rel);
+#ifdef _WIN32
+    /* no symbolic links, copy the target next to the link */
+    snprintf (src, sizeof (src), "%s", rel);
+    slash = strrchr (src, '/');
+    slash = slash ? slash + 1 : src;
+    snprintf (slash, sizeof (src) - (slash - src), "%s", target);
+    return copy (dfd, src, dfd, rel, 0644, name);
+#else /* _WIN32 */
+    if (out_update)
+    {
+      n = readlinkat (dfd, rel, link, sizeof (link));
+      if (n == (ssize_t) strlen (target) && !memcmp (link, target, n))
+      {
+        stats.count[COUNT_UNCHANGED]++;
+        return 1;
+      }
+      /* replaced by out_commit, with the confs */
+      if (!(p = out_pending_get (name, known)))
+        return -1;
+      free (p->data);
+      p->type = PENDING_LINK;
+      return (p->data = stats_strdup (target)) ? 1 : -1;
+    }
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1)
+    {
+      iov.iov_base = (void *) target;
+      iov.iov_len = strlen (target);
+      return uring_queue (dfd, name, rel, &iov, 1, 0, 1);
+    }
+#endif /* HAVE_IO_URING */
+    return symlinkat (target, dfd, rel) == 0 ? 1 : -1;
+#endif /* !_WIN32 */
+  }
+
+  if (out_format == OUT_TAR)
+    return out_header (name, S_IFLNK | 0777, 0, target);
+  if (out_header (name, S_IFLNK | 0777, strlen (target), NULL) < 0
+      || out_write (target, strlen (target)) < 0)
+    return -1;
+  return out_pad (strlen (target), 4);
+}
+
+static int
+out_manifest (void)
+{
+  char dst[STRBUFFER];
+  char num[32];
+  def_buf_t b = { 0 };
+  unsigned int i;
+  int res = 1;
+
+  qsort (sums, nb_sums, sizeof (def_sum_t), sum_order);
+  for (i = 0; i < nb_sums && res > 0; i++)
+    /* a conf may be written more than once, the last one wins */
+    if (i + 1 == nb_sums || strcmp (sums[i].name, sums[i + 1].name))
+    {
+      snprintf (num, sizeof (num), "%08x %llu ", sums[i].crc, sums[i].size);
+      res = buf_cat (&b, num, sums[i].name, "\n", NULL);
+    }
+  if (snprintf (dst, sizeof (dst), "%s/%s", driver_name, MANIFEST)
+      >= (int) sizeof (dst))
+    res = -1;
+  if (res > 0)
+    res = out_data (dst, b.data ? b.data : "", b.len, 0644);
+  if (res < 0)
+    printf ("Unable to create file %s/%s/%s\n", confdir, driver_name,
+            MANIFEST);
+  buf_free (&b);
+  return res;
+}
+
+static int
+out_exists (const char *name)
+{
+  /*
+   * The driver directory is new, or being updated and only trusts what
+   * it wrote itself : what exists is what was written, maybe not yet on
+   * disk with io_uring.
+   */
+  return nameset_has (&out_names, name);
+}
+
+static int
+out_prune (void)
+{
+  char file[STRBUFFER];
+  DIR *d;
+  struct dirent *dp;
+  struct stat st;
+  int res = 1;
+
+  if (!(d = dir_read (drv_fd, ".")))
+    return -1;
+  while ((dp = readdir (d)))
+  {
+    /* kept : written by this install, or too long to be compared */
+    if (snprintf (file, sizeof (file), "%s/%s", driver_name, dp->d_name)
+        >= (int) sizeof (file) || nameset_has (&out_names, file)
+        || my_fstatat (drv_fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+        || S_ISDIR (st.st_mode))
+      continue;
+    if (my_unlinkat (drv_fd, dp->d_name, 0) == 0)
+      stats.count[COUNT_REMOVED]++;
+    else
+    {
+      printf ("Unable to remove %s/%s\n", confdir, file);
+      res = -1;
+    }
+  }
+  closedir (d);
+  return res;
+}
+
+static FILE *
+out_fopen (def_outfile_t *of, const char *name)
+{
+  snprintf (of->name, sizeof (of->name), "%s", name);
+  of->buf = NULL;
+  of->len = 0;
+#ifdef _WIN32
+  of->f = tmpfile ();
+#else /* _WIN32 */
+  of->f = open_memstream (&of->buf, &of->len);
+#endif /* !_WIN32 */
+  return of->f;
+}
+
+static int
+out_fclose (def_outfile_t *of)
+{
+  int res;
+
+  if (!of->f)
+    return -1;
+
+#ifdef _WIN32
+  of->len = ftell (of->f);
+  of->buf = stats_malloc (of->len + 1);
+  rewind (of->f);
+  of->len = fread (of->buf, 1, of->len, of->f);
+#endif /* _WIN32 */
+  res = ferror (of->f) ? -1 : 1;
+  fclose (of->f);
+  of->f = NULL;
+  if (res > 0)
+    res = out_data (of->name, of->buf, of->len, 0644);
+  free (of->buf);
+  of->buf = NULL;
+  of->len = 0;
+  return res;
+}
+
+static int
+alt_record (const char *from, const char *to)
+{
+  if (!alt_manifest.f)
+    return -1;
+  return fprintf (alt_manifest.f, "%s %s\n", from, to) < 0 ? -1 : 1;
+}
+
+/*
+ * Files processing
+ * ----------------
+ * - finddir      : depend of copy_file
+ * - findfile     : find a name case-insensitively (directory read once,
+ *                  or archive index)
+ * - copy_file    : search the real name of the file
+ * - copyfiles    : search files for the copy
+ * - file_exists  : test if a file exists
+ * - rmtree       : remove a dir
+ * - loadRules    : read the fix-ups of a rules file
+ *
+ */
+
+static int
+finddir (char *file)
+{
+  unsigned int i = 0;
+  const def_line_t *line;
+  const def_slice_t *dir;
+  def_atom_t *name;
+  def_section_t *sourcedisksfiles = NULL;
+
+  sourcedisksfiles = getSection ("sourcedisksfiles");
+  name = atom_lookup (&inf_atoms, file, strlen (file), ATOM_FOLD);
+  if (!sourcedisksfiles || !name)
+  {
+    file[0] = '\0';
+    return -1;
+  }
+
+  /* file = diskid[,subdir[,size]] : the directory is the last field */
+  for (i = 0; i < sourcedisksfiles->datalen; i++)
+  {
+    line = &sourcedisksfiles->data[i];
+    if (!line->key.len || line->nfields < 2)
+      continue;
+
+    dir = &line->field[line->nfields - 1];
+    if (dir->len && ATOM (line->key.s)->fold == name)
+    {
+      strcpy (file, dir->s);
+      return 1;
+    }
+  }
+  file[0] = '\0';
+  return -1;
+}
+
+static int
+findfile (const char *dir, char *file)
+{
+  unsigned int i;
+  DIR *d;
+  struct dirent *dp;
+  def_dircache_t *cache, *tab;
+  def_atom_t *atom;
+
+  if (arc.map)
+    return arc_lookup (dir, file);
+
+  /* each directory of the package is only read once */
+  for (i = 0; i < nb_dircache; i++)
+    if (!strcmp (dircache[i].dir, dir))
+      break;
+
+  if (i == nb_dircache)
+  {
+    if (!(d = dir_read (pkg_fd, dir[0] ? dir : ".")))
+    {
+      printf ("Unable to open %s\n", instdir);
+      file[0] = '\0';
+      return -1;
+    }
+
+    tab = stats_realloc (dircache, (nb_dircache + 1) * sizeof (def_dircache_t));
+    if (!tab)
+    {
+      closedir (d);
+      file[0] = '\0';
+      return -1;
+    }
+    dircache = tab;
+    cache = &dircache[nb_dircache++];
+    memset (cache, 0, sizeof (*cache));
+    snprintf (cache->dir, sizeof (cache->dir), "%s", dir);
+    while ((dp = readdir (d)))
+      atom_lookup (&cache->names, dp->d_name, strlen (dp->d_name), ATOM_ADD);
+    closedir (d);
+  }
+
+  /* the fold atom is the first entry read with that name */
+  atom = atom_lookup (&dircache[i].names, file, strlen (file), ATOM_FOLD);
+  if (atom)
+  {
+    strcpy (file, atom->str);
+    return 1;
+  }
+
+  file[0] = '\0';
+  return -1;
+}
+
+static void
+copy_file (char *file)
 {
   int nocopy = 0;
   char *ptr;
-  char newname[STRBUFFER];
-  char src[STRBUFFER], dst[STRBUFFER];
-  char dir[STRBUFFER];
-  char realname[STRBUFFER];
+  char newname[STRBUFFER];
+  char dst[STRBUFFER];
+  char dir[STRBUFFER];
+  char realname[STRBUFFER];
+
+  ptr = file;
+  if (file[0] == ';')
+    while (*ptr != '\0')
+    {
+      *ptr = *(ptr + 1);
+      ptr++;
+    }
+
+  trim (remComment (file));
+
+  strcpy (dir, file);
+  finddir (dir);
+  if (dir[0] != '\0')
+    findfile ("", dir);
+
+  strcpy (realname, file);
+  findfile (dir, realname);
+
+  if (realname[0] != '\0')
+  {
+    strcpy (newname, realname);
+    if (dir[0] != '\0')
+      snprintf (realname, sizeof (realname), "%s/%s", dir, newname);
+    lc (newname);
+    if (!nocopy)
+    {
+      snprintf (dst, sizeof (dst), "%s/%s", driver_name, newname);
+      out_copy (realname, dst, 0644);
+    }
+  }
+}
+
+static int
+copyfiles (const char *copy_name)
+{
+  unsigned int i = 0, k;
+  char *copy_ptr;
+  char file[STRBUFFER];
+  const def_line_t *line;
+  def_section_t *copy = NULL;
+
+  if (copy_name[0] == '@')
+  {
+    copy_ptr = stats_strdup (copy_name+1);
+    copy_file (copy_ptr);
+    if (!strstr (sys_files, lc (copy_ptr)) && strstr (copy_ptr, ".sys"))
+      snprintf (sys_files, sizeof (sys_files), "%s%s ", sys_files, copy_ptr);
+    free (copy_ptr);
+    return 1;
+  }
+
+  copy = getSection (copy_name);
+  if (!copy)
+  {
+    printf ("Parse error in inf. Unable to find section %s\n", copy_name);
+    return -1;
+  }
+
+  for (i = 0; i < copy->datalen; i++)
+  {
+    line = &copy->data[i];
+    if (line->text[0] == '[')
+      break;
+
+    for (k = 0; k < line->nfields; k++)
+    {
+      if (!line->field[k].len)
+        continue;
+      strcpy (file, line->field[k].s);
+      copy_file (file);
+      if (!strstr (sys_files, lc (file)) && strstr (file, ".sys"))
+        snprintf (sys_files, sizeof (sys_files), "%s%s ", sys_files, file);
+    }
+  }
+  return 0;
+}
+
+static int
+file_exists (const char *file)
+{
+  struct stat st;
+
+  if (stat (file, &st) < 0)
+    return 0;
+  return 1;
+}
+
+static int
+rmtree (int dfd, const char *dir)
+{
+  int fd;
+  DIR *d;
+  struct dirent *dp;
+
+  if ((fd = dir_open (dfd, dir)) == -1)
+    return 0;
+  if ((d = dir_read (fd, ".")))
+  {
+    while ((dp = readdir (d)))
+      if (strcmp (dp->d_name, ".") != 0 && strcmp (dp->d_name, "..") != 0)
+        my_unlinkat (fd, dp->d_name, 0);
+    closedir (d);
+  }
+  dir_close (&fd);
+  if (my_unlinkat (dfd, dir, AT_REMOVEDIR) == 0)
+    return 1;
+  return 0;
+}
+
+static int
+loadRules (const char *file)
+{
+  char line[LINEBUFFER], *from, *to, *end;
+  unsigned int n = 0;
+  FILE *f;
+
+  /* Param|Value=NewValue, '*' is any value, ';' and '#' start comments */
+  f = fopen (file, "r");
+  if (!f)
+  {
+    printf ("Unable to open rules file %s\n", file);
+    return -1;
+  }
+  while (fgets (line, sizeof (line), f))
+  {
+    n++;
+    if ((end = strchr (line, '#')))
+      *end = '\0';
+    trim (remComment (line));
+    if (line[0] == '\0')
+      continue;
+    from = strchr (line, '|');
+    to = from ? strchr (from, '=') : NULL;
+    if (!from || !to)
+    {
+      printf ("Ignoring rule %s:%u\n", file, n);
+      continue;
+    }
+    *from++ = '\0';
+    *to++ = '\0';
+    trim (line);
+    trim (from);
+    trim (to);
+    if (line[0] == '\0'
+        || def_rule (line, strcmp (from, "*") ? from : NULL, to) < 0)
+      printf ("Ignoring rule %s:%u\n", file, n);
+  }
+  fclose (f);
+  return 1;
+}
+
+/*
+ * Hardware
+ * --------
+ * - sysfs_attr    : read a hexadecimal attribute of a device
+ * - sysfs_bus     : list the devices of a bus
+ * - presentScan   : list the PCI and USB devices of the box
+ * - isPresent     : test if a device ID is worth a conf
+ * - presentFree   : forget the devices
+ *
+ * Devices are read under a configurable sysfs root, so that a fake tree
+ * can stand for the hardware.
+ *
+ */
+
+static int
+sysfs_attr (int dfd, const char *name, unsigned int *val)
+{
+  char buf[32];
+  ssize_t n;
+  int fd;
+
+  if ((fd = my_openat (dfd, name, O_RDONLY, 0)) == -1)
+    return -1;
+  n = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  *val = strtoul (buf, NULL, 16);
+  return 1;
+}
+
+static int
+sysfs_bus (int sysfs, const char *dir, int bus,
+           const char *vendor_attr, const char *device_attr)
+{
+  def_present_t *tab;
+  unsigned int vendor, device;
+  DIR *d;
+  struct dirent *dp;
+  int fd, devfd;
+
+  if ((fd = dir_open (sysfs, dir)) == -1)
+    return 0;
+  if (!(d = dir_read (fd, ".")))
+  {
+    dir_close (&fd);
+    return -1;
+  }
+  while ((dp = readdir (d)))
+  {
+    if (dp->d_name[0] == '.' || (devfd = dir_open (fd, dp->d_name)) == -1)
+      continue;
+    /* USB interfaces have no IDs, only the devices */
+    if (sysfs_attr (devfd, vendor_attr, &vendor) > 0
+        && sysfs_attr (devfd, device_attr, &device) > 0)
+    {
+      tab = stats_realloc (present, (nb_present + 1) * sizeof (def_present_t));
+      if (tab)
+      {
+        present = tab;
+        present[nb_present].bus = bus;
+        snprintf (present[nb_present].vd, sizeof (present[0].vd),
+                  "%04X:%04X", vendor & 0xffff, device & 0xffff);
+        nb_present++;
+      }
+    }
+    dir_close (&devfd);
+  }
+  closedir (d);
+  dir_close (&fd);
+  return 1;
+}
+
+static int
+presentScan (const char *root)
+{
+  int sysfs;
+
+  if ((sysfs = dir_open (AT_FDCWD, root)) == -1)
+  {
+    printf ("Unable to open %s\n", root);
+    return -1;
+  }
+  sysfs_bus (sysfs, "bus/pci/devices", WRAP_PCI_BUS, "vendor", "device");
+  sysfs_bus (sysfs, "bus/usb/devices", WRAP_USB_BUS, "idVendor", "idProduct");
+  dir_close (&sysfs);
+  return 1;
+}
+
+static int
+isPresent (int bt, const char *vendor, const char *device)
+{
+  char vd[STRBUFFER];
+  unsigned int i;
+
+  if (!sysfs_root)
+    return 1;
+
+  /*
+   * Every subsystem of a present vendor:device is kept : the exact one,
+   * the generic one and the one processPCIFuzz() links as a fallback.
+   */
+  snprintf (vd, sizeof (vd), "%s:%s", vendor, device);
+  for (i = 0; i < nb_present; i++)
+    if (present[i].bus == bt && !strcmp (present[i].vd, vd))
+      return 1;
+  return 0;
+}
+
+static void
+presentFree (void)
+{
+  free (present);
+  present = NULL;
+  nb_present = 0;
+}
+
+/*
+ * Parsers
+ * -------
+ * - addPCIFuzzEntry  : add device in the fuzzlist
+ * - ndiParam         : get the parameter of a Ndi\params subkey
+ * - addReg           : add registry to the conf
+ * - parseDevice      : parse device informations and write conf file
+ * - hexID            : parse a hexadecimal part of a device ID
+ * - idPart           : skip the name of a part of a device ID
+ * - parseID          : parse a device ID (PCI, USB, SDIO and PCMCIA)
+ * - parseModels      : parse the device IDs of a models section at once
+ * - searchEntry      : match a device of the INF against the searched IDs
+ * - parseVendor      : parse vendor informations
+ * - parseMfr         : parse manufacturer informations
+ * - confHeader       : render the conf lines common to all devices
+ * - parseVersion     : parse version informations
+ *
+ */
+
+static void
+addPCIFuzzEntry (const char *vendor, const char *device,
+                 const char *subvendor, const char *subdevice,
+                 const char *bt)
+{
+  char s[STRBUFFER], s2[STRBUFFER];
+  char fuzz[STRBUFFER];
+
+  snprintf (s, sizeof (s), "%s:%s", vendor, device);
+
+  strcpy (fuzz, s);
+  getFuzzlist (fuzz);
+  if (subvendor[0] == '\0' || !strcmp (fuzz, s))
+  {
+    strcpy (s2, s);
+    if (subvendor[0] != '\0')
+      snprintf (s2, sizeof (s2), "%s:%s:%s", s, subdevice, subvendor);
+    def_fuzzlist (s, s2);
+    def_buslist (s, bt);
+  }
+}
+
+static const char *
+ndiParam (const char *subkey)
+{
+  const char *p;
+
+  for (p = subkey; *p; p++)
+    if (!strncasecmp (p, "ndi\\params\\", 11) && p[11] != '\0')
+      return p + 11;
+  return NULL;
+}
+
+static int
+addReg (const char *reg_name, def_strlist_t *params)
+{
+  unsigned int i = 0;
+  int found = 0, gotParam = 0, driver_desc = 0;
+  char name[STRBUFFER], s[STRBUFFER];
+  char *ptr;
+  const def_rule_t *rule;
+  const char *param = NULL, *param_t, *val = NULL;
+  const char *p1, *p2, *p4, *subkey;
+  def_line_t *line;
+  def_section_t *reg = NULL;
+
+  reg = getSection (reg_name);
+  if (reg == NULL)
+  {
+    printf ("Parse error in inf. Unable to find section %s\n", reg_name);
+    return -1;
+  }
+
+  for (i = 0; i < reg->datalen; i++)
+  {
+    /* root, subkey, value name, flags, value */
+    line = &reg->data[i];
+    if (line->nfields >= 5)
+    {
+      p1 = lineField (line, 1);
+      p2 = lineField (line, 2);
+      /* the value may itself contain commas */
+      p4 = line->nfields == 5 ? lineField (line, 4)
+                              : resolveStr (lineTail (line, 4));
+      if (p1[0] != '\0')
+      {
+        if ((subkey = ndiParam (p1)))
+        {
+          /* Ndi\params\<param>[\enum] */
+          strcpy (name, subkey);
+          ptr = strrchr (name, '\\');
+          if (ptr && ptr > name)
+            *ptr = '\0';
+          param_t = intern (name);
+          if (param != param_t)
+          {
+            found = 0;
+            param = param_t;
+            val = NULL;
+          }
+          if (ATOM (p2)->fold == ATOM (key_type)->fold)
+            found++;
+          else if (ATOM (p2)->fold == ATOM (key_default)->fold)
+          {
+            found++;
+            val = p4;
+          }
+
+          if (found == 2)
+            gotParam = 1;
+        }
+        else if (strncasecmp (p1, "ndi", 3) || !strcasecmp (p1, "ndi"))
+        {
+          param = p2;
+          val = p4;
+          gotParam = 1;
+        }
+      }
+      else
+      {
+        param = p2;
+        val = p4;
+        gotParam = 1;
+      }
+
+      if (gotParam && param && param[0] != '\0')
+      {
+        if (param == key_driverdesc)
+          driver_desc = 1;
+        snprintf (s, sizeof (s), "%s|%s", param, val ? val : "");
+        rule = getRule (param, val ? val : "");
+        if (rule && strcmp (rule->to, val ? val : ""))
+        {
+          printf ("Forcing parameter %s to %s|%s\n", s, param, rule->to);
+          snprintf (s, sizeof (s), "%s|%s", param, rule->to);
+        }
+        strlist_add (params, s);
+        param = NULL;
+        gotParam = 0;
+      }
+    }
+  }
+
+  if (!driver_desc)
+    strlist_add (params, "DriverDesc|NDIS Network Adapter");
+
+  return 1;
+}
+
+static int
+parseDevice (const char *flavour, const char *device_sect,
+             const char *device, const char *vendor,
+             const char *subvendor, const char *subdevice)
+{
+  unsigned int i = 0, k;
+  def_strlist_t params = { 0 };
+  char sec[STRBUFFER];
+  char filename[STRBUFFER], bt[STRBUFFER], file[STRBUFFER];
+  char bustype[STRBUFFER], alt_filename[STRBUFFER], conf[STRBUFFER];
+  const def_line_t *line, *addreg = NULL;
+  def_section_t *dev = NULL;
+  struct iovec iov[5];
+  size_t bus_at, par_at;
+  char *p;
+
+  /*
+   * for RNDIS INF file (for USR5420), vendor section names device
+   * section as RNDIS.NT.5.1, but copyfiles section is RNDIS.NT, so
+   * first strip flavour from device_sect and then look for matching
+   * section
+   */
+  if (!strcmp (device_sect, "RNDIS.NT.5.1"))
+    dev = getSection ("RNDIS.NT");
+
+  if (!dev)
+  {
+    snprintf (sec, sizeof (sec), "%s.%s", device_sect, flavour);
+    dev = getSection (sec);
+  }
+
+  if (!dev)
+  {
+    snprintf (sec, sizeof (sec), "%s.NT", device_sect);
+    dev = getSection (sec);
+  }
+
+  if (!dev)
+  {
+    snprintf (sec, sizeof (sec), "%s.NTx86", device_sect);
+    dev = getSection (sec);
+  }
+
+  if (!dev)
+    dev = getSection (device_sect);
+
+  if (!dev)
+  {
+    printf ("no dev %s %s\n", device_sect, flavour);
+    return -1;
+  }
+
+  for (i = 0; i < dev->datalen; i++)
+  {
+    line = &dev->data[i];
+    if (line->kclass == KEY_ADDREG)
+      addreg = line;
+    else if (line->kclass == KEY_BUSTYPE)
+      def_strings ("BusType", line->val.s);
+  }
+
+  snprintf (filename, sizeof (filename), "%s:%s", device, vendor);
+  if (subvendor[0] != '\0')
+  {
+    strcat (filename, ":");
+    strcat (filename, subdevice);
+    strcat (filename, ":");
+    strcat (filename, subvendor);
+  }
+
+  snprintf (bt, sizeof (bt), "%X", bus);
+  strcat (filename, ".");
+  strcat (filename, bt);
+  strcat (filename, ".conf");
+  if (bus == WRAP_PCI_BUS || bus == WRAP_PCMCIA_BUS)
+    addPCIFuzzEntry (device, vendor, subvendor, subdevice, bt);
+
+  if (alt_install)
+  {
+    snprintf (file, sizeof (file), "driver%d", nb_driver);
+    snprintf (alt_filename, sizeof (file), "%s", filename);
+    if (alt_record (file, alt_filename) < 0)
+    {
+      printf ("Unable to create file %s\n", alt_install_file);
+      return -1;
+    }
+    snprintf (file, sizeof (file), "%s/driver%d", driver_name, nb_driver++);
+  }
+  else if (out_compact)
+  {
+    /* one conf per install section, the IDs are in the ID map */
+    if (snprintf (conf, sizeof (conf), "%s.%s.conf", dev->name, bt)
+        >= (int) sizeof (conf))
+    {
+      printf ("Conf name of section %s is too long\n", dev->name);
+      return -1;
+    }
+    for (p = conf; (p = strchr (p, '/')); )
+      *p = '_';
+    filename[strlen (filename) - 5] = '\0';
+    if (def_idmap (filename, intern (conf)) < 0)
+    {
+      printf ("Unable to map %s\n", filename);
+      return -1;
+    }
+    if (snprintf (file, sizeof (file), "%s/%s", driver_name, conf)
+        >= (int) sizeof (file))
+    {
+      printf ("Conf name of section %s is too long\n", dev->name);
+      return -1;
+    }
+    if (out_exists (file))
+      return 1;
+  }
+  else
+    snprintf (file, sizeof (file), "%s/%s", driver_name, filename);
+
+  for (i = 0; addreg && i < addreg->nfields; i++)
+    if (addreg->field[i].len)
+    {
+      trace_begin ("addReg", addreg->field[i].s);
+      addReg (addreg->field[i].s, &params);
+      trace_end ("addReg");
+    }
+
+  for (k = 0; k < dev->datalen; k++)
+  {
+    line = &dev->data[k];
+    if (line->kclass != KEY_COPYFILES)
+      continue;
+    for (i = 0; i < line->nfields; i++)
+      if (line->field[i].len)
+        copyfiles (line->field[i].s);
+  }
+
+  /* only sys_files, BusType and the parameters depend on the device */
+  conf_buf.len = 0;
+  buf_cat (&conf_buf, "sys_files|", sys_files, "\n", NULL);
+  bus_at = conf_buf.len;
+  strcpy (bustype, "BusType");
+  getString (bustype);
+  buf_cat (&conf_buf, "BusType|", bustype, "\n", NULL);
+  par_at = conf_buf.len;
+
+  /* sort and unify before writing */
+  unisort (&params);
+  for (i = 0; i < params.nb; i++)
+    buf_cat (&conf_buf, params.tab[i], "\n", NULL);
+  strlist_free (&params);
+
+  iov[0].iov_base = conf_buf.data;
+  iov[0].iov_len = bus_at;
+  iov[1].iov_base = conf_head.data;
+  iov[1].iov_len = conf_head.len;
+  iov[2].iov_base = conf_buf.data + bus_at;
+  iov[2].iov_len = par_at - bus_at;
+  iov[3].iov_base = conf_tail.data;
+  iov[3].iov_len = conf_tail.len;
+  iov[4].iov_base = conf_buf.data + par_at;
+  iov[4].iov_len = conf_buf.len - par_at;
+  if (!conf_buf.data || out_writev (file, iov, 5, 0644) < 0)
+  {
+    printf ("Unable to create file %s\n", filename);
+    return -1;
+  }
+  stats.count[COUNT_CONFS]++;
+  return 1;
+}
+
+static int
+hexID (const char **p, unsigned int min, unsigned int max, unsigned int *val)
+{
+  const char *s = *p;
+  unsigned int n;
+  int c;
+
+  /* up to the next '&', the ID is upper case */
+  for (*val = 0, n = 0; *s != '&' && *s != '\0'; s++, n++)
+  {
+    c = *s;
+    if (n == max || !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')))
+      return 0;
+    *val = *val << 4 | (c <= '9' ? c - '0' : c - 'A' + 10);
+  }
+  *p = s;
+  return n >= min;
+}
 
-  ptr = file;
-  if (file[0] == ';')
-    while (*ptr != '\0')
+static const char *
+idPart (const char *p, const char *name)
+{
+  size_t len = strlen (name);
+
+  return strncmp (p, name, len) ? NULL : p + len;
+}
+
+static int
+parseID (const char *id, def_hwid_t *hw)
+{
+  const char *p, *q, *dash;
+  unsigned int val, n;
+
+  memset (hw, 0, sizeof (*hw));
+  if (!strncmp (id, "PCI\\", 4))
+  {
+    hw->bus = WRAP_PCI_BUS;
+    p = id + 4;
+  }
+  else if (!strncmp (id, "USB\\", 4))
+  {
+    hw->bus = WRAP_USB_BUS;
+    p = id + 4;
+  }
+  else if (!strncmp (id, "SD\\", 3))
+  {
+    hw->bus = WRAP_SDIO_BUS;
+    p = id + 3;
+  }
+  else if (!strncmp (id, "PCMCIA\\", 7))
+  {
+    /* names may have dashes, the CRC is the last part */
+    hw->bus = WRAP_PCMCIA_BUS;
+    hw->flags = HWID_NAMED;
+    dash = strrchr (id + 7, '-');
+    p = dash + 1;
+    if (!dash || !hexID (&p, 4, 4, &hw->crc) || *p != '\0')
+      hw->bus = 0;
+    return hw->bus != 0;
+  }
+  else
+    return 0;
+
+  /* the vendor and the device come first, then optional parts */
+  for (n = 0; *p != '\0'; n++, p = q)
+  {
+    if (n == 0 && ((q = idPart (p, "VEN_")) || (q = idPart (p, "VID_")))
+        && hexID (&q, 1, 4, &val))
+      hw->vendor = val;
+    else if (n == 1 && ((q = idPart (p, "DEV_")) || (q = idPart (p, "PID_")))
+             && hexID (&q, 1, 4, &val))
+      hw->device = val;
+    else if (n < 2)
+      break;
+    else if (hw->bus == WRAP_PCI_BUS && (q = idPart (p, "SUBSYS_"))
+             && hexID (&q, 8, 8, &hw->subsys))
+      hw->flags |= HWID_SUBSYS;
+    else if (hw->bus != WRAP_SDIO_BUS && (q = idPart (p, "REV_"))
+             && hexID (&q, 2, 4, &hw->rev))
+      hw->flags |= HWID_REV;
+    else if (hw->bus == WRAP_PCI_BUS && (q = idPart (p, "CC_"))
+             && hexID (&q, 2, 6, &hw->cc))
+      hw->flags |= HWID_CC;
+    else if (hw->bus == WRAP_USB_BUS && (q = idPart (p, "MI_"))
+             && hexID (&q, 2, 2, &hw->mi))
+      hw->flags |= HWID_MI;
+    else if (hw->bus == WRAP_SDIO_BUS && (q = idPart (p, "FN_"))
+             && hexID (&q, 1, 2, &hw->mi))
+      hw->flags |= HWID_FN;
+    else
+      break;
+    if (*q == '&')
+      q++;
+  }
+
+  /* anything left or missing is not an ID of a known form */
+  if (*p != '\0' || n < 2)
+  {
+    hw->bus = 0;
+    return 0;
+  }
+  return 1;
+}
+
+static unsigned int
+parseModels (def_section_t *vend, def_model_t *models)
+{
+  def_line_t *line;
+  def_model_t *m;
+  char id[STRBUFFER];
+  unsigned int i, k, n, nb = 0;
+
+  for (i = 0; i < vend->datalen; i++)
+  {
+    /* description = install section, hardware id[, compatible ids] */
+    line = &vend->data[i];
+    if (!line->key.len || !line->val.len)
+      continue;
+
+    m = &models[nb];
+    for (k = 0, n = 0; k < line->nfields && n < 2; k++)
     {
-      *ptr = *(ptr + 1);
-      ptr++;
+      if (!line->field[k].len)
+        continue;
+      if (n++)
+        m->id = lineField (line, k);
+      else
+        m->section = line->field[k].s;
     }
+    if (n < 2)
+      continue;
+    snprintf (id, sizeof (id), "%s", m->id);
+    uc (id);
+    parseID (id, &m->hw);
+    nb++;
+  }
+  return nb;
+}
 
-  trim (remComment (file));
+static void
+searchEntry (int bt, const char *vendor, const char *device,
+             const char *subvendor, const char *subdevice)
+{
+  char vd[STRBUFFER], id[STRBUFFER];
+  unsigned int i;
+  int subsys = subvendor[0] != '\0';
 
-  strcpy (dir, file);
-  finddir (dir);
-  if (dir[0] != '\0')
-    findfile ("", dir);
+  /* named like the conf file parseDevice() would write, if searchable */
+  if (snprintf (vd, sizeof (vd), "%s:%s", vendor, device) >= (int) sizeof (vd)
+      || (subsys && snprintf (id, sizeof (id), "%s:%s:%s", vd, subdevice,
+                              subvendor) >= (int) sizeof (id)))
+    return;
+  if (!subsys)
+    strcpy (id, vd);
+
+  /*
+   * Fuzzy : a PCI subsystem entry is linked from its generic ID by
+   * processPCIFuzz(), and a generic entry is used for any subsystem.
+   */
+  for (i = 0; i < nb_search; i++)
+  {
+    if (!strcmp (search[i].id, id))
+      search[i].match = SEARCH_EXACT;
+    else if (search[i].match == SEARCH_NONE && !strcmp (search[i].vd, vd)
+             && (search[i].subsys ? !subsys
+                 : subsys && (bt == WRAP_PCI_BUS || bt == WRAP_PCMCIA_BUS)))
+      search[i].match = SEARCH_FUZZY;
+  }
+}
+
+static int
+parseVendor (const char *flavour, const char *vendor_name)
+{
+  unsigned int i, nb;
+  char vendor[5], device[5];
+  char subvendor[5], subdevice[5];
+  unsigned long long t;
+  def_section_t *vend = NULL;
+  def_model_t *models;
+  const def_hwid_t *hw;
+
+  vend = getSection (vendor_name);
+  if (vend == NULL)
+  {
+    printf ("Could not find section for %s in inf file!\n", vendor_name);
+    return -1;
+  }
+
+  models = stats_malloc ((vend->datalen + 1) * sizeof (def_model_t));
+  if (!models)
+    return -1;
+  nb = parseModels (vend, models);
+
+  for (i = 0; i < nb; i++)
+  {
+    /* confs are only written for the buses of ndiswrapper */
+    hw = &models[i].hw;
+    if (hw->bus != WRAP_PCI_BUS && hw->bus != WRAP_USB_BUS)
+      continue;
+    snprintf (vendor, sizeof (vendor), "%04X", hw->vendor);
+    snprintf (device, sizeof (device), "%04X", hw->device);
+    subvendor[0] = '\0';
+    subdevice[0] = '\0';
+    if (hw->flags & HWID_SUBSYS)
+    {
+      snprintf (subdevice, sizeof (subdevice), "%04X", hw->subsys >> 16);
+      snprintf (subvendor, sizeof (subvendor), "%04X", hw->subsys & 0xffff);
+    }
+
+    bus = hw->bus;
+    if (nb_search)
+      searchEntry (bus, vendor, device, subvendor, subdevice);
+    else if (isPresent (bus, vendor, device))
+    {
+      t = stats_start ();
+      trace_begin ("parseDevice", models[i].section);
+      parseDevice (flavour, models[i].section, vendor, device,
+                   subvendor, subdevice);
+      trace_end ("parseDevice");
+      stats_stop (PHASE_PARSEDEVICE, t);
+    }
+  }
+  free (models);
+  return 0;
+}
+
+static int
+parseMfr (void)
+{
+  /*
+   * Examples:
+   * Vendor
+   * Vendor,ME,NT,NT.5.1
+   * Vendor.NTx86
+   */
+  unsigned int i = 0, k, n;
+  int res = 0;
+  char sp[2][STRBUFFER];
+  char ver[STRBUFFER];
+  char section[STRBUFFER] = "";
+  char vendor[STRBUFFER], flavour[STRBUFFER], tmp[STRBUFFER];
+  const def_line_t *line;
+  def_section_t *manu = NULL;
+
+  manu = getSection ("manufacturer");
+  if (!manu)
+  {
+    printf ("Could not find section 'manufacturer' in inf file!\n");
+    return -1;
+  }
+
+  for (i = 0; i < manu->datalen; i++)
+  {
+    line = &manu->data[i];
+
+    strcpy (ver, "Provider");
+    getVersion (ver);
+    if (line->key.len && !strcmp (line->key.s, ver))
+      def_strings (line->key.s, line->val.s);
+
+    if (line->key.len && line->val.len)
+    {
+      flavour[0] = '\0';
+      for (k = 0, n = 0; k < line->nfields; k++)
+      {
+        if (!line->field[k].len)
+          continue;
+        if (!n++)
+        {
+          /* Vendor */
+          strcpy (vendor, line->field[k].s);
+          stripquotes (vendor);
+          continue;
+        }
+
+        strcpy (tmp, line->field[k].s);
+        regex (stripquotes (tmp),
+               "[[:space:]]*([^[:space:]]+)[[:space:]]*", sp, SCASE);
+        if (!strcasecmp (sp[1], "NT.5.1"))
+        {
+          /* This is the best (XP) */
+          snprintf (section, sizeof (section), "%s.%s", vendor, sp[1]);
+          strcpy (flavour, sp[1]);
+        }
+        else
+        {
+          if (!strncasecmp(sp[1], "NT", 2) && section[0] == '\0')
+          {
+            /* This is the second best (win2k) */
+            snprintf (section, sizeof (section), "%s.%s", vendor, sp[1]);
+            strcpy (flavour, sp[1]);
+          }
+        }
+      }
+      if (n == 1)
+        strcpy (section, vendor);
+      if (!res)
+      {
+        trace_begin ("parseVendor", section);
+        res = parseVendor (flavour, section);
+        trace_end ("parseVendor");
+      }
+    }
+  }
+  return res;
+}
+
+static int
+confHeader (void)
+{
+  char ver[STRBUFFER];
+
+  strcpy (ver, "DriverVer");
+  getVersion (ver);
+
+  conf_head.len = 0;
+  conf_tail.len = 0;
+  if (buf_cat (&conf_head, "NdisVersion|0x50001\n", "Environment|1\n",
+               "class_guid|", classguid, "\n",
+               "driver_version|", provider_string, ",", ver, "\n",
+               NULL) < 0
+      || buf_cat (&conf_tail, "SlotNumber|01\n",
+                  "NetCfgInstanceId|{28022A01-1234-5678-ABCDE-123813291A00}\n",
+                  "\n", NULL) < 0)
+    return -1;
+  return 1;
+}
+
+static int
+parseVersion (void)
+{
+  unsigned int i = 0;
+  char val[STRBUFFER];
+  const char *ptr1, *ptr2;
+  const def_line_t *line;
+  unsigned long long t;
+  def_section_t *s = NULL;
+
+  s = getSection ("version");
+  if (!s)
+  {
+    printf ("Could not find section 'version' in inf file!\n");
+    return -1;
+  }
+
+  for (i = 0; i < s->datalen; i++)
+  {
+    line = &s->data[i];
+    switch (line->kclass)
+    {
+    case KEY_PROVIDER:
+      strcpy (val, line->val.s);
+      def_version ("Provider", stripquotes (val));
+      break;
+
+    case KEY_DRIVERVER:
+      strcpy (val, line->val.s);
+      def_version ("DriverVer", stripquotes (val));
+      break;
+
+    case KEY_CLASSGUID:
+      ptr1 = strchr (line->val.s, '{');
+      ptr2 = ptr1 ? strchr (ptr1, '}') : NULL;
+      if (ptr2)
+      {
+        strncpy (classguid, ptr1 + 1, ptr2 - ptr1 - 1);
+        classguid[ptr2-ptr1-1] = '\0';
+        lc (classguid);
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  /* the provider is the same for every device */
+  strcpy (val, "Provider");
+  getVersion (val);
+  snprintf (provider_string, sizeof (provider_string), "%s", resolveStr (val));
+  if (confHeader () < 0)
+    return -1;
+
+  t = stats_start ();
+  parseMfr ();
+  stats_stop (PHASE_PARSEMFR, t);
+  return 1;
+}
+
+/*
+ * INF installation
+ * ----------------
+ * - initStrings    : init "strings" section
+ * - newSection     : add a section to the index
+ * - loadinf        : load INF in memory and index its sections
+ * - saveCache      : write the parse cache next to the installed INF
+ * - freeinf        : release the INF and its sections
+ * - validName      : test if a driver name is a directory of confdir
+ * - isInstalled    : test if the driver is already installed
+ * - cleanClaim     : remove the files of the claim, but its pid file
+ * - claimDriver    : take the driver directory for this process
+ * - releaseDriver  : publish or discard the claimed driver directory
+ * - writeIdmap     : write the sorted ID map of a compact install
+ * - processPCIFuzz : create symbolic link
+ * - install        : install driver described by INF
+ *
+ */
+
+static int
+initStrings (void)
+{
+  unsigned int i = 0;
+  char ps[STRBUFFER];
+  const def_line_t *line;
+  def_section_t *s = NULL;
+
+  s = getSection ("strings");
+  if (s == NULL)
+  {
+    printf ("Could not find section 'strings' in inf file!\n");
+    return -1;
+  }
+
+  /* resolved once, when the cache was built */
+  if (inf_cache.head)
+  {
+    for (i = 0; i < inf_cache.head->nb_strings; i++)
+      if (inf_cache.str[i].key < inf_cache.head->pool_size
+          && inf_cache.str[i].val < inf_cache.head->pool_size
+          && strlen (inf_cache.pool + inf_cache.str[i].key) < STRBUFFER
+          && strlen (inf_cache.pool + inf_cache.str[i].val) < STRBUFFER)
+        def_strings (inf_cache.pool + inf_cache.str[i].key,
+                     inf_cache.pool + inf_cache.str[i].val);
+    return 1;
+  }
+
+  for (i = 0; i < s->datalen; i++)
+  {
+    line = &s->data[i];
+    if (line->key.len && line->val.len)
+    {
+      strcpy (ps, line->val.s);
+      def_strings (line->key.s, stripquotes (ps));
+    }
+  }
+  return 1;
+}
+
+static def_section_t *
+newSection (const char *name, size_t len, size_t start)
+{
+  def_section_t **tab, *sec;
+  def_atom_t *atom;
+
+  if (nb_sections == sections_size)
+  {
+    sections_size = sections_size ? sections_size * 2 : STRBUFFER;
+    tab = stats_realloc (sections, sections_size * sizeof (def_section_t *));
+    if (!tab)
+      return NULL;
+    sections = tab;
+  }
+
+  sec = stats_calloc (1, sizeof (def_section_t));
+  if (!sec)
+    return NULL;
+  if (len > sizeof (sec->name) - 1)
+    len = sizeof (sec->name) - 1;
+  memcpy (sec->name, name, len);
+
+  /* getSection() returns the first section of a name */
+  atom = atom_lookup (&inf_atoms, sec->name, len, ATOM_ADD);
+  if (!atom)
+  {
+    free (sec);
+    return NULL;
+  }
+  if (!atom->fold->section)
+    atom->fold->section = sec;
+  sec->start = start;
+  sec->end = start;
+  sections[nb_sections++] = sec;
+  return sec;
+}
+
+static int
+loadinf (const char *filename, int cfd, const char *cache)
+{
+  const char *line, *eol, *end, *lbracket, *rbracket;
+  char cache_name[STRBUFFER];
+  const def_cache_sect_t *cs;
+  def_section_t *sec;
+  struct stat st;
+  unsigned int i;
+  size_t len;
+  ssize_t n;
+  int fd;
+
+  /* the INF of a driver archive is one of its members */
+  if (arc.map)
+  {
+    if (!(inf_text = arc_read (filename, &inf_size)))
+      return 0;
+  }
+  else
+  {
+    if ((fd = open (filename, O_RDONLY | O_BINARY)) == -1
+        || fstat (fd, &st) < 0)
+    {
+      printf ("Could not open %s for reading!\n", filename);
+      if (fd != -1)
+        close (fd);
+      return 0;
+    }
+
+    inf_text = stats_malloc (st.st_size + 1);
+    if (!inf_text)
+    {
+      close (fd);
+      return 0;
+    }
+    for (inf_size = 0; inf_size < (size_t) st.st_size; inf_size += n)
+      if ((n = read (fd, inf_text + inf_size, st.st_size - inf_size)) <= 0)
+        break;
+    inf_text[inf_size] = '\0';
+    close (fd);
+  }
+
+  initKeys ();
+  if (!inf_size)
+    return 0;
+
+  /*
+   * The sections of an unchanged INF are indexed by its cache. The hash
+   * only ties a cache to the text of the INF : a cache coming with the
+   * package is not trusted, only one written under confdir is.
+   */
+  len = strlen (confdir);
+  if (!cache && !arc.map && !strncmp (filename, confdir, len)
+      && filename[len] == '/')
+  {
+    snprintf (cache_name, sizeof (cache_name), "%s.cache", filename);
+    cfd = AT_FDCWD;
+    cache = cache_name;
+  }
+  if (cache_enable && cache && cache_open (cfd, cache))
+  {
+    for (i = 0; i < inf_cache.head->nb_sections; i++)
+    {
+      cs = &inf_cache.sect[i];
+      if (cs->name + (unsigned long long) cs->name_len
+          >= inf_cache.head->pool_size
+          || (cs->raw && (cs->start > cs->end || cs->end > inf_size))
+          || !(sec = newSection (inf_cache.pool + cs->name, cs->name_len,
+                                 cs->raw ? cs->start : cs->line)))
+        return 0;
+      sec->end = cs->raw ? cs->end : cs->line + cs->nb_lines;
+      sec->cached = !cs->raw;
+    }
+    stats.count[COUNT_SECTIONS] = nb_sections;
+    return nb_sections > 0;
+  }
 
-  strcpy (realname, file);
-  findfile (dir, realname);
+  if (!(sec = newSection ("none", 4, 0)))
+    return 0;
 
-  if (realname[0] != '\0')
+  /* index the sections, lines are split later by getSection() */
+  end = inf_text + inf_size;
+  for (line = inf_text; line < end; line = eol + 1)
   {
-    strcpy (newname, realname);
-    if (dir[0] != '\0')
-      snprintf (realname, sizeof (realname), "%s/%s", dir, newname);
-    lc (newname);
-    if (!nocopy)
+    eol = memchr (line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    lbracket = memchr (line, '[', eol - line);
+    rbracket = memchr (line, ']', eol - line);
+    if (lbracket && rbracket && lbracket < rbracket)
     {
-      snprintf (src, sizeof (src), "%s/%s", instdir, realname);
-      snprintf (dst, sizeof (dst), "%s/%s/%s", confdir, driver_name, newname);
-      copy (src, dst, 0644);
+      sec->end = line - inf_text;
+      sec = newSection (lbracket + 1, rbracket - lbracket - 1,
+                        eol < end ? (size_t) (eol + 1 - inf_text) : inf_size);
+      if (!sec)
+        return 0;
     }
   }
+  sec->end = inf_size;
+
+  stats.count[COUNT_SECTIONS] = nb_sections;
+  return 1;
 }
 
-static int
-copyfiles (const char *copy_name)
+static void
+freeinf (void)
 {
-  unsigned int i = 0, k, l;
-  char *copy_ptr;
-  char **files;
-  char *tmp;
-  def_section_t *copy = NULL;
+  unsigned int i, j;
 
-  if (copy_name[0] == '@')
+  for (i = 0; i < nb_sections; i++)
   {
-    copy_ptr = strdup (copy_name+1);
-    copy_file (copy_ptr);
-    if (!strstr (sys_files, lc (copy_ptr)) && strstr (copy_ptr, ".sys"))
-      snprintf (sys_files, sizeof (sys_files), "%s%s ", sys_files, copy_ptr);
-    free (copy_ptr);
-    return 1;
+    for (j = 0; j < sections[i]->datalen; j++)
+      free (sections[i]->data[j].field);
+    free (sections[i]->data);
+    free (sections[i]);
   }
+  free (sections);
+  sections = NULL;
+  sections_size = 0;
+  nb_sections = 0;
+  free (inf_text);
+  inf_text = NULL;
+  inf_size = 0;
+  cache_close ();
+  free (idmap);
+  idmap = NULL;
+  nb_idmap = 0;
+  idmap_size = 0;
+  strtab_free (&strings);
+  strtab_free (&version);
+  strtab_free (&fuzzlist);
+  strtab_free (&buslist);
+  atompool_free (&inf_atoms);
+  nameset_free (&unresolved);
+  for (i = 0; i < nb_dircache; i++)
+    atompool_free (&dircache[i].names);
+  free (dircache);
+  dircache = NULL;
+  nb_dircache = 0;
+  buf_free (&conf_buf);
+  buf_free (&conf_head);
+  buf_free (&conf_tail);
+
+  nb_driver = 0;
+  sys_files[0] = '\0';
+  classguid[0] = '\0';
+  provider_string[0] = '\0';
+}
 
-  copy = getSection (copy_name);
-  if (!copy)
+static int
+saveCache (void)
+{
+  char dst[STRBUFFER];
+  def_buf_t b = { 0 };
+  unsigned int i;
+  int res;
+
+  /* lines of the cache in use are kept, they are not split again */
+  for (i = 0; i < nb_sections; i++)
+    if (sections[i]->cached && !sections[i]->loaded)
+      loadSection (sections[i]);
+
+  if (snprintf (dst, sizeof (dst), "%s/%s.inf.cache", driver_name,
+                driver_name) >= (int) sizeof (dst))
   {
-    printf ("Parse error in inf. Unable to find section %s\n", copy_name);
+    printf ("Unable to write %s/%s/%s.inf.cache\n", confdir, driver_name,
+            driver_name);
     return -1;
   }
+  res = cache_build (&b);
+  if (res > 0)
+    res = out_data (dst, b.data, b.len, 0644);
+  if (res < 0)
+    printf ("Unable to write %s/%s\n", confdir, dst);
+  buf_free (&b);
+  return res;
+}
 
-  files = malloc (LINEBUFFER * sizeof (char *));
-  memset (files, 0, LINEBUFFER * sizeof (char *));
-  for (i = 0; i < copy->datalen; i++)
+static int
+validName (const char *name)
+{
+  /* a directory of confdir, not a path, nor a claim */
+  if (!name[0] || name[0] == '.' || strchr (name, '/')
+#ifdef _WIN32
+      || strchr (name, '\\')
+#endif /* _WIN32 */
+      )
   {
-    if (copy->data[i][0] == '[')
-      break;
-
-    /* Split */
-    k = 0;
-    if ((tmp = strtok (copy->data[i], ",")) != NULL)
-    {
-      files[k] = strdup (tmp);
-      while ((tmp = strtok (NULL, ",")) != NULL)
-      {
-        files[++k] = strdup (tmp);
-        *(tmp - 1) = ',';
-      }
-    }
-    else
-      files[k] = strdup (copy->data[i]);
-
-    l = k + 1;
-    for (k = 0; k < l; k++)
-    {
-      trim (files[k]);
-      if (strlen (files[k]) > 0)
-      {
-        copy_file (files[k]);
-        if (!strstr (sys_files, lc (files[k])) && strstr (files[k], ".sys"))
-          snprintf (sys_files, sizeof (sys_files),
-                    "%s%s ", sys_files, files[k]);
-      }
-      free (files[k]);
-    }
+    printf ("Invalid driver name %s\n", name);
+    return 0;
   }
-  free (files);
-  return 0;
+  return 1;
 }
 
 static int
-file_exists (const char *file)
+isInstalled (const char *name)
 {
   struct stat st;
 
-  if (stat (file, &st) < 0)
+  if (conf_fd == -1 || !validName (name))
     return 0;
-  return 1;
+  return my_fstatat (conf_fd, name, &st, 0) == 0 && S_ISDIR (st.st_mode);
 }
 
-static int
-rmtree (const char *dir)
+static void
+cleanClaim (void)
 {
-  char file[STRBUFFER];
   DIR *d;
   struct dirent *dp;
+  int fd;
 
-  d = opendir (dir);
-  while ((dp = readdir (d)))
+  if ((fd = dir_open (conf_fd, claim_name)) == -1)
+    return;
+  if ((d = dir_read (fd, ".")))
   {
-    if (strcmp (dp->d_name, ".") != 0 || strcmp (dp->d_name, "..") != 0)
-    {
-      snprintf (file, sizeof (file), "%s/%s", dir, dp->d_name);
-      unlink (file);
-    }
+    while ((dp = readdir (d)))
+      if (strcmp (dp->d_name, ".") && strcmp (dp->d_name, "..")
+          && strcmp (dp->d_name, "pid") && my_unlinkat (fd, dp->d_name, 0) < 0)
+        rmtree (fd, dp->d_name);
+    closedir (d);
   }
-  if (rmdir (dir) == 0)
-    return 1;
-  return 0;
+  dir_close (&fd);
 }
 
-/*
- * Parsers
- * -------
- * - addPCIFuzzEntry  : add device in the fuzzlist
- * - addReg           : add registry to the conf
- * - parseDevice      : parse device informations and write conf file
- * - parseID          : parse device ID informations (PCI and USB)
- * - parseVendor      : parse vendor informations
- * - parseMfr         : parse manufacturer informations
- * - parseVersion     : parse version informations
- *
- */
-
-static void
-addPCIFuzzEntry (const char *vendor, const char *device,
-                 const char *subvendor, const char *subdevice,
-                 const char *bt)
+static int
+claimDriver (void)
 {
-  char s[STRBUFFER], s2[STRBUFFER];
-  char fuzz[STRBUFFER];
+  char path[STRBUFFER + 16];
+  char pid[32];
+  struct stat st1, st2;
+  unsigned int tries;
+  long owner;
+  ssize_t n;
+  int created = 0, fd;
 
-  snprintf (s, sizeof (s), "%s:%s", vendor, device);
+  /*
+   * Of the processes installing, updating or removing a driver at once,
+   * one owns ".<driver>.new" : the one holding the lock of its pid file.
+   * mkdir is atomic, and the lock is released when its owner exits, so
+   * the claim of a killed process is taken over.
+   */
+  if (!validName (driver_name))
+    return -1;
+  snprintf (claim_name, sizeof (claim_name), ".%s.new", driver_name);
+  snprintf (path, sizeof (path), "%s/pid", claim_name);
+  for (tries = 0; claim_fd == -1 && tries < CLAIM_TRIES; tries++)
+  {
+    created = my_mkdirat (conf_fd, claim_name) == 0;
+    if (!created && errno != EEXIST)
+    {
+      printf ("Unable to create directory %s/%s. "
+              "Make sure you are running as root\n", confdir, claim_name);
+      break;
+    }
+    /* released meanwhile */
+    fd = my_openat (conf_fd, path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd == -1)
+      continue;
+    if (my_lockfd (fd) < 0)
+    {
+      n = read (fd, pid, sizeof (pid) - 1);
+      pid[n > 0 ? n : 0] = '\0';
+      if ((owner = strtol (pid, NULL, 10)) > 0)
+        printf ("%s is being changed by process %ld\n", driver_name, owner);
+      else
+        printf ("%s is being changed by another process\n", driver_name);
+      close (fd);
+      break;
+    }
+    /* the pid file of the claim, not one removed meanwhile */
+    if (fstat (fd, &st1) == 0 && my_fstatat (conf_fd, path, &st2, 0) == 0
+        && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+      claim_fd = fd;
+    else
+      close (fd);
+  }
+  if (claim_fd == -1)
+  {
+    if (tries == CLAIM_TRIES)
+      printf ("%s is being changed by another process\n", driver_name);
+    claim_name[0] = '\0';
+    return -1;
+  }
 
-  strcpy (fuzz, s);
-  getFuzzlist (fuzz);
-  if (subvendor[0] == '\0' || !strcmp (fuzz, s))
+  /* the files of a killed process are not a driver */
+  if (!created)
   {
-    strcpy (s2, s);
-    if (subvendor[0] != '\0')
-      snprintf (s2, sizeof (s2), "%s:%s:%s", s, subdevice, subvendor);
-    def_fuzzlist (s, s2);
-    def_buslist (s, bt);
+    printf ("Taking over %s/%s, left by a killed process\n",
+            confdir, claim_name);
+    cleanClaim ();
   }
+  n = snprintf (pid, sizeof (pid), "%ld\n", (long) getpid ());
+  if (ftruncate (claim_fd, 0) < 0 || write (claim_fd, pid, n) != n)
+    printf ("Unable to write %s/%s\n", confdir, path);
+
+  /* a new driver is written in the claim, then renamed */
+  out_stage = !isInstalled (driver_name);
+  return 1;
 }
 
 static int
-addReg (const char *reg_name, char param_tab[][STRBUFFER], unsigned int *k)
+releaseDriver (int publish)
 {
-  unsigned int i = 0;
-  int found = 0, gotParam = 0, driver_desc = 0;
-  char ps[6][STRBUFFER];
-  char param[STRBUFFER], param_t[STRBUFFER];
-  char type[STRBUFFER], val[STRBUFFER], s[STRBUFFER];
-  char p1[STRBUFFER], p2[STRBUFFER], p3[STRBUFFER], p4[STRBUFFER];
-  char fixlist[STRBUFFER], sOld[STRBUFFER];
-  def_section_t *reg = NULL;
+  char path[STRBUFFER + 16];
+  int res = 1;
 
-  reg = getSection (reg_name);
-  if (reg == NULL)
+  if (claim_fd == -1)
+    return 1;
+
+#ifdef _WIN32
+  /* an open file can neither be renamed nor removed */
+  close (claim_fd);
+#endif /* _WIN32 */
+  /* readers see no driver, or the complete one */
+  if (publish && out_stage)
   {
-    printf ("Parse error in inf. Unable to find section %s\n", reg_name);
-    return -1;
+    snprintf (path, sizeof (path), "%s/pid", driver_name);
+    if (my_renameat (conf_fd, claim_name, conf_fd, driver_name) == 0)
+      my_unlinkat (conf_fd, path, 0);
+    else
+    {
+      printf ("Unable to rename %s/%s to %s\n", confdir, claim_name,
+              driver_name);
+      res = -1;
+    }
+  }
+  /* the files of a failed install, or only the lock of an update */
+  if (!publish || !out_stage || res < 0)
+  {
+    cleanClaim ();
+    snprintf (path, sizeof (path), "%s/pid", claim_name);
+    my_unlinkat (conf_fd, path, 0);
+    my_unlinkat (conf_fd, claim_name, AT_REMOVEDIR);
   }
+  /* the lock is held until the claim is gone */
+#ifndef _WIN32
+  close (claim_fd);
+#endif /* !_WIN32 */
+  claim_fd = -1;
+  claim_name[0] = '\0';
+  out_stage = 0;
+  return res;
+}
 
-  for (i = 0; i < reg->datalen; i++)
+static int
+writeIdmap (void)
+{
+  char dst[STRBUFFER];
+  def_buf_t b = { 0 };
+  unsigned int i;
+  int res = 1;
+
+  idmap_sort ();
+  for (i = 0; i < nb_idmap && res > 0; i++)
+    res = buf_cat (&b, idmap[i].id, " ", idmap[i].conf, "\n", NULL);
+  if (snprintf (dst, sizeof (dst), "%s/idmap", driver_name)
+      >= (int) sizeof (dst))
+    res = -1;
+  if (res > 0)
+    res = out_data (dst, b.data ? b.data : "", b.len, 0644);
+  if (res < 0)
+    printf ("Unable to create file %s/%s/idmap\n", confdir, driver_name);
+  buf_free (&b);
+  return res;
+}
+
+static int
+processPCIFuzz (void)
+{
+  unsigned int i, n;
+  int ret = 1;
+  char bl[STRBUFFER];
+  char src[STRBUFFER], dst[STRBUFFER];
+  const char *conf;
+
+  /* the fuzzy IDs are added after the sorted ones */
+  if (out_compact)
+    idmap_sort ();
+  n = nb_idmap;
+
+  for (i = 0; i < fuzzlist.nb; i++)
   {
-    if (strcmp (reg->data[i], "") != 0)
-    {
-      regex (reg->data[i], PS1, ps, SCASE);
-      strcpy (p1, ps[2]);
-      strcpy (p2, ps[3]);
-      strcpy (p3, ps[4]);
-      strcpy (p4, ps[5]);
-      substStr (stripquotes (trim (p1)));
-      substStr (stripquotes (trim (p2)));
-      substStr (stripquotes (trim (p3)));
-      substStr (stripquotes (trim (p4)));
-      if (p1[0] != '\0')
+    if (strcmp (fuzzlist.tab[i].key, fuzzlist.tab[i].val) != 0)
+    {
+      strcpy (bl, fuzzlist.tab[i].key);
+      getBuslist (bl);
+
+      if (alt_install)
       {
-        if (regex (p1, PS2, ps, ICASE))
-        {
-          strcpy (param_t, ps[1]);
-          regex (param_t, PS3, ps, SCASE);
-          strcpy (param_t, ps[1]);
-          if (strcmp (param, param_t) != 0)
-          {
-            found = 0;
-            strcpy (param, param_t);
-            type[0] = '\0';
-            val[0] = '\0';
-          }
-          if (!strcasecmp (p2, "type"))
-          {
-            found++;
-            strcpy (type, p4);
-          }
-          else if (!strcasecmp (p2, "default"))
-          {
-            found++;
-            strcpy (val, p4);
-          }
+        /* source file */
+        snprintf (src, sizeof (src), "%s.%s.conf", fuzzlist.tab[i].val, bl);
 
-          if (found == 2)
-            gotParam = 1;
-        }
-        else if (strncasecmp (p1, "ndi", 3) || !strcasecmp (p1, "ndi"))
+        /* destination link */
+        snprintf (dst, sizeof (dst), "%s.%s.conf", fuzzlist.tab[i].key, bl);
+        if (alt_record (src, dst) < 0)
         {
-          strcpy (param, p2);
-          strcpy (val, p4);
-          gotParam = 1;
+          printf ("Failed to write %s file!\n", alt_install_file);
+          ret = 0;
         }
       }
-      else
+      else if (out_compact)
       {
-        strcpy (param, p2);
-        strcpy (val, p4);
-        gotParam = 1;
+        snprintf (dst, sizeof (dst), "%s.%s", fuzzlist.tab[i].key, bl);
+        snprintf (src, sizeof (src), "%s.%s", fuzzlist.tab[i].val, bl);
+        if (!getIdmap (dst, n) && (conf = getIdmap (src, n))
+            && def_idmap (dst, conf) < 0)
+        {
+          printf ("Unable to map %s\n", dst);
+          ret = 0;
+        }
       }
-
-      if (gotParam && strcmp (param, "") != 0)
+      else
       {
-        if (!strcmp (param, "DriverDesc"))
-          driver_desc = 1;
-        snprintf (s, sizeof (s), "%s|%s", param, val);
-        strcpy (fixlist, s);
-        getFixlist (fixlist);
-        if (strcmp (fixlist, s) != 0)
+        /* destination link */
+        snprintf (dst, sizeof (dst), "%s/%s.%s.conf",
+                  driver_name, fuzzlist.tab[i].key, bl);
+        /* source file */
+        snprintf (src, sizeof (src), "%s.%s.conf", fuzzlist.tab[i].val, bl);
+        if (!out_exists (dst) && 1 != out_symlink (src, dst))
         {
-          strcpy (sOld, s);
-          strcpy (s, fixlist);
-          printf ("Forcing parameter %s to %s\n", sOld, s);
+          printf ("Failed to create symlink!\n");
+          ret = 0;
         }
-        strcpy (param_tab[*k], s);
-        *k = *k + 1;
-        param[0] = '\0';
-        gotParam = 0;
       }
     }
   }
+  if (out_compact && writeIdmap () < 0)
+    ret = 0;
+  return ret;
+}
+
+static int
+install (const char *inf)
+{
+  char install_dir[STRBUFFER];
+  char dst[STRBUFFER];
+  char *slash, *ext;
+  int retval = -1;
+  int loaded, claimed, cached;
+  unsigned long long t;
+
+  if (!file_exists (inf))
+  {
+    printf ("Unable to locate %s\n", inf);
+    return retval;
+  }
+
+  /* a driver archive is read in place, its INF is one of its members */
+  if ((loaded = arc_open (inf)) < 0)
+    return retval;
+  if (loaded)
+    inf = arc.inf;
+
+  ext = strstr (inf,".inf");
+  if (!ext)
+    ext=strstr (inf,".INF");
+  slash = strrchr (inf,'/');
+  if (!slash || !ext)
+  {
+    printf ("%s is not a valid inf filename, "
+            "please provide in format /path/filename.inf\n", inf);
+    arc_close ();
+    return retval;
+  }
+
+  strncpy (driver_name, slash + 1, ext - slash - 1);
+  driver_name[ext - slash - 1] = '\0';
+  lc (driver_name);
+  if (!validName (driver_name))
+  {
+    arc_close ();
+    return retval;
+  }
+  if (alt_install)
+    snprintf (alt_install_file, sizeof (alt_install_file),
+              "%s/%s/ndiswrapper", confdir, driver_name);
+  strncpy (instdir, inf, slash - inf);
+  instdir[slash - inf] = '\0';
+
+  /* the alternate format names its confs itself */
+  if (alt_install)
+    out_compact = 0;
+  if (out_format != OUT_DIR)
+    out_update = 0;
+  else
+    conf_fd = dir_open (AT_FDCWD, confdir);
+  if (out_format == OUT_DIR && !out_update && isInstalled (driver_name))
+  {
+    printf ("%s is already installed. Use -e to remove it\n", driver_name);
+    dir_close (&conf_fd);
+    arc_close ();
+    return retval;
+  }
+
+  if (sysfs_root && presentScan (sysfs_root) < 0)
+  {
+    dir_close (&conf_fd);
+    arc_close ();
+    return retval;
+  }
+
+  /* files of the package are opened relative to its directory */
+  if (!arc.map)
+    pkg_fd = dir_open (AT_FDCWD, instdir[0] ? instdir : "/");
+
+  /* an installed driver has the cache of its INF */
+  cached = conf_fd != -1
+    && snprintf (dst, sizeof (dst), "%s/%s.inf.cache", driver_name,
+                 driver_name) < (int) sizeof (dst);
+  t = stats_start ();
+  trace_begin ("loadinf", inf);
+  loaded = pkg_fd != -1 || arc.map
+    ? loadinf (arc.map ? slash + 1 : inf, conf_fd, cached ? dst : NULL)
+    : 0;
+  trace_end ("loadinf");
+  stats_stop (PHASE_LOADINF, t);
+  if (loaded && out_open () > 0)
+  {
+    if (out_format == OUT_DIR && conf_fd == -1)
+    {
+      my_mkdirat (AT_FDCWD, confdir);
+      conf_fd = dir_open (AT_FDCWD, confdir);
+    }
+
+    printf ("%s %s\n", out_update ? "Updating" : "Installing", driver_name);
+    snprintf (install_dir, sizeof (install_dir), "%s/%s", confdir, driver_name);
+    /* another process may have installed it since the first test */
+    claimed = out_format == OUT_DIR ? claimDriver () : 1;
+    if (claimed > 0 && !out_update && out_format == OUT_DIR && !out_stage)
+    {
+      printf ("%s is already installed. Use -e to remove it\n", driver_name);
+      releaseDriver (0);
+      claimed = -1;
+    }
+    if (claimed > 0 && !out_stage && out_mkdir (driver_name) < 0)
+    {
+      printf ("Unable to create directory %s. "
+              "Make sure you are running as root\n", install_dir);
+      releaseDriver (0);
+      claimed = -1;
+    }
+    if (claimed > 0)
+    {
+      if (out_format == OUT_DIR)
+        drv_fd = dir_open (conf_fd, out_stage ? claim_name : driver_name);
+
+      /* the list is kept in memory and written once, at the end */
+      snprintf (dst, sizeof (dst), "%s/ndiswrapper", driver_name);
+      if (alt_install && !out_fopen (&alt_manifest, dst))
+        printf ("Unable to create file %s\n", alt_install_file);
+
+      t = stats_start ();
+      initStrings ();
+      stats_stop (PHASE_INITSTRINGS, t);
+      t = stats_start ();
+      parseVersion ();
+      stats_stop (PHASE_PARSEVERSION, t);
+      snprintf (dst, sizeof (dst), "%s/%s.inf", driver_name, driver_name);
+      if (out_copy (slash + 1, dst, 0644) != 1)
+        printf ("couldn't copy %s\n", inf);
+      /* the links and the publish need every file in place */
+      else if (copy_join () < 0)
+        printf ("couldn't copy the files of %s\n", driver_name);
+      else
+      {
+        t = stats_start ();
+        trace_begin ("processPCIFuzz", driver_name);
+        if (processPCIFuzz ())
+          retval = 0;
+        trace_end ("processPCIFuzz");
+        stats_stop (PHASE_PCIFUZZ, t);
+        /* the cache is only a shortcut, an install works without it */
+        if (retval == 0 && cache_enable)
+          saveCache ();
+      }
 
-  if (!driver_desc)
-  {
-    strcpy (param_tab[*k], "DriverDesc|NDIS Network Adapter");
-    *k = *k + 1;
+      if (alt_manifest.f && out_fclose (&alt_manifest) < 0)
+        retval = -1;
+      /* the copies are complete, every file of the directory is known */
+      if (retval == 0 && out_manifest () < 0)
+        retval = -1;
+      /* a failed update leaves the installed tree as it was */
+      if (out_update && retval == 0
+          && (out_commit () < 0 || out_prune () < 0))
+        retval = -1;
+    }
+    if (out_close () < 0)
+      retval = -1;
+    /* every file is written, the new directory appears at once */
+    if (claimed > 0 && releaseDriver (retval == 0) < 0)
+      retval = -1;
   }
-
-  return 1;
+  freeinf ();
+  presentFree ();
+  arc_close ();
+  dir_close (&drv_fd);
+  dir_close (&pkg_fd);
+  dir_close (&conf_fd);
+  return retval;
 }
 
+/*
+ * Driver tools
+ * ------------
+ * - remove        : remove a driver
+ * - search_walk   : list the INF files of a tree
+ * - search_inf    : report the searched IDs supported by an INF
+ * - search_cmp    : order of the search results
+ * - search_driver : find the INF files supporting device IDs
+ * - query_map     : find an ID in the ID map of a compact install
+ * - query_conf    : find the conf of an ID in an installed driver
+ * - installed_cmp : order of the installed drivers
+ * - query_close   : forget the installed drivers
+ * - query_open    : index the installed drivers
+ * - query_id      : find the installed conf of a device ID
+ * - query_driver  : find the installed confs of device IDs
+ * - list_drivers  : list the installed drivers
+ * - check_load    : queue the files of the manifest of a driver
+ * - check_worker  : verify the queued files (one per thread)
+ * - check_driver  : verify the files of one or all installed drivers
+ *
+ */
+
 static int
-parseDevice (const char *flavour, const char *device_sect,
-             const char *device, const char *vendor,
-             const char *subvendor, const char *subdevice)
+remove_driver (const char *name)
 {
-  unsigned int i = 0, j, k, push = 0, par_k = 0;
-  char **lines;
-  char **copy_files;
-  char param_tab[LINEBUFFER][STRBUFFER];
-  char keyval[2][STRBUFFER];
-  char sec[STRBUFFER], addreg[STRBUFFER];
-  char filename[STRBUFFER], bt[STRBUFFER], file[STRBUFFER];
-  char bustype[STRBUFFER], alt_filename[STRBUFFER];
-  char ver[STRBUFFER], provider[STRBUFFER], providerstring[STRBUFFER];
-  char *tmp;
-  def_section_t *dev = NULL;
-  FILE *f;
-
-  /*
-   * for RNDIS INF file (for USR5420), vendor section names device
-   * section as RNDIS.NT.5.1, but copyfiles section is RNDIS.NT, so
-   * first strip flavour from device_sect and then look for matching
-   * section
-   */
-  if (!strcmp (device_sect, "RNDIS.NT.5.1"))
-    dev = getSection ("RNDIS.NT");
+  char old[STRBUFFER + 16];
+  int removed, fd = -1;
 
-  if (!dev)
+  if (!validName (name))
+    return -1;
+  conf_fd = dir_open (AT_FDCWD, confdir);
+  snprintf (driver_name, sizeof (driver_name), "%s", name);
+  if (!isInstalled (name) || (claimDriver () > 0 && out_stage))
   {
-    snprintf (sec, sizeof (sec), "%s.%s", device_sect, flavour);
-    dev = getSection (sec);
+    printf
+      ("Driver %s is not installed, Use -l to list installed drivers\n", name);
+    releaseDriver (0);
+    dir_close (&conf_fd);
+    return -1;
   }
-
-  if (!dev)
+  if (!claim_name[0])
   {
-    snprintf (sec, sizeof (sec), "%s.NT", device_sect);
-    dev = getSection (sec);
+    dir_close (&conf_fd);
+    return -1;
   }
 
-  if (!dev)
-  {
-    snprintf (sec, sizeof (sec), "%s.NTx86", device_sect);
-    dev = getSection (sec);
-  }
+  /* the driver disappears at once, then is removed from the claim */
+  snprintf (old, sizeof (old), "%s/old", claim_name);
+  removed = my_renameat (conf_fd, name, conf_fd, old) == 0
+    && (fd = dir_open (conf_fd, claim_name)) != -1 && rmtree (fd, "old");
+  dir_close (&fd);
+  releaseDriver (0);
+  dir_close (&conf_fd);
+  if (removed)
+    return 0;
 
-  if (!dev)
-    dev = getSection (device_sect);
+  printf ("Could not remove driver!\n");
+  return -1;
+}
 
-  if (!dev)
-  {
-    printf ("no dev %s %s\n", device_sect, flavour);
+static int
+search_walk (int dfd, const char *path, char ***infs,
+             unsigned int *nb, unsigned int *size)
+{
+  char *name, **tab;
+  DIR *d;
+  struct dirent *dp;
+  struct stat st;
+  size_t len;
+  int fd;
+
+  if (!(d = dir_read (dfd, ".")))
     return -1;
-  }
+  while ((dp = readdir (d)))
+  {
+    if (!strcmp (dp->d_name, ".") || !strcmp (dp->d_name, "..")
+        || my_fstatat (dfd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
 
-  copy_files = malloc (LINEBUFFER * sizeof (char *));
-  memset (copy_files, 0, LINEBUFFER * sizeof (char *));
+    len = strlen (path) + strlen (dp->d_name) + 2;
+    if (!(name = stats_malloc (len)))
+      break;
+    snprintf (name, len, "%s/%s", path, dp->d_name);
 
-  for (i = 0; i < dev->datalen; i++)
-  {
-    getKeyVal (dev->data[i], keyval);
-    if (keyval[0][0] != '\0')
+    len = strlen (dp->d_name);
+    if (S_ISDIR (st.st_mode) && (fd = dir_open (dfd, dp->d_name)) != -1)
     {
-      if (!strcasecmp (keyval[0], "addreg"))
-        strcpy (addreg, keyval[1]);
-      else if (!strcasecmp (keyval[0], "copyfiles"))
+      search_walk (fd, name, infs, nb, size);
+      dir_close (&fd);
+    }
+    else if (S_ISREG (st.st_mode) && len > 4
+             && !strcasecmp (dp->d_name + len - 4, ".inf"))
+    {
+      if (*nb == *size)
       {
-        copy_files[push] = strdup (keyval[1]);
-        push++;
+        *size = *size ? *size * 2 : 64;
+        tab = stats_realloc (*infs, *size * sizeof (char *));
+        if (!tab)
+          break;
+        *infs = tab;
       }
-      else if (!strcasecmp (keyval[0], "BusType"))
-        def_strings (keyval[0], keyval[1]);
+      (*infs)[(*nb)++] = name;
+      continue;
     }
+    free (name);
   }
+  closedir (d);
+  return 1;
+}
 
-  snprintf (filename, sizeof (filename), "%s:%s", device, vendor);
-  if (subvendor[0] != '\0')
+static void
+search_inf (const char *path, FILE *out)
+{
+  char ver[STRBUFFER];
+  unsigned int i;
+
+  /* only [Version], [Manufacturer] and the models are parsed */
+  if (loadinf (path, AT_FDCWD, NULL))
   {
-    strcat (filename, ":");
-    strcat (filename, subdevice);
-    strcat (filename, ":");
-    strcat (filename, subvendor);
+    initStrings ();
+    parseVersion ();
+    strcpy (ver, "DriverVer");
+    getVersion (ver);
+    for (i = 0; i < nb_search; i++)
+    {
+      if (search[i].match != SEARCH_NONE)
+        fprintf (out, "%d\t%u\t%s, %s\t%s\n", search[i].match, i,
+                 provider_string, ver, path);
+      search[i].match = SEARCH_NONE;
+    }
   }
+  freeinf ();
+}
 
-  snprintf (bt, sizeof (bt), "%X", bus);
-  strcat (filename, ".");
-  strcat (filename, bt);
-  strcat (filename, ".conf");
-  if (bus == WRAP_PCI_BUS || bus == WRAP_PCMCIA_BUS)
-    addPCIFuzzEntry (device, vendor, subvendor, subdevice, bt);
+static int
+search_cmp (const void *a, const void *b)
+{
+  const def_found_t *f1 = a, *f2 = b;
 
-  if (alt_install)
+  if (f1->id != f2->id)
+    return f1->id < f2->id ? -1 : 1;
+  if (f1->match != f2->match)
+    return f1->match > f2->match ? -1 : 1;
+  return strcmp (f1->path, f2->path);
+}
+
+static int
+search_driver (const char *dir, int nb_ids, char **ids)
+{
+  char line[4096];
+  char **infs = NULL, *tab, *path;
+  def_found_t *found = NULL, *f;
+  unsigned int i, j, nb_infs = 0, infs_size = 0, nb_found = 0;
+  unsigned int found_size = 0;
+  unsigned int vendor, device, subdevice, subvendor;
+  int fd, n, nb_workers = 1, res = -1;
+  FILE *in[64];
+  char c;
+#ifndef _WIN32
+  int fds[2], null;
+  pid_t pid[64];
+#endif /* !_WIN32 */
+
+  search = stats_calloc (nb_ids, sizeof (def_search_t));
+  if (!search)
+    return -1;
+  for (i = 0; i < (unsigned int) nb_ids; i++)
   {
-    snprintf (file, sizeof (file), "driver%d", nb_driver);
-    snprintf (alt_filename, sizeof (file), "%s", filename);
-    if ((f = fopen (alt_install_file, "ab")))
-    {
-      fprintf (f, "%s %s\n", file, alt_filename);
-      fclose (f);
-    }
-    else
+    n = sscanf (ids[i], "%4x:%4x:%4x:%4x%c",
+                &vendor, &device, &subdevice, &subvendor, &c);
+    if ((n != 2 && n != 4) || strlen (ids[i]) != (n == 2 ? 9 : 19))
     {
-      printf ("Unable to create file %s\n", alt_install_file);
+      printf ("%s is not a device ID, expected VVVV:DDDD[:SSSS:SSSS]\n",
+              ids[i]);
+      free (search);
+      search = NULL;
       return -1;
     }
-    snprintf (file, sizeof (file),
-              "%s/%s/driver%d", confdir, driver_name, nb_driver++);
+    snprintf (search[i].vd, sizeof (search[i].vd), "%04X:%04X",
+              vendor, device);
+    if (n == 4)
+      snprintf (search[i].id, sizeof (search[i].id), "%s:%04X:%04X",
+                search[i].vd, subdevice, subvendor);
+    else
+      strcpy (search[i].id, search[i].vd);
+    search[i].subsys = n == 4;
   }
-  else
-    snprintf (file, sizeof (file), "%s/%s/%s", confdir, driver_name, filename);
+  nb_search = nb_ids;
 
-  if (!(f = fopen (file, "wb")))
+  if ((fd = dir_open (AT_FDCWD, dir)) == -1)
   {
-    printf ("Unable to create file %s\n", filename);
+    printf ("Unable to open %s\n", dir);
+    free (search);
+    search = NULL;
+    nb_search = 0;
     return -1;
   }
+  search_walk (fd, dir, &infs, &nb_infs, &infs_size);
+  dir_close (&fd);
 
-  /* Split */
-  i = 0;
-  lines = malloc (LINEBUFFER * sizeof (char *));
-  memset (lines, 0, LINEBUFFER * sizeof (char *));
-  if ((tmp = strtok (addreg, ",")) != NULL)
-  {
-    lines[i] = strdup (tmp);
-    while ((tmp = strtok (NULL, ",")) != NULL)
-      lines[++i] = strdup (tmp);
-  }
-  else
-    lines[i] = strdup (addreg);
-
-  j = i + 1;
-  for (i = 0; i < j; i++)
+#ifdef _WIN32
+  in[0] = tmpfile ();
+  for (i = 0; in[0] && i < nb_infs; i++)
+    search_inf (infs[i], in[0]);
+  if (in[0])
+    rewind (in[0]);
+#else /* _WIN32 */
+  /* each worker scans every nb_workers-th INF and reports on a pipe */
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+  nb_workers = n < 1 ? 1 : n > 64 ? 64 : n;
+  if ((unsigned int) nb_workers > nb_infs)
+    nb_workers = nb_infs ? nb_infs : 1;
+  fflush (stdout);
+  for (n = 0; n < nb_workers; n++)
   {
-    trim (lines[i]);
-    addReg (lines[i], param_tab, &par_k);
-    free (lines[i]);
+    in[n] = NULL;
+    pid[n] = -1;
+    if (pipe (fds) < 0)
+      continue;
+    if ((pid[n] = fork ()) == 0)
+    {
+      close (fds[0]);
+      /* parser messages are not part of the report */
+      if ((null = open ("/dev/null", O_WRONLY)) != -1)
+        dup2 (null, 1);
+      in[0] = fdopen (fds[1], "w");
+      for (i = n; in[0] && i < nb_infs; i += nb_workers)
+        search_inf (infs[i], in[0]);
+      if (in[0])
+        fclose (in[0]);
+      _exit (0);
+    }
+    close (fds[1]);
+    if (pid[n] != -1)
+      in[n] = fdopen (fds[0], "r");
+    else
+      close (fds[0]);
   }
+#endif /* !_WIN32 */
 
-  for (k = 0; k < push; k++)
+  /* match \t id \t provider, version \t path */
+  for (n = 0; n < nb_workers; n++)
   {
-    /* Split */
-    i = 0;
-    if ((tmp = strtok (copy_files[k], ",")) != NULL)
+    while (in[n] && fgets (line, sizeof (line), in[n]))
     {
-      lines[i] = strdup (tmp);
-      while ((tmp = strtok (NULL, ",")) != NULL)
-        lines[++i] = strdup (tmp);
+      line[strcspn (line, "\n")] = '\0';
+      if (!(tab = strchr (line, '\t')) || !(tab = strchr (tab + 1, '\t'))
+          || !(path = strchr (tab + 1, '\t')))
+        continue;
+      *tab++ = '\0';
+      *path++ = '\0';
+      if (nb_found == found_size)
+      {
+        found_size = found_size ? found_size * 2 : 64;
+        f = stats_realloc (found, found_size * sizeof (def_found_t));
+        if (!f)
+          break;
+        found = f;
+      }
+      f = &found[nb_found++];
+      f->match = atoi (line) == SEARCH_EXACT ? SEARCH_EXACT : SEARCH_FUZZY;
+      f->id = strtoul (strchr (line, '\t') + 1, NULL, 10);
+      f->info = stats_strdup (tab);
+      f->path = stats_strdup (path);
     }
-    else
-      lines[i] = strdup (copy_files[k]);
-    free (copy_files[k]);
+    if (in[n])
+      fclose (in[n]);
+#ifndef _WIN32
+    if (pid[n] > 0)
+      waitpid (pid[n], NULL, 0);
+#endif /* !_WIN32 */
+  }
 
-    j = i + 1;
-    for (i = 0; i < j; i++)
+  /* per ID, exact matches first */
+  qsort (found, nb_found, sizeof (def_found_t), search_cmp);
+  for (i = 0; i < nb_search; i++)
+  {
+    for (j = 0; j < nb_found && found[j].id != i; j++)
+      ;
+    if (j == nb_found)
+      printf ("%s : no INF found\n", search[i].id);
+    for (; j < nb_found && found[j].id == i; j++)
     {
-      trim (lines[i]);
-      copyfiles (lines[i]);
-      free (lines[i]);
+      printf ("%s : %s %s (%s)\n", search[i].id,
+              found[j].match == SEARCH_EXACT ? "exact" : "fuzzy",
+              found[j].path, found[j].info);
+      res = 0;
     }
   }
 
-  fprintf (f, "sys_files|%s\n", sys_files);
-  strcpy (ver, "DriverVer");
-  getVersion (ver);
-  strcpy (provider, "Provider");
-  getVersion (provider);
-  strcpy (providerstring, provider);
-  stripquotes (substStr (trim (providerstring)));
-
-  fputs ("NdisVersion|0x50001\n", f);
-  fputs ("Environment|1\n", f);
-  fprintf (f, "class_guid|%s\n", classguid);
-  fprintf (f, "driver_version|%s,%s\n", providerstring, ver);
-  strcpy (bustype, "BusType");
-  getString (bustype);
-  fprintf (f, "BusType|%s\n", bustype);
-  fputs ("SlotNumber|01\n", f);
-  fputs ("NetCfgInstanceId|{28022A01-1234-5678-ABCDE-123813291A00}\n", f);
-  fputs ("\n", f);
-
-  /* sort and unify before writing */
-  unisort (param_tab, &par_k);
-  for (i = 0; i < par_k; i++)
-    fprintf (f, "%s\n", param_tab[i]);
-
-  fclose (f);
-  free (copy_files);
-  free (lines);
-  return 1;
+  for (i = 0; i < nb_found; i++)
+  {
+    free (found[i].path);
+    free (found[i].info);
+  }
+  free (found);
+  for (i = 0; i < nb_infs; i++)
+    free (infs[i]);
+  free (infs);
+  free (search);
+  search = NULL;
+  nb_search = 0;
+  return res;
 }
 
-static int
-parseID (const char *id, int *bt, char *vendor,
-         char *device, char *subvendor, char *subdevice)
+/*
+ * Main
+ * ----
+ *
+ */
+
+static const char *
+query_map (const char *map, size_t size, const char *key, size_t *len)
 {
-  char *ptr1, *ptr2, *ptr3;
-  ptr1 = strstr (id, "PCI\\VEN_");
-  ptr2 = strstr (id, "&DEV_");
-  ptr3 = strstr (id, "&SUBSYS_");
-  if (ptr1 && ptr2)
+  size_t lo = 0, hi = size, mid, klen = strlen (key), i;
+  const char *line, *end;
+  int cmp;
+
+  /* lower bound of the key among the sorted lines */
+  while (lo < hi)
   {
-    *bt = WRAP_PCI_BUS;
-    strncpy (vendor, ptr1 + strlen ("PCI\\VEN_"), 4);
-    vendor[4] = '\0';
-    strncpy (device, ptr2 + strlen ("&DEV_"), 4);
-    device[4] = '\0';
-    if (ptr3)
+    for (mid = lo + (hi - lo) / 2; mid > lo && map[mid - 1] != '\n'; mid--)
+      ;
+    line = map + mid;
+    for (i = 0, cmp = 0; i < klen && !cmp; i++)
+      cmp = mid + i < size && line[i] != '\n'
+        ? (unsigned char) line[i] - (unsigned char) key[i] : -1;
+    if (cmp < 0)
     {
-      strncpy (subdevice, ptr3 + strlen ("&SUBSYS_"), 4);
-      subdevice[4] = '\0';
-      strncpy (subvendor, ptr3 + strlen ("&SUBSYS_")+4, 4);
-      subvendor[4] = '\0';
+      end = memchr (line, '\n', size - mid);
+      lo = end ? (size_t) (end - map) + 1 : size;
     }
     else
-    {
-      subvendor[0] = '\0';
-      subdevice[0] = '\0';
-    }
-  }
-  else
-  {
-    ptr1 = strstr (id, "USB\\VID_");
-    ptr2 = strstr (id, "&PID_");
-    *bt = WRAP_USB_BUS;
-    strncpy (vendor, ptr1 + strlen ("USB\\VID_"), 4);
-    vendor[4] = '\0';
-    strncpy (device, ptr2 + strlen ("&PID_"), 4);
-    device[4] = '\0';
-    subvendor[0] = '\0';
-    subdevice[0] = '\0';
+      hi = mid;
   }
-  return 1;
+
+  if (lo + klen > size || memcmp (map + lo, key, klen))
+    return NULL;
+  line = memchr (map + lo, ' ', size - lo);
+  end = memchr (map + lo, '\n', size - lo);
+  if (!end)
+    end = map + size;
+  if (!line || line > end)
+    return NULL;
+  *len = end - line - 1;
+  return line + 1;
 }
 
 static int
-parseVendor (const char *flavour, const char *vendor_name)
+query_conf (int dfd, const char *map, size_t size, const char *id,
+            char *conf, size_t conf_size)
 {
-  unsigned int i = 0;
-  int bt;
-  char keyval[2][STRBUFFER];
-  char section[STRBUFFER], id[STRBUFFER];
-  char vendor[5], device[5];
-  char subvendor[5], subdevice[5];
-  def_section_t *vend = NULL;
+  static const char *buses[] = { "5", "8", "F" };
+  char key[STRBUFFER];
+  const char *found;
+  struct stat st;
+  unsigned int i;
+  size_t len;
 
-  vend = getSection (vendor_name);
-  if (vend == NULL)
+  /* an ID of any bus is "VVVV:DDDD[:SSSS:SSSS]." in the map */
+  if (map)
   {
-    printf ("Could not find section for %s in inf file!\n", vendor_name);
-    return -1;
+    snprintf (key, sizeof (key), "%s.", id);
+    found = query_map (map, size, key, &len);
+    if (!found)
+      return 0;
+    snprintf (conf, conf_size, "%.*s", (int) len, found);
+    return 1;
   }
 
-  for (i = 0; i < vend->datalen; i++)
+  for (i = 0; i < sizeof (buses) / sizeof (buses[0]); i++)
   {
-    getKeyVal (vend->data[i], keyval);
-    if (keyval[1][0] != '\0')
-    {
-      strcpy (section, strtok (keyval[1], ","));
-      strcpy (id, strtok (NULL, ","));
-      trim (section);
-      uc (substStr (trim (id)));
-      parseID (id, &bt, vendor, device, subvendor, subdevice);
-      bus = bt;
-      if (vendor[0] != '\0')
-        parseDevice (flavour, section, vendor, device, subvendor, subdevice);
-    }
+    snprintf (conf, conf_size, "%s.%s.conf", id, buses[i]);
+    if (my_fstatat (dfd, conf, &st, 0) == 0)
+      return 1;
   }
   return 0;
 }
 
 static int
-parseMfr (void)
+installed_cmp (const void *a, const void *b)
 {
-  /*
-   * Examples:
-   * Vendor
-   * Vendor,ME,NT,NT.5.1
-   * Vendor.NTx86
-   */
-  unsigned int i = 0, k, l;
-  int res = 0;
-  char keyval[2][STRBUFFER];
-  char **flavours;
-  char sp[2][STRBUFFER];
-  char ver[STRBUFFER];
-  char section[STRBUFFER] = "";
-  char flavour[STRBUFFER];
-  char *tmp;
-  def_section_t *manu = NULL;
+  return strcmp (((const def_installed_t *) a)->name,
+                 ((const def_installed_t *) b)->name);
+}
 
-  manu = getSection ("manufacturer");
-  if (!manu)
+static void
+query_close (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < nb_installed; i++)
   {
-    printf ("Could not find section 'manufacturer' in inf file!\n");
-    return -1;
+    my_munmap (installed[i].map, installed[i].size);
+    dir_close (&installed[i].fd);
+    free (installed[i].name);
   }
+  free (installed);
+  installed = NULL;
+  nb_installed = 0;
+}
 
-  for (i = 0; i < manu->datalen; i++)
-  {
-    getKeyVal (manu->data[i], keyval);
+static int
+query_open (void)
+{
+  def_installed_t *tab;
+  unsigned int size = 0;
+  struct dirent *dp;
+  DIR *d;
+  int dfd, fd;
 
-    strcpy (ver, "Provider");
-    getVersion (ver);
-    if (!strcmp (keyval[0], ver))
-      def_strings (keyval[0], keyval[1]);
+  if ((dfd = dir_open (AT_FDCWD, confdir)) == -1
+      || !(d = dir_read (dfd, ".")))
+  {
+    printf ("Unable to open %s\n", confdir);
+    dir_close (&dfd);
+    return -1;
+  }
 
-    if (keyval[1][0] != '\0')
+  /* the installed drivers, with the ID map of the compact ones */
+  while ((dp = readdir (d)))
+  {
+    if (dp->d_name[0] == '.' || (fd = dir_open (dfd, dp->d_name)) == -1)
+      continue;
+    if (nb_installed == size)
     {
-      flavour[0] = '\0';
-      /* Split */
-      k = 0;
-      flavours = malloc (LINEBUFFER * sizeof (char *));
-      memset (flavours, 0, LINEBUFFER * sizeof (char *));
-      if ((tmp = strtok (keyval[1], ",")) != NULL)
-      {
-        flavours[k] = strdup (tmp);
-        stripquotes (trim (flavours[k]));
-        while ((tmp = strtok (NULL, ",")) != NULL)
-        {
-          flavours[++k] = strdup (tmp);
-          *(tmp - 1) = ',';
-          stripquotes (trim (flavours[k]));
-        }
-      }
-      else
+      size = size ? size * 2 : 16;
+      tab = stats_realloc (installed, size * sizeof (def_installed_t));
+      if (!tab)
       {
-        flavours[k] = strdup (keyval[1]);
-        stripquotes (trim (flavours[k]));
+        dir_close (&fd);
+        break;
       }
+      installed = tab;
+    }
+    installed[nb_installed].name = stats_strdup (dp->d_name);
+    installed[nb_installed].fd = fd;
+    installed[nb_installed].map = my_mmap (fd, "idmap",
+                                           &installed[nb_installed].size);
+    if (!installed[nb_installed].name)
+    {
+      my_munmap (installed[nb_installed].map, installed[nb_installed].size);
+      dir_close (&fd);
+      continue;
+    }
+    nb_installed++;
+  }
+  closedir (d);
+  dir_close (&dfd);
+  qsort (installed, nb_installed, sizeof (def_installed_t), installed_cmp);
+  return 1;
+}
 
-      if (k == 0)
-      {
-        /* Vendor */
-        strcpy (section, flavours[0]);
-        free (flavours[0]);
-      }
-      else
+static int
+query_id (const char *devid)
+{
+  char id[STRBUFFER], conf[STRBUFFER];
+  unsigned int i;
+  int k;
+
+  snprintf (id, sizeof (id), "%s", devid);
+  uc (id);
+  /* like the loader : the exact ID, then the generic vendor:device */
+  for (k = 0; k < 2; k++)
+  {
+    for (i = 0; i < nb_installed; i++)
+      if (query_conf (installed[i].fd, installed[i].map, installed[i].size,
+                      id, conf, sizeof (conf)))
       {
-        l = k + 1;
-        for (k = 1; k < l; k++)
-        {
-          regex (flavours[k],
-                 "[[:space:]]*([^[:space:]]+)[[:space:]]*", sp, SCASE);
-          if (!strcasecmp (sp[1], "NT.5.1"))
-          {
-            /* This is the best (XP) */
-            snprintf (section, sizeof (section), "%s.%s", flavours[0], sp[1]);
-            strcpy (flavour, sp[1]);
-          }
-          else
-          {
-            if (!strncasecmp(sp[1], "NT", 2) && section[0] == '\0')
-            {
-              /* This is the second best (win2k) */
-              snprintf (section, sizeof (section), "%s.%s", flavours[0], sp[1]);
-              strcpy (flavour, sp[1]);
-            }
-          }
-          free (flavours[k]);
-        }
-        free (flavours[0]);
+        printf ("%s %s/%s\n", devid, installed[i].name, conf);
+        return 1;
       }
-      if (!res)
-        res = parseVendor (flavour, section);
-      free (flavours);
-    }
+    if (strlen (id) <= 9)
+      break;
+    id[9] = '\0';
   }
+  printf ("%s not found\n", devid);
+  return 0;
+}
+
+static int
+query_driver (int nb_ids, char **ids)
+{
+  int i, res = 0;
+
+  if (query_open () < 0)
+    return -1;
+  for (i = 0; i < nb_ids; i++)
+    if (!query_id (ids[i]))
+      res = -1;
+  query_close ();
   return res;
 }
 
 static int
-parseVersion (void)
+list_drivers (void)
 {
-  unsigned int i = 0;
-  char keyval[2][STRBUFFER];
-  char *ptr1, *ptr2;
-  def_section_t *s = NULL;
+  unsigned int i;
 
-  s = getSection ("version");
-  if (!s)
-  {
-    printf ("Could not find section 'version' in inf file!\n");
+  if (!installed && query_open () < 0)
     return -1;
-  }
+  printf ("Installed drivers:\n");
+  for (i = 0; i < nb_installed; i++)
+    printf ("%s\t\tdriver installed%s\n", installed[i].name,
+            installed[i].map ? " (compact)" : "");
+  return 0;
+}
 
-  /* Split */
-  for (i = 0; i < s->datalen; i++)
+static int
+check_load (unsigned int drv)
+{
+  char *map, *p, *end, *eol, *name;
+  def_check_t *tab;
+  unsigned long long fsize;
+  unsigned long crc;
+  size_t size;
+
+  if (!(map = my_mmap (installed[drv].fd, MANIFEST, &size)))
+    return -1;
+
+  /* "crc32c size name" lines */
+  for (p = map, end = map + size; p < end; p = eol + 1)
   {
-    getKeyVal (s->data[i], keyval);
-    if (!strcmp (keyval[0], "Provider"))
+    if (!(eol = memchr (p, '\n', end - p)))
+      eol = end;
+    if (eol - p < 12)
+      continue;
+    crc = strtoul (p, &name, 16);
+    fsize = strtoull (name, &name, 10);
+    if (*name++ != ' ' || name >= eol)
+      continue;
+
+    if (nb_checks == checks_size)
     {
-      stripquotes (keyval[1]);
-      def_version (keyval[0], keyval[1]);
+      checks_size = checks_size ? checks_size * 2 : 256;
+      tab = stats_realloc (checks, checks_size * sizeof (def_check_t));
+      if (!tab)
+      {
+        checks_size = nb_checks;
+        break;
+      }
+      checks = tab;
     }
+    if (!(checks[nb_checks].name = stats_strndup (name, eol - name)))
+      break;
+    checks[nb_checks].drv = drv;
+    checks[nb_checks].size = fsize;
+    checks[nb_checks].crc = crc;
+    checks[nb_checks].error = NULL;
+    nb_checks++;
+  }
+  my_munmap (map, size);
+  return 1;
+}
+
+static void *
+check_worker (void *arg)
+{
+  char rwbuf[64 * 1024];
+  def_check_t *c;
+  unsigned long long size;
+  unsigned int crc;
+  ssize_t nbytes;
+  int fd;
+
+  (void) arg;
+  for (;;)
+  {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock (&checks_lock);
+#endif /* HAVE_PTHREAD */
+    c = next_check < nb_checks ? &checks[next_check++] : NULL;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock (&checks_lock);
+#endif /* HAVE_PTHREAD */
+    if (!c)
+      break;
 
-    if (!strcmp (keyval[0], "DriverVer"))
+    if ((fd = my_openat (installed[c->drv].fd, c->name,
+                         O_RDONLY | O_BINARY, 0)) == -1)
     {
-      stripquotes (keyval[1]);
-      def_version (keyval[0], keyval[1]);
+      c->error = "missing";
+      continue;
     }
-
-    if (!strcmp (keyval[0], "ClassGUID"))
+    size = 0;
+    crc = 0;
+    while ((nbytes = read (fd, rwbuf, sizeof (rwbuf))) > 0)
     {
-      ptr1 = strchr (keyval[1], '{');
-      ptr2 = strchr (keyval[1], '}');
-      strncpy (classguid, ptr1 + 1, ptr2 - ptr1 - 1);
-      classguid[ptr2-ptr1-1] = '\0';
-      lc (classguid);
+      crc = crc32c (crc, rwbuf, nbytes);
+      size += nbytes;
     }
+    close (fd);
+    if (nbytes < 0)
+      c->error = "unreadable";
+    else if (size != c->size)
+      c->error = "size mismatch";
+    else if (crc != c->crc)
+      c->error = "checksum mismatch";
   }
-  parseMfr ();
-  return 1;
+  trace_release ();
+  return NULL;
 }
 
-/*
- * INF installation
- * ----------------
- * - initStrings    : init "strings" section
- * - loadinf        : load INF in memory
- * - isInstalled    : test if the driver is already installed
- * - processPCIFuzz : create symbolic link
- * - install        : install driver described by INF
- *
- */
-
 static int
-initStrings (void)
+check_driver (const char *name)
 {
-  unsigned int i = 0;
-  char keyval[2][STRBUFFER];
-  char ps[STRBUFFER], *ptr1, *ptr2;
-  def_section_t *s = NULL;
+  unsigned int i, j, bad;
+  int res = 0;
+#ifdef HAVE_PTHREAD
+  pthread_t workers[COPY_WORKERS];
+  unsigned int nb_workers = 0;
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+#endif /* HAVE_PTHREAD */
 
-  s = getSection ("strings");
-  if (s == NULL)
-  {
-    printf ("Could not find section 'strings' in inf file!\n");
+  if (!installed && query_open () < 0)
     return -1;
-  }
-
-  for (i = 0; i < s->datalen; i++)
+  if (name)
   {
-    getKeyVal (s->data[i], keyval);
-    if (keyval[1][0] != '\0')
+    for (i = 0; i < nb_installed && strcmp (installed[i].name, name); i++)
+      ;
+    if (i == nb_installed)
     {
-      ptr1 = strchr (keyval[1], '"');
-      ptr2 = strchr (ptr1+1, '"');
-      strncpy (ps, ptr1 + 1, ptr2 - ptr1 - 1);
-      ps[ptr2-ptr1-1] = '\0';
-      def_strings (keyval[0], ps);
+      printf ("Driver %s is not installed, Use -l to list installed drivers\n",
+              name);
+      return -1;
     }
   }
-  return 1;
+
+  for (i = 0; i < nb_installed; i++)
+    if ((!name || !strcmp (installed[i].name, name)) && check_load (i) < 0)
+      printf ("%s\t\tno manifest\n", installed[i].name);
+
+  /* the files of all the drivers are shared by one thread per core */
+#ifdef HAVE_PTHREAD
+  while (nb_workers + 1 < (unsigned long) cpus && nb_workers < COPY_WORKERS
+         && nb_workers + 1 < nb_checks
+         && !pthread_create (&workers[nb_workers], NULL, check_worker, NULL))
+    nb_workers++;
+#endif /* HAVE_PTHREAD */
+  check_worker (NULL);
+#ifdef HAVE_PTHREAD
+  while (nb_workers)
+    pthread_join (workers[--nb_workers], NULL);
+#endif /* HAVE_PTHREAD */
+
+  /* the files of a driver are consecutive */
+  for (i = 0; i < nb_checks; i = j)
+  {
+    for (bad = 0, j = i; j < nb_checks && checks[j].drv == checks[i].drv; j++)
+      if (checks[j].error)
+      {
+        printf ("%s/%s: %s\n", installed[checks[j].drv].name, checks[j].name,
+                checks[j].error);
+        bad++;
+      }
+    printf ("%s\t\t%u files, %s\n", installed[checks[i].drv].name, j - i,
+            bad ? "corrupted" : "verified");
+    if (bad)
+      res = -1;
+  }
+
+  for (i = 0; i < nb_checks; i++)
+    free (checks[i].name);
+  free (checks);
+  checks = NULL;
+  nb_checks = 0;
+  checks_size = 0;
+  next_check = 0;
+  return res;
 }
 
+/*
+ * Daemon
+ * ------
+ * - frame_write   : send a frame
+ * - frame_read    : receive a frame
+ * - daemon_signal : stop the daemon
+ * - daemon_args   : run the request of a client
+ * - daemon_run    : serve the requests on a Unix socket
+ * - client_run    : send a request to the daemon
+ *
+ * A frame is a 32 bits big endian length and a payload. A request is
+ * the arguments of a command line, each one followed by a '\0', the
+ * answer is a status byte ('0' or '1') and the output of the command.
+ * The index of the installed drivers is kept between the requests and
+ * rebuilt after an install or a removal. A client sends its request
+ * within FRAME_TIMEOUT seconds, or is dropped.
+ *
+ */
+
+#ifndef _WIN32
 static int
-loadinf (const char *filename)
+frame_write (int fd, const char *status, const char *data, size_t len)
 {
-  char s[STRBUFFER];
-  char *lbracket, *rbracket;
-  FILE *f;
-  int res = 0;
-
-  if (!sections)
+  unsigned char head[4];
+  struct iovec iov[3];
+  size_t total = len + (status ? 1 : 0);
+  ssize_t n;
+  int iovcnt = 0;
+
+  head[0] = total >> 24;
+  head[1] = total >> 16;
+  head[2] = total >> 8;
+  head[3] = total;
+  iov[iovcnt].iov_base = head;
+  iov[iovcnt++].iov_len = sizeof (head);
+  if (status)
   {
-    printf ("Memory for 'sections' not allocated!\n");
-    return res;
-  }
-  if ((f = fopen (filename, "rb")) == NULL)
-  {
-    printf ("Could not open %s for reading!\n", filename);
-    return res;
+    iov[iovcnt].iov_base = (void *) status;
+    iov[iovcnt++].iov_len = 1;
   }
+  iov[iovcnt].iov_base = (void *) data;
+  iov[iovcnt++].iov_len = len;
 
-  while (fgets (s, sizeof (s), f))
+  /* a socket may take a part of the frame only */
+  while (iovcnt)
   {
-    res = 1;
-    if (!nb_sections)
+    if ((n = my_writev (fd, iov, iovcnt)) < 0)
     {
-      nb_sections++;
-      sections[nb_sections-1] = malloc (sizeof (def_section_t));
-      strcpy (sections[nb_sections-1]->name, "none");
-      sections[nb_sections-1]->data = malloc (LINEBUFFER * sizeof (char *));
-      memset (sections[nb_sections-1]->data, 0, LINEBUFFER * sizeof (char *));
-      sections[nb_sections-1]->datalen = 0;
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
-    lbracket = strchr (s,'[');
-    rbracket = strchr (s,']');
-    if (lbracket && rbracket)
+    for (; iovcnt && (size_t) n >= iov[0].iov_len; iovcnt--)
     {
-      nb_sections++;
-      sections[nb_sections - 1] = malloc (sizeof (def_section_t));
-      strncpy (sections[nb_sections - 1]->name,
-               lbracket + 1, rbracket - lbracket - 1);
-      sections[nb_sections - 1]->name[rbracket - lbracket - 1] = '\0';
-      sections[nb_sections - 1]->data = malloc (LINEBUFFER * sizeof (char *));
-      memset (sections[nb_sections - 1]->data, 0, LINEBUFFER * sizeof (char *));
-      sections[nb_sections - 1]->datalen = 0;
+      n -= iov[0].iov_len;
+      memmove (iov, iov + 1, (iovcnt - 1) * sizeof (struct iovec));
     }
-    else
+    if (iovcnt)
     {
-      trim (remComment (s));
-      if (strlen (s) > 0)
-        sections[nb_sections - 1]->data[sections[nb_sections - 1]->datalen++] =
-          strdup (s);
+      iov[0].iov_base = (char *) iov[0].iov_base + n;
+      iov[0].iov_len -= n;
     }
   }
-  fclose (f);
-  return res;
+  return 1;
 }
 
-static int
-isInstalled (const char *name)
+static char *
+frame_read (int fd, size_t max, time_t deadline, size_t *len)
 {
-  int installed = 0;
-  char f_path[STRBUFFER];
-  DIR *d;
-  struct dirent *dp;
-  struct stat st;
-
-  stat (confdir, &st);
-  if (!S_ISDIR (st.st_mode))
-    return 0;
-
-  d = opendir (confdir);
-  while ((dp = readdir (d)))
-  {
-    snprintf (f_path, sizeof (f_path), "%s/%s", confdir, dp->d_name);
-    stat (f_path, &st);
-    if (S_ISDIR (st.st_mode) && !strcmp (name, dp->d_name))
+  unsigned char head[4];
+  char *data;
+  size_t done;
+  ssize_t n;
+
+  /* a read times out on the socket, the whole frame at the deadline */
+  for (done = 0; done < sizeof (head); done += n)
+    if ((deadline && time (NULL) > deadline)
+        || (n = read (fd, head + done, sizeof (head) - done)) <= 0)
+      return NULL;
+  *len = (size_t) head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+  if (*len > max || !(data = stats_malloc (*len + 1)))
+    return NULL;
+  for (done = 0; done < *len; done += n)
+    if ((deadline && time (NULL) > deadline)
+        || (n = read (fd, data + done, *len - done)) <= 0)
     {
-      installed = 1;
-      break;
+      free (data);
+      return NULL;
     }
-  }
-  closedir (d);
-  return installed;
+  data[*len] = '\0';
+  return data;
+}
+
+static void
+daemon_signal (int sig)
+{
+  (void) sig;
+  daemon_stop = 1;
 }
 
 static int
-processPCIFuzz (void)
+daemon_args (int argc, char **argv)
 {
-  unsigned int i;
-  int ret = 1;
-  char bl[STRBUFFER];
-  char src[STRBUFFER], dst[STRBUFFER];
-  FILE *f;
+  int i, res = -1;
 
-  for (i = 0; i < nb_fuzzlist; i++)
-  {
-    if (strcmp (fuzzlist[i].key, fuzzlist[i].val) != 0)
-    {
-      strcpy (bl, fuzzlist[i].key);
-      getBuslist (bl);
+  /* the options of a request do not outlive it */
+  alt_install = 0;
+  out_update = 0;
+  out_compact = 0;
 
-      if (alt_install)
-      {
-        /* source file */
-        snprintf (src, sizeof (src), "%s.%s.conf", fuzzlist[i].val, bl);
+  /* an empty frame is a request without arguments */
+  if (!argc)
+  {
+    printf ("Unknown request\n");
+    return -1;
+  }
 
-        /* destination link */
-        snprintf (dst, sizeof (dst), "%s.%s.conf", fuzzlist[i].key, bl);
-        f = fopen (alt_install_file, "ab");
-        if (f)
-        {
-          fprintf (f, "%s %s\n", src, dst);
-          fclose (f);
-          return 1;
-        }
-        else
-        {
-          printf ("Failed to open %s file!\n", alt_install_file);
-          return 0;
-        }
-      }
-      else
-      {
-        /* destination link */
-        snprintf (dst, sizeof (dst), "%s/%s/%s.%s.conf",
-                  confdir, driver_name, fuzzlist[i].key, bl);
-#ifdef _WIN32
-        /* source file */
-        snprintf (src, sizeof (src), "%s/%s/%s.%s.conf",
-                  confdir, driver_name, fuzzlist[i].val, bl);
-        if (!file_exists (dst) && 1 != copy (src, dst, 0644))
-        {
-          printf ("Failed to copy file!\n");
-          ret = 0;
-        }
-#else /* _WIN32 */
-        /* source file */
-        snprintf (src, sizeof (src), "%s.%s.conf", fuzzlist[i].val, bl);
-        if (!file_exists (dst) && 0 != symlink (src, dst))
-        {
-          printf ("Failed to create symlink!\n");
-          ret = 0;
-        }
-#endif /* !_WIN32 */
-      }
-    }
+  if (argc > 1 && (!strcmp (argv[0], "-i") || !strcmp (argv[0], "-u")))
+  {
+    out_update = argv[0][1] == 'u';
+    for (i = 2; i < argc; i++)
+      if (!strcmp (argv[i], "-a"))
+        alt_install = 1;
+      else if (!strcmp (argv[i], "--compact"))
+        out_compact = 1;
+    res = install (argv[1]);
   }
-  return ret;
+  /* a driver name of a client is a directory of confdir */
+  else if (argc == 2 && !strcmp (argv[0], "-e"))
+  {
+    if (!validName (argv[1]))
+      return -1;
+    res = remove_driver (argv[1]);
+  }
+  else if (argc > 1 && !strcmp (argv[0], "-q"))
+  {
+    for (res = 0, i = 1; i < argc; i++)
+      if (!query_id (argv[i]))
+        res = -1;
+    return res;
+  }
+  else if (argc == 1 && !strcmp (argv[0], "-l"))
+    return list_drivers ();
+  else if (argc <= 2 && !strcmp (argv[0], "-c"))
+    return argc == 2 && !validName (argv[1]) ? -1
+      : check_driver (argc == 2 ? argv[1] : NULL);
+  else
+  {
+    printf ("Unknown request %s\n", argv[0]);
+    return -1;
+  }
+
+  /* the installed drivers changed */
+  query_close ();
+  query_open ();
+  return res;
 }
 
 static int
-install (const char *inf)
+daemon_run (const char *path)
 {
-  char install_dir[STRBUFFER];
-  char dst[STRBUFFER];
-  DIR *dir;
-  unsigned int i, j;
-  char *slash, *ext;
-  int retval = -1;
-
-  if (!file_exists (inf))
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct timeval tv;
+  char *req, *out, *argv[STRBUFFER];
+  size_t len, i;
+  off_t size;
+  mode_t mask;
+  int sfd, cfd, saved, argc, res;
+  FILE *tmp;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
   {
-    printf ("Unable to locate %s\n", inf);
-    return retval;
+    printf ("Socket path %s is too long\n", path);
+    return -1;
   }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
 
-  ext = strstr (inf,".inf");
-  if (!ext)
-    ext=strstr (inf,".INF");
-  slash = strrchr (inf,'/');
-  if (!slash || !ext)
+  /* the output of a request is captured in a temporary file */
+  if (!(tmp = tmpfile ()))
+    return -1;
+  unlink (path);
+  /* only the user of the daemon may connect : it runs the requests */
+  mask = umask (0177);
+  if ((sfd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1
+      || bind (sfd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (sfd, 16) < 0)
   {
-    printf ("%s is not a valid inf filename, "
-            "please provide in format /path/filename.inf\n", inf);
-    return retval;
+    printf ("Unable to listen on %s\n", path);
+    umask (mask);
+    if (sfd != -1)
+      close (sfd);
+    fclose (tmp);
+    return -1;
   }
 
-  strncpy (driver_name, slash + 1, ext - slash - 1);
-  driver_name[ext-slash] = '\0';
-  lc (driver_name);
-  if (alt_install)
-    snprintf (alt_install_file, sizeof (alt_install_file),
-              "%s/%s/ndiswrapper", confdir, driver_name);
-  strncpy (instdir, inf, slash - inf);
-  instdir[slash-inf + 1] = '\0';
+  umask (mask);
 
-  if (isInstalled (driver_name))
-  {
-    printf ("%s is already installed. Use -e to remove it\n", driver_name);
-    return retval;
-  }
+  /* no SA_RESTART : accept() returns on a signal */
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = daemon_signal;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
 
-  sections = malloc (STRBUFFER * sizeof (def_section_t *));
-  memset (sections, 0, STRBUFFER * sizeof (def_section_t *));
-  if (loadinf (inf))
+  query_open ();
+  while (!daemon_stop)
   {
-    if ((dir = opendir (confdir)) != NULL)
-      closedir (dir);
-    else
-      my_mkdir (confdir);
-
-    printf ("Installing %s\n", driver_name);
-    snprintf (install_dir, sizeof (install_dir), "%s/%s", confdir, driver_name);
-    if (my_mkdir (install_dir) == -1)
+    if ((cfd = accept (sfd, NULL, NULL)) == -1)
+      continue;
+    /* a client which stops sending, or reading, does not hold the daemon */
+    tv.tv_sec = FRAME_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt (cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    setsockopt (cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+    if (!(req = frame_read (cfd, FRAME_MAX, time (NULL) + FRAME_TIMEOUT,
+                            &len)))
     {
-      printf ("Unable to create directory %s. "
-              "Make sure you are running as root\n", install_dir);
-      return retval;
+      close (cfd);
+      continue;
     }
+    for (argc = 0, i = 0; i < len && argc < STRBUFFER; i += strlen (req + i) + 1)
+      argv[argc++] = req + i;
 
-    initStrings ();
-    parseVersion ();
-    snprintf (dst, sizeof (dst), "%s/%s.inf", install_dir, driver_name);
-    if (!copy (inf, dst, 0644))
+    fflush (stdout);
+    rewind (tmp);
+    if (ftruncate (fileno (tmp), 0) < 0 || (saved = dup (1)) == -1)
     {
-      printf ("couldn't copy %s\n", inf);
-      return retval;
+      frame_write (cfd, "1", NULL, 0);
+      free (req);
+      close (cfd);
+      continue;
     }
-
-    if (processPCIFuzz ())
-      retval = 0;
+    dup2 (fileno (tmp), 1);
+    res = daemon_args (argc, argv);
+    fflush (stdout);
+    dup2 (saved, 1);
+    close (saved);
+
+    size = lseek (fileno (tmp), 0, SEEK_CUR);
+    out = size > 0 ? stats_malloc (size) : NULL;
+    if (out && pread (fileno (tmp), out, size, 0) != size)
+      size = 0;
+    frame_write (cfd, res < 0 ? "1" : "0", out ? out : "",
+                 out ? (size_t) size : 0);
+    free (out);
+    free (req);
+    close (cfd);
   }
-  if (sections)
-  {
-    for (i = 0; i < nb_sections; i++)
-      if (sections[i])
-      {
-        for (j = 0; j < sections[i]->datalen; j++)
-          free (sections[i]->data[j]);
-        free (sections[i]->data);
-        free (sections[i]);
-      }
-    free (sections);
-  }
-  return retval;
-}
 
-/*
- * Driver tools
- * ------------
- * - remove : remove a driver
- *
- */
+  query_close ();
+  close (sfd);
+  unlink (path);
+  fclose (tmp);
+  return 0;
+}
 
 static int
-remove_driver (const char *name)
+client_run (const char *path, int argc, char **argv)
 {
-  char driver[STRBUFFER];
+  struct sockaddr_un addr;
+  char arg[PATH_MAX], *answer;
+  def_buf_t req = { 0 };
+  size_t len;
+  int i, fd, res = -1;
 
-  if (!isInstalled (name))
+  if (strlen (path) >= sizeof (addr.sun_path))
   {
-    printf
-      ("Driver %s is not installed, Use -l to list installed drivers\n", name);
+    printf ("Socket path %s is too long\n", path);
     return -1;
   }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
 
-  snprintf (driver, sizeof (driver), "%s/%s", confdir, name);
-  if (rmtree (driver))
-    return 0;
-
-  printf ("Could not remove driver!\n");
-  return -1;
+  /* the daemon has its own working directory */
+  for (i = 0; i < argc; i++)
+  {
+    if (i == 1 && (!strcmp (argv[0], "-i") || !strcmp (argv[0], "-u"))
+        && realpath (argv[i], arg))
+      buf_put (&req, arg, strlen (arg) + 1);
+    else
+      buf_put (&req, argv[i], strlen (argv[i]) + 1);
+  }
+  /* long options are removed from the command line */
+  if (out_compact)
+    buf_put (&req, "--compact", sizeof ("--compact"));
+
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1
+      || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    printf ("Unable to connect to %s\n", path);
+  else if (!req.data || req.len > FRAME_MAX
+           || frame_write (fd, NULL, req.data, req.len) < 0
+           || !(answer = frame_read (fd, (size_t) -1, 0, &len)) || !len)
+    printf ("No answer from %s\n", path);
+  else
+  {
+    fwrite (answer + 1, 1, len - 1, stdout);
+    res = answer[0] == '0' ? 0 : -1;
+    free (answer);
+  }
+  if (fd != -1)
+    close (fd);
+  buf_free (&req);
+  return res;
 }
-
-/*
- * Main
- * ----
- *
- */
+#endif /* !_WIN32 */
 
 int
 main (int argc, char **argv)
 {
   /* main initialisation */
-  int loc;
+  int loc, nargc;
   int res = 0;
+  char *ptr;
 
   /* param_fixlist initialisation */
   strcpy (param_fixlist[0].n, "EnableRadio|0");
@@ -1707,6 +7402,64 @@ main (int argc, char **argv)
   strcpy (param_fixlist[3].m, "MapRegisters|64");
   strcpy (param_fixlist[4].n, "AdhocGMode|1");
   strcpy (param_fixlist[4].m, "AdhocGMode|0");
+  /* compiled into rules, "Param|Value" to "Param|NewValue" */
+  for (loc = 0; loc < (int) (sizeof (param_fixlist) / sizeof (param_fixlist[0]));
+       loc++)
+  {
+    ptr = strchr (param_fixlist[loc].n, '|');
+    *ptr = '\0';
+    def_rule (param_fixlist[loc].n, ptr + 1,
+              strchr (param_fixlist[loc].m, '|') + 1);
+    *ptr = '|';
+  }
+  /* before any thread hashes a file */
+  crc32c_init ();
+
+  /* long options, removed from the argument list */
+  for (loc = 1, nargc = 1; loc < argc; loc++)
+  {
+    if (!strcmp (argv[loc], "--stats") || !strcmp (argv[loc], "--stats=text"))
+      stats_mode = STATS_TEXT;
+    else if (!strcmp (argv[loc], "--stats=json"))
+      stats_mode = STATS_JSON;
+    else if (!strncmp (argv[loc], "--trace=", 8) && argv[loc][8] != '\0')
+    {
+      trace_on = 1;
+      trace_name = argv[loc] + 8;
+      trace_t0 = stats_now ();
+    }
+    else if (!strcmp (argv[loc], "--io-uring"))
+      out_uring = 1;
+    else if (!strncmp (argv[loc], "--jobs=", 7) && argv[loc][7] != '\0')
+      copy_jobs = strtoul (argv[loc] + 7, NULL, 10);
+    else if (!strcmp (argv[loc], "--no-cache"))
+      cache_enable = 0;
+    else if (!strcmp (argv[loc], "--compact"))
+      out_compact = 1;
+    else if (!strncmp (argv[loc], "--rules=", 8) && argv[loc][8] != '\0')
+    {
+      /* after the built-in ones, which it may replace */
+      if (loadRules (argv[loc] + 8) < 0)
+        return -1;
+    }
+    else if (!strcmp (argv[loc], "--present"))
+      sysfs_root = "/sys";
+    else if (!strncmp (argv[loc], "--sysfs=", 8) && argv[loc][8] != '\0')
+      sysfs_root = argv[loc] + 8;
+    else if (!strncmp (argv[loc], "--tar=", 6) && argv[loc][6] != '\0')
+    {
+      out_format = OUT_TAR;
+      out_name = argv[loc] + 6;
+    }
+    else if (!strncmp (argv[loc], "--cpio=", 7) && argv[loc][7] != '\0')
+    {
+      out_format = OUT_CPIO;
+      out_name = argv[loc] + 7;
+    }
+    else
+      argv[nargc++] = argv[loc];
+  }
+  argc = nargc;
 
   /* arguments */
   if (argc < 2)
@@ -1716,12 +7469,14 @@ main (int argc, char **argv)
   }
 
   /* optional argument */
-  for (loc = 4; loc < argc; loc++)
+  for (loc = 3; loc < argc; loc++)
     if (!strcmp (argv[loc-1], "-o"))
       confdir = argv[loc];
 
-  if (!strcmp (argv[1], "-i") && argc < 7 && argc > 2)
+  if ((!strcmp (argv[1], "-i") || !strcmp (argv[1], "-u"))
+      && argc < 7 && argc > 2)
   {
+    out_update = argv[1][1] == 'u';
     for (loc = 3; loc < argc; loc++)
       if (!strcmp (argv[loc], "-a"))
         alt_install = 1;
@@ -1733,9 +7488,33 @@ main (int argc, char **argv)
 */
   else if (!strcmp (argv[1], "-e") && argc < 6 && argc > 2)
     res = remove_driver (argv[2]);
+  else if (!strcmp (argv[1], "-s") && argc > 3)
+    res = search_driver (argv[2], argc - 3, argv + 3);
+  else if (!strcmp (argv[1], "-l") && (argc == 2 || argc == 4))
+  {
+    res = list_drivers ();
+    query_close ();
+  }
+  else if (!strcmp (argv[1], "-c") && argc < 6)
+  {
+    /* -c [driver] [-o dir] */
+    res = check_driver (argc == 3 || argc == 5 ? argv[2] : NULL);
+    query_close ();
+  }
+#ifndef _WIN32
+  else if (!strcmp (argv[1], "-D") && (argc == 3 || argc == 5))
+    res = daemon_run (argv[2]);
+  else if (!strcmp (argv[1], "-C") && argc > 3)
+    res = client_run (argv[2], argc - 3, argv + 3);
+#endif /* !_WIN32 */
+  else if (!strcmp (argv[1], "-q") && argc > 2)
+  {
+    /* -o is the only option */
+    for (loc = 2; loc < argc && strcmp (argv[loc], "-o"); loc++)
+      ;
+    res = query_driver (loc - 2, argv + 2);
+  }
 /*
-  else if (!strcmp (argv[1], "-l") && argc == 2)
-    res = list ();
   else if (!strcmp (argv[1], "-m") && argc == 2)
     res = modalias ();
   else if (!strcmp (argv[1], "-v") && argc == 2)
@@ -1754,5 +7533,8 @@ main (int argc, char **argv)
   else
     usage ();
 
+  stats_print ();
+  if (trace_write () < 0)
+    res = -1;
   return res;
 }
@@ -0,0 +1,415 @@
+/*
+ * Driver archives : writes a package directory, the same package as .zip
+ * and .cab archives, and damaged copies of these archives.
+ *
+ * usage: archives <dir>
+ *
+ * <dir>/pkg  : the package directory, the reference install
+ * <dir>/good : .zip and .cab archives of the package, installed like it
+ * <dir>/bad  : truncated or corrupt archives, never installed
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define CAB_BLOCK   32768
+
+typedef struct def_buf_s {
+  unsigned char *data;
+  size_t len, size;
+} def_buf_t;
+
+typedef struct def_file_s {
+  const char *name;
+  unsigned char *data;
+  size_t len;
+  int folder;
+} def_file_t;
+
+/* the damage done to an archive */
+typedef enum flaw {
+  FLAW_NONE,
+  FLAW_TRUNCATED,     /* cut in the middle of the data */
+  FLAW_STORED,        /* a byte of a stored member, or block, changed */
+  FLAW_DEFLATED,      /* a deflate stream starting with a reserved block */
+  FLAW_SIZE,          /* an uncompressed size too large */
+  FLAW_BLOCK,         /* a data block running past the end */
+  FLAW_SIGNATURE      /* a MSZIP block without its "CK" */
+} flaw_t;
+
+static const char inf[] =
+  "; archived package\r\n"
+  "[Version]\r\n"
+  "Signature=\"$Windows NT$\"\r\n"
+  "Class=Net\r\n"
+  "Provider=%Mfg%\r\n"
+  "DriverVer=01/01/2007,1.2.3.4\r\n"
+  "\r\n"
+  "[Manufacturer]\r\n"
+  "%Mfg%=Acme,NTx86\r\n"
+  "\r\n"
+  "[Acme.NTx86]\r\n"
+  "%Dev.Desc%=Acme_Inst, PCI\\VEN_1814&DEV_0201\r\n"
+  "%Dev.Desc%=Acme_Inst, PCI\\VEN_1814&DEV_0301&SUBSYS_27021814\r\n"
+  "%Dev.Desc%=Acme_Inst, USB\\VID_148F&PID_2573\r\n"
+  "\r\n"
+  "[Acme_Inst.NT]\r\n"
+  "AddReg=Acme.Reg\r\n"
+  "CopyFiles=Acme.Files\r\n"
+  "\r\n"
+  "[Acme.Reg]\r\n"
+  "HKR,Ndi\\params\\EnableRadio,default,0,\"1\"\r\n"
+  "HKR,,DriverDesc,0,%Dev.Desc%\r\n"
+  "\r\n"
+  "[Acme.Files]\r\n"
+  "acme.sys\r\n"
+  "acme.bin\r\n"
+  "\r\n"
+  "[Strings]\r\n"
+  "Mfg=\"Acme Corp\"\r\n"
+  "Dev.Desc=\"Acme Wireless\"\r\n";
+
+/* the INF and the driver in the first folder of a cabinet, the rest in
+ * the second one, acme.sys spans several blocks, pad.bin is not copied */
+static def_file_t files[] = {
+  { "acme.inf", NULL, 0, 0 },
+  { "acme.sys", NULL, 100000, 0 },
+  { "ACME.BIN", NULL, 5000, 1 },
+  { "pad.bin", NULL, 70000, 1 }
+};
+
+#define NB_FILES (sizeof (files) / sizeof (files[0]))
+
+static void
+put (def_buf_t *b, const void *data, size_t len)
+{
+  if (b->len + len > b->size)
+  {
+    b->size = (b->len + len) * 2;
+    if (!(b->data = realloc (b->data, b->size)))
+    {
+      perror ("realloc");
+      exit (1);
+    }
+  }
+  memcpy (b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void
+put16 (def_buf_t *b, unsigned int v)
+{
+  unsigned char p[2] = { v, v >> 8 };
+
+  put (b, p, 2);
+}
+
+static void
+put32 (def_buf_t *b, unsigned long v)
+{
+  unsigned char p[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+  put (b, p, 4);
+}
+
+static void
+set16 (def_buf_t *b, size_t off, unsigned int v)
+{
+  b->data[off] = v;
+  b->data[off + 1] = v >> 8;
+}
+
+static void
+set32 (def_buf_t *b, size_t off, unsigned long v)
+{
+  set16 (b, off, v & 0xFFFF);
+  set16 (b, off + 2, v >> 16);
+}
+
+static void
+save (const char *dir, const char *name, const unsigned char *data,
+      size_t len)
+{
+  char path[4096];
+  FILE *f;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  if (!(f = fopen (path, "wb")) || fwrite (data, 1, len, f) != len
+      || fclose (f))
+  {
+    perror (path);
+    exit (1);
+  }
+}
+
+/* raw deflate, with the previous data as dictionary for MSZIP */
+static void
+deflate_raw (def_buf_t *b, const unsigned char *dict, size_t dlen,
+          const unsigned char *data, size_t len)
+{
+  unsigned char out[2 * CAB_BLOCK + 1024];
+  z_stream zs;
+
+  memset (&zs, 0, sizeof (zs));
+  if (deflateInit2 (&zs, 9, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK
+      || (dlen && deflateSetDictionary (&zs, dict, dlen) != Z_OK))
+    exit (1);
+  zs.next_in = (unsigned char *) data;
+  zs.avail_in = len;
+  do
+  {
+    zs.next_out = out;
+    zs.avail_out = sizeof (out);
+    if (deflate (&zs, Z_FINISH) == Z_STREAM_ERROR)
+      exit (1);
+    put (b, out, sizeof (out) - zs.avail_out);
+  }
+  while (zs.avail_out == 0);
+  deflateEnd (&zs);
+}
+
+/* the files under Drv/, deflated and stored in turn */
+static void
+zip (const char *dir, const char *name, flaw_t flaw)
+{
+  def_buf_t b = { NULL, 0, 0 }, cd = { NULL, 0, 0 };
+  size_t off, start, nlen;
+  unsigned long crc;
+  unsigned int i, method, nb = 0;
+  char path[64];
+
+  for (i = 0; i <= NB_FILES; i++, nb++)
+  {
+    /* a directory entry first */
+    if (i == 0)
+      snprintf (path, sizeof (path), "Drv/");
+    else
+      snprintf (path, sizeof (path), "Drv/%s", files[i - 1].name);
+    nlen = strlen (path);
+    method = i % 2 ? 8 : 0;
+    crc = i ? crc32 (0, files[i - 1].data, files[i - 1].len) : 0;
+
+    off = b.len;
+    put32 (&b, 0x04034b50);
+    put16 (&b, 20);
+    put16 (&b, 0);
+    put16 (&b, method);
+    put16 (&b, 0);
+    put16 (&b, 0x21);
+    put32 (&b, crc);
+    put32 (&b, 0);
+    put32 (&b, i ? files[i - 1].len : 0);
+    put16 (&b, nlen);
+    put16 (&b, 0);
+    put (&b, path, nlen);
+    start = b.len;
+    if (i && method == 8)
+      deflate_raw (&b, NULL, 0, files[i - 1].data, files[i - 1].len);
+    else if (i)
+      put (&b, files[i - 1].data, files[i - 1].len);
+    set32 (&b, off + 18, b.len - start);
+
+    if (i == 2 && flaw == FLAW_STORED)
+      b.data[start + files[i - 1].len / 2] ^= 0x01;
+    if (i == 3 && flaw == FLAW_DEFLATED)
+      b.data[start] |= 0x06;
+
+    put32 (&cd, 0x02014b50);
+    put16 (&cd, 20);
+    put (&cd, b.data + off + 4, 26);
+    put16 (&cd, 0);
+    put16 (&cd, 0);
+    put16 (&cd, 0);
+    put32 (&cd, 0);
+    put32 (&cd, off);
+    put (&cd, path, nlen);
+    if (i == 3 && flaw == FLAW_SIZE)
+      set32 (&cd, cd.len - nlen - 46 + 24, files[i - 1].len + 1);
+  }
+
+  off = b.len;
+  put (&b, cd.data, cd.len);
+  put32 (&b, 0x06054b50);
+  put16 (&b, 0);
+  put16 (&b, 0);
+  put16 (&b, nb);
+  put16 (&b, nb);
+  put32 (&b, cd.len);
+  put32 (&b, off);
+  put16 (&b, 12);
+  put (&b, "acme drivers", 12);
+
+  save (dir, name, b.data, flaw == FLAW_TRUNCATED ? off / 2 : b.len);
+  free (b.data);
+  free (cd.data);
+}
+
+/* the files under Drv\, in folders of 'types' (0 stored, 1 MSZIP), with
+ * reserved bytes in the header, the folders and the data blocks if
+ * 'reserve' */
+static void
+cab (const char *dir, const char *name, const unsigned int *types,
+     unsigned int nb_folders, int reserve, flaw_t flaw)
+{
+  def_buf_t b = { NULL, 0, 0 }, data = { NULL, 0, 0 };
+  size_t folder_off[2], flen[2] = { 0, 0 }, off, ulen, hist, blk = 0, mid = 0;
+  unsigned int i, k, nb_blocks, dres = reserve ? 2 : 0;
+  char path[64];
+
+  /* header, with its reserved bytes */
+  put (&b, "MSCF", 4);
+  put32 (&b, 0);
+  put32 (&b, 0);
+  put32 (&b, 0);
+  put32 (&b, 0);
+  put32 (&b, 0);
+  put (&b, "\3\1", 2);
+  put16 (&b, nb_folders);
+  put16 (&b, 0);
+  put16 (&b, reserve ? 0x0004 : 0);
+  put16 (&b, 0x1234);
+  put16 (&b, 0);
+  if (reserve)
+  {
+    put16 (&b, 4);
+    put16 (&b, 4 | dres << 8);
+    put32 (&b, 0);
+  }
+
+  for (k = 0; k < nb_folders; k++)
+  {
+    folder_off[k] = b.len;
+    put32 (&b, 0);
+    put16 (&b, 0);
+    put16 (&b, types[k]);
+    if (reserve)
+      put32 (&b, 0);
+  }
+
+  set32 (&b, 16, b.len);
+  for (i = 0, k = 0; i < NB_FILES; i++)
+  {
+    if (files[i].folder >= (int) nb_folders)
+      continue;
+    snprintf (path, sizeof (path), "Drv\\%s", files[i].name);
+    put32 (&b, files[i].len);
+    put32 (&b, flen[files[i].folder]);
+    put16 (&b, files[i].folder);
+    put16 (&b, 0x21);
+    put16 (&b, 0);
+    put16 (&b, 0x20);
+    put (&b, path, strlen (path) + 1);
+    flen[files[i].folder] += files[i].len;
+    k++;
+  }
+  set16 (&b, 28, k);
+
+  /* the data blocks of each folder, MSZIP ones using the previous 32KB */
+  for (k = 0; k < nb_folders; k++)
+  {
+    data.len = 0;
+    for (i = 0; i < NB_FILES; i++)
+      if (files[i].folder == (int) k)
+        put (&data, files[i].data, files[i].len);
+    set32 (&b, folder_off[k], b.len);
+    for (off = 0, nb_blocks = 0; off < data.len; off += ulen, nb_blocks++)
+    {
+      ulen = data.len - off < CAB_BLOCK ? data.len - off : CAB_BLOCK;
+      hist = off < CAB_BLOCK ? off : CAB_BLOCK;
+      blk = b.len;
+      put32 (&b, 0);
+      put32 (&b, 0);
+      put (&b, "\0\0", dres);
+      if (types[k])
+      {
+        put (&b, "CK", 2);
+        deflate_raw (&b, data.data + off - hist, hist, data.data + off, ulen);
+      }
+      else
+        put (&b, data.data + off, ulen);
+      set16 (&b, blk + 4, b.len - blk - 8 - dres);
+      set16 (&b, blk + 6, ulen);
+
+      /* the damage, in the second block of the folder without the INF */
+      if (k != nb_folders - 1 || nb_blocks != 1)
+        continue;
+      mid = blk + (b.len - blk) / 2;
+      if (flaw == FLAW_STORED || flaw == FLAW_SIZE)
+        set16 (&b, blk + 6, ulen + 1);
+      else if (flaw == FLAW_DEFLATED)
+        b.data[blk + 8 + dres + 2] |= 0x06;
+      else if (flaw == FLAW_SIGNATURE)
+        b.data[blk + 8 + dres + 1] = 'X';
+    }
+    set16 (&b, folder_off[k] + 4, nb_blocks);
+  }
+  /* the last block of the cabinet running past the end */
+  if (flaw == FLAW_BLOCK)
+    set16 (&b, blk + 4, b.len - blk - 8 - dres + 1);
+  set32 (&b, 8, b.len);
+
+  save (dir, name, b.data, flaw == FLAW_TRUNCATED ? mid : b.len);
+  free (b.data);
+  free (data.data);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int mszip[] = { 1, 1 }, stored[] = { 0, 0 };
+  static const unsigned int mixed[] = { 1, 0 };
+  char dir[4096];
+  unsigned int i;
+  size_t k;
+
+  if (argc != 2)
+  {
+    printf ("usage: %s <dir>\n", argv[0]);
+    return 1;
+  }
+
+  /* a driver repeating with a period longer than a block, so that MSZIP
+   * blocks refer to the previous ones */
+  files[0].data = (unsigned char *) inf;
+  files[0].len = strlen (inf);
+  for (i = 1; i < NB_FILES; i++)
+  {
+    if (!(files[i].data = malloc (files[i].len)))
+      return 1;
+    for (k = 0; k < files[i].len; k++)
+      files[i].data[k] = i == 1 ? (k % 40000) * 7 % 251 : (k * 13 + i) % 256;
+  }
+
+  snprintf (dir, sizeof (dir), "%s/pkg", argv[1]);
+  mkdir (dir, 0755);
+  for (i = 0; i < NB_FILES - 1; i++)
+    save (dir, files[i].name, files[i].data, files[i].len);
+
+  snprintf (dir, sizeof (dir), "%s/good", argv[1]);
+  mkdir (dir, 0755);
+  zip (dir, "acme.zip", FLAW_NONE);
+  cab (dir, "acme.cab", mszip, 2, 1, FLAW_NONE);
+  cab (dir, "stored.cab", stored, 2, 0, FLAW_NONE);
+  cab (dir, "mixed.cab", mixed, 2, 1, FLAW_NONE);
+
+  snprintf (dir, sizeof (dir), "%s/bad", argv[1]);
+  mkdir (dir, 0755);
+  zip (dir, "truncated.zip", FLAW_TRUNCATED);
+  zip (dir, "stored-crc.zip", FLAW_STORED);
+  zip (dir, "deflated-data.zip", FLAW_DEFLATED);
+  zip (dir, "size.zip", FLAW_SIZE);
+  cab (dir, "truncated.cab", mszip, 2, 1, FLAW_TRUNCATED);
+  cab (dir, "stored-size.cab", stored, 2, 0, FLAW_STORED);
+  cab (dir, "mszip-size.cab", mszip, 2, 1, FLAW_SIZE);
+  cab (dir, "mszip-data.cab", mszip, 2, 1, FLAW_DEFLATED);
+  cab (dir, "mszip-signature.cab", mszip, 2, 0, FLAW_SIGNATURE);
+  cab (dir, "block.cab", mixed, 2, 1, FLAW_BLOCK);
+
+  for (i = 1; i < NB_FILES; i++)
+    free (files[i].data);
+  return 0;
+}
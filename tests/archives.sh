@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Installs from .zip and .cab driver archives : the same driver as from
+# the package directory, and truncated or corrupt archives failing without
+# leaving anything behind.
+#
+# usage: archives.sh [ndiswrapper] [archives]
+#
+# archives : the fixture generator, built from tests/archives.c
+#
+
+NDIS=${1:-./ndiswrapper}
+GEN=${2:-./tests/archives}
+
+case "$NDIS" in
+  /*) ;;
+  *) NDIS="$(pwd)/$NDIS" ;;
+esac
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+failed=0
+
+fail ()
+{
+  echo "FAIL: $*"
+  failed=1
+}
+
+"$GEN" "$TMP" || exit 1
+
+# the reference, from the package directory
+mkdir "$TMP/ref"
+"$NDIS" -i "$TMP/pkg/acme.inf" -o "$TMP/ref" > /dev/null \
+  || fail "package directory: install failed"
+
+for arc in "$TMP"/good/*; do
+  name=$(basename "$arc")
+  mkdir "$TMP/$name"
+  if ! "$NDIS" -i "$arc" -o "$TMP/$name" > /dev/null; then
+    fail "$name: install failed"
+    continue
+  fi
+  diff -r "$TMP/ref" "$TMP/$name" > /dev/null \
+    || fail "$name: tree differs from the package directory install"
+  "$NDIS" -c acme -o "$TMP/$name" > /dev/null \
+    || fail "$name: verification failed"
+done
+
+for arc in "$TMP"/bad/*; do
+  name=$(basename "$arc")
+
+  # an install fails, without crashing, and leaves nothing
+  mkdir "$TMP/$name"
+  "$NDIS" -i "$arc" -o "$TMP/$name" > /dev/null 2>&1
+  res=$?
+  # 255 is an error of ndiswrapper, 129 to 254 a signal
+  if [ $res -eq 0 ] || { [ $res -gt 128 ] && [ $res -ne 255 ]; }; then
+    fail "$name: install returned $res"
+  fi
+  [ -z "$(ls -A "$TMP/$name")" ] \
+    || fail "$name: install left $(ls -A "$TMP/$name")"
+
+  # an update fails, and leaves the installed driver as it was
+  cp -R "$TMP/ref" "$TMP/$name.u"
+  "$NDIS" -u "$arc" -o "$TMP/$name.u" > /dev/null 2>&1 \
+    && fail "$name: update succeeded"
+  diff -r "$TMP/ref" "$TMP/$name.u" > /dev/null \
+    || fail "$name: update changed the installed driver"
+done
+
+[ $failed -eq 0 ] && echo "archives: ok"
+exit $failed
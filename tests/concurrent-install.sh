@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# Parallel installs, updates and removals of drivers in one confdir.
+#
+# usage: concurrent-install.sh [ndiswrapper] [processes]
+#
+
+NDIS=${1:-./ndiswrapper}
+N=${2:-8}
+
+case "$NDIS" in
+  /*) ;;
+  *) NDIS="$(pwd)/$NDIS" ;;
+esac
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+failed=0
+
+fail ()
+{
+  echo "FAIL: $*"
+  failed=1
+}
+
+# a package : 'name' 'version', 16 files of 64 KB shared by 20 devices
+mkpkg ()
+{
+  dir="$TMP/pkg/$1-$2"
+  mkdir -p "$dir"
+  {
+    printf '[Version]\r\n'
+    printf 'Signature="$Windows NT$"\r\n'
+    printf 'Class=Net\r\n'
+    printf 'Provider=%%Mfg%%\r\n'
+    printf 'DriverVer=01/01/2010,1.0.0.%s\r\n\r\n' "$2"
+    printf '[Manufacturer]\r\n%%Mfg%%=Test,NTx86\r\n\r\n'
+    printf '[Test.NTx86]\r\n'
+    f=0
+    while [ $f -lt 20 ]; do
+      printf '%%Desc%%=Inst, PCI\\VEN_1814&DEV_%04d\r\n' $f
+      f=$((f + 1))
+    done
+    printf '\r\n[Inst.NT]\r\nAddReg=Reg\r\nCopyFiles=Files\r\n\r\n'
+    printf '[Reg]\r\nHKR,,Version,0,"%s"\r\n\r\n[Files]\r\n' "$2"
+    f=0
+    while [ $f -lt 16 ]; do
+      printf 'f%02d.sys\r\n' $f
+      f=$((f + 1))
+    done
+    printf '\r\n[Strings]\r\nMfg="Test"\r\nDesc="Test %s"\r\n' "$1"
+  } > "$dir/$1.inf"
+  f=0
+  while [ $f -lt 16 ]; do
+    dd if=/dev/zero bs=1024 count=64 2> /dev/null \
+      | tr '\0' "$(printf '\\%03o' $((65 + $2 + f)))" \
+      > "$dir/$(printf 'f%02d.sys' $f)"
+    f=$((f + 1))
+  done
+}
+
+# no claim, nor staged file, is left in the confdir
+noleft ()
+{
+  left=$(cd "$1" && ls -A | grep '^\.')
+  [ -z "$left" ] || fail "$2: left $left"
+}
+
+mkpkg drv 1
+mkpkg drv 2
+i=0
+while [ $i -lt $N ]; do
+  mkpkg "drv$i" 1
+  i=$((i + 1))
+done
+
+# references, installed one at a time
+"$NDIS" -i "$TMP/pkg/drv-1/drv.inf" -o "$TMP/ref1" > /dev/null
+"$NDIS" -i "$TMP/pkg/drv-2/drv.inf" -o "$TMP/ref2" > /dev/null
+
+# the same driver : one install wins, the others give up
+i=0
+pids=
+while [ $i -lt $N ]; do
+  "$NDIS" -i "$TMP/pkg/drv-1/drv.inf" -o "$TMP/same" > /dev/null 2>&1 &
+  pids="$pids $!"
+  i=$((i + 1))
+done
+wins=0
+for pid in $pids; do
+  wait $pid && wins=$((wins + 1))
+done
+[ $wins -eq 1 ] || fail "same driver: $wins installs succeeded"
+diff -r "$TMP/ref1" "$TMP/same" > /dev/null \
+  || fail "same driver: tree differs from a serial install"
+noleft "$TMP/same" "same driver"
+
+# different drivers : every install succeeds
+i=0
+pids=
+while [ $i -lt $N ]; do
+  "$NDIS" -i "$TMP/pkg/drv$i-1/drv$i.inf" -o "$TMP/many" > /dev/null 2>&1 &
+  pids="$pids $!"
+  i=$((i + 1))
+done
+for pid in $pids; do
+  wait $pid || fail "different drivers: an install failed"
+done
+"$NDIS" -c -o "$TMP/many" > /dev/null \
+  || fail "different drivers: verification failed"
+[ $(ls "$TMP/many" | wc -l) -eq $N ] \
+  || fail "different drivers: $(ls "$TMP/many" | wc -l) of $N installed"
+noleft "$TMP/many" "different drivers"
+
+# updates racing removals : no driver, or a complete one
+round=0
+while [ $round -lt 4 ]; do
+  i=0
+  while [ $i -lt $N ]; do
+    if [ $i -eq $round ]; then
+      "$NDIS" -e drv -o "$TMP/same" > /dev/null 2>&1 &
+    else
+      "$NDIS" -u "$TMP/pkg/drv-$((1 + (i + round) % 2))/drv.inf" \
+        -o "$TMP/same" > /dev/null 2>&1 &
+    fi
+    i=$((i + 1))
+  done
+  wait
+  if [ -d "$TMP/same/drv" ]; then
+    "$NDIS" -c drv -o "$TMP/same" > /dev/null \
+      || fail "update/remove round $round: verification failed"
+    diff -r "$TMP/ref1" "$TMP/same" > /dev/null \
+      || diff -r "$TMP/ref2" "$TMP/same" > /dev/null \
+      || fail "update/remove round $round: mixed tree"
+  fi
+  noleft "$TMP/same" "update/remove round $round"
+  round=$((round + 1))
+done
+
+# a killed install : its claim is taken over
+rm -rf "$TMP/kill"
+for delay in 0.01 0.05; do
+  "$NDIS" -i "$TMP/pkg/drv-1/drv.inf" -o "$TMP/kill" > /dev/null 2>&1 &
+  pid=$!
+  sleep $delay
+  kill -9 $pid 2> /dev/null
+  wait $pid 2> /dev/null
+  rm -rf "$TMP/kill/drv"
+done
+"$NDIS" -i "$TMP/pkg/drv-1/drv.inf" -o "$TMP/kill" > /dev/null \
+  || fail "killed install: the next install failed"
+diff -r "$TMP/ref1" "$TMP/kill" > /dev/null \
+  || fail "killed install: tree differs from a serial install"
+noleft "$TMP/kill" "killed install"
+
+[ $failed -eq 0 ] && echo "concurrent-install: ok"
+exit $failed
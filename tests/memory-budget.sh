@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Peak resident size and allocations of installs of synthetic INFs, from
+# a few devices to a large multi-language INF, against a budget growing
+# with the size of the INF.
+#
+# usage: memory-budget.sh [ndiswrapper]
+#
+# RSS_BASE_KB     : peak resident size of an install, whatever the INF
+#                   (default 4096)
+# RSS_PER_INF_KB  : peak resident size per KB of INF (6)
+# ALLOCS_BASE     : allocations of an install, whatever the INF (4096)
+# ALLOCS_PER_LINE : allocations per line of the INF (8)
+#
+
+NDIS=${1:-./ndiswrapper}
+RSS_BASE_KB=${RSS_BASE_KB:-4096}
+RSS_PER_INF_KB=${RSS_PER_INF_KB:-6}
+ALLOCS_BASE=${ALLOCS_BASE:-4096}
+ALLOCS_PER_LINE=${ALLOCS_PER_LINE:-8}
+
+case "$NDIS" in
+  /*) ;;
+  *) NDIS="$(pwd)/$NDIS" ;;
+esac
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+failed=0
+
+# an INF of 'devices' models, sharing 3 install sections, with 8 languages
+mkinf ()
+{
+  awk -v n="$1" 'BEGIN {
+    ORS = "\r\n"
+    print "[Version]"
+    print "Signature=\"$Windows NT$\""
+    print "Class=Net"
+    print "Provider=%Mfg%"
+    print "DriverVer=01/01/2010,1.0.0.0"
+    print ""
+    print "[Manufacturer]"
+    print "%Mfg%=Syn,NTx86"
+    print ""
+    print "[Syn.NTx86]"
+    for (i = 0; i < n; i++)
+      printf "%%Dev%d.Desc%%=Inst%d, PCI\\VEN_%04X&DEV_%04X%s" ORS, \
+        i % 50, i % 3, 4096 + int (i / 65536), i % 65536, \
+        i % 2 ? sprintf ("&SUBSYS_%04X1186", i % 65536) : ""
+    print ""
+    for (k = 0; k < 3; k++)
+    {
+      print "[Inst" k ".NT]"
+      print "AddReg=Reg" k
+      print "CopyFiles=Files"
+      print ""
+      print "[Reg" k "]"
+      for (j = 0; j < 40; j++)
+      {
+        printf "HKR,Ndi\\params\\P%d_%d,type,0,\"dword\"" ORS, k, j
+        printf "HKR,Ndi\\params\\P%d_%d,default,0,\"%d\"" ORS, k, j, j
+      }
+      print ""
+    }
+    print "[Files]"
+    print "syn.sys"
+    print ""
+    print "[Strings]"
+    print "Mfg=\"Synthetic\""
+    for (i = 0; i < 50; i++)
+      printf "Dev%d.Desc=\"Synthetic %d\"" ORS, i, i
+    for (l = 0; l < 8; l++)
+    {
+      print ""
+      printf "[Strings.%04X]" ORS, 1031 + l
+      for (i = 0; i < n; i++)
+        printf "Dev%d.Desc=\"Localized %d %d\"" ORS, i, l, i
+    }
+  }' > "$TMP/syn.inf"
+  printf 'syn' > "$TMP/syn.sys"
+}
+
+for devices in 10 100 1000 10000; do
+  mkinf $devices
+  lines=$(wc -l < "$TMP/syn.inf")
+  size=$(($(wc -c < "$TMP/syn.inf") / 1024))
+  rm -rf "$TMP/out"
+  if ! "$NDIS" -i "$TMP/syn.inf" -o "$TMP/out" --jobs=0 --stats=json \
+    2> "$TMP/stats" > /dev/null; then
+    echo "FAIL: $devices devices: install failed"
+    failed=1
+    continue
+  fi
+  rss=$(sed -n 's/.*"peak_rss_kb":\([0-9]*\).*/\1/p' "$TMP/stats")
+  allocs=$(sed -n 's/.*"allocs":\([0-9]*\).*/\1/p' "$TMP/stats")
+  rss_budget=$((RSS_BASE_KB + RSS_PER_INF_KB * size))
+  allocs_budget=$((ALLOCS_BASE + ALLOCS_PER_LINE * lines))
+  echo "$devices devices, $size KB, $lines lines:" \
+    "peak_rss_kb $rss/$rss_budget, allocs $allocs/$allocs_budget"
+  if [ -z "$rss" ] || [ "$rss" -gt "$rss_budget" ]; then
+    echo "FAIL: $devices devices: peak RSS over the budget"
+    failed=1
+  fi
+  if [ -z "$allocs" ] || [ "$allocs" -gt "$allocs_budget" ]; then
+    echo "FAIL: $devices devices: allocations over the budget"
+    failed=1
+  fi
+done
+
+[ $failed -eq 0 ] && echo "memory-budget: ok"
+exit $failed
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Removals : a driver name is a directory of confdir, never a path out
+# of it, nor the claim of another process.
+#
+# usage: remove.sh [ndiswrapper]
+#
+
+NDIS=${1:-./ndiswrapper}
+
+case "$NDIS" in
+  /*) ;;
+  *) NDIS="$(pwd)/$NDIS" ;;
+esac
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+failed=0
+
+fail ()
+{
+  echo "FAIL: $*"
+  failed=1
+}
+
+mkdir -p "$TMP/pkg" "$TMP/conf" "$TMP/victim"
+{
+  printf '[Version]\r\nSignature="$Windows NT$"\r\nClass=Net\r\n'
+  printf 'Provider=%%Mfg%%\r\nDriverVer=01/01/2010,1.0.0.0\r\n\r\n'
+  printf '[Manufacturer]\r\n%%Mfg%%=Test,NTx86\r\n\r\n'
+  printf '[Test.NTx86]\r\n%%Desc%%=Inst, PCI\\VEN_1814&DEV_0201\r\n\r\n'
+  printf '[Inst.NT]\r\nCopyFiles=Files\r\n\r\n[Files]\r\ndrv.sys\r\n\r\n'
+  printf '[Strings]\r\nMfg="Test"\r\nDesc="Test"\r\n'
+} > "$TMP/pkg/drv.inf"
+printf 'drv' > "$TMP/pkg/drv.sys"
+
+"$NDIS" -i "$TMP/pkg/drv.inf" -o "$TMP/conf" > /dev/null \
+  || fail "install failed"
+
+# names reaching out of confdir, or naming no driver
+mkdir "$TMP/conf/.other.new"
+for name in ../victim ./../victim "$TMP/victim" drv/.. . .. "" .other.new; do
+  "$NDIS" -e "$name" -o "$TMP/conf" > /dev/null 2>&1 \
+    && fail "'$name': removal succeeded"
+done
+[ -d "$TMP/victim" ] || fail "a directory out of confdir was removed"
+[ -d "$TMP/conf/.other.new" ] || fail "the claim of a driver was removed"
+[ -d "$TMP/conf/drv" ] || fail "the installed driver was removed"
+
+"$NDIS" -e drv -o "$TMP/conf" > /dev/null || fail "drv: removal failed"
+[ -d "$TMP/conf/drv" ] && fail "drv: still installed"
+
+[ $failed -eq 0 ] && echo "remove: ok"
+exit $failed
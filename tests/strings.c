@@ -0,0 +1,295 @@
+/*
+ * String helpers : equivalence with the byte-at-a-time versions they
+ * replaced, on random and edge-case input, at every alignment.
+ *
+ * usage: strings [-b]   (-b : time the old and the new helpers)
+ */
+
+#define main ndiswrapper_main
+#include "../ndiswrapper.c"
+#undef main
+
+#include <ctype.h>      /* toupper tolower */
+
+#define MAXLEN      80
+#define ROUNDS      200000
+#define BENCH_LOOPS 2000000
+
+static char *
+old_uc (char *data)
+{
+  int i;
+
+  for (i = 0; data[i] != '\0'; i++)
+    data[i] = toupper (data[i]);
+  return data;
+}
+
+static char *
+old_lc (char *data)
+{
+  int i;
+
+  for (i = 0; data[i] != '\0'; i++)
+    data[i] = tolower (data[i]);
+  return data;
+}
+
+static char *
+old_trim (char *s)
+{
+  char *ptr, *copy;
+  copy = s;
+
+  ptr = strchr (s, '\0');
+  while (ptr > s && (*(ptr-1) == ' '
+         || *(ptr-1) == '\t'
+         || *(ptr-1) == '\r'
+         || *(ptr-1) == '\n'))
+    ptr--;
+
+  *ptr = '\0';
+  ptr = s;
+  while (*ptr == ' ' || *ptr == '\t')
+    ptr++;
+
+  do
+  {
+    *(copy++) = *ptr;
+  }
+  while (*(ptr++));
+
+  return s;
+}
+
+static char *
+old_stripquotes (char *s)
+{
+  char *start, *end, *copy;
+
+  start = strchr (s, '"');
+  if (!start)
+    return s;
+
+  end = strchr (start + 1, '"');
+  if (!end)
+    return s;
+
+  *end = '\0';
+  copy = strdup (start + 1);
+  strcpy (s, copy);
+  free (copy);
+  return s;
+}
+
+static char *
+old_remComment (char *s)
+{
+  char *comment;
+  comment = strchr (s, ';');
+  if (comment)
+    *comment = '\0';
+  return s;
+}
+
+typedef struct def_helper_s {
+  const char *name;
+  char *(*old) (char *);
+  char *(*new) (char *);
+} def_helper_t;
+
+static const def_helper_t helpers[] = {
+  { "uc", old_uc, uc },
+  { "lc", old_lc, lc },
+  { "trim", old_trim, trim },
+  { "stripquotes", old_stripquotes, stripquotes },
+  { "remComment", old_remComment, remComment }
+};
+
+#define NB_HELPERS (sizeof (helpers) / sizeof (helpers[0]))
+
+/* the bytes around the ranges of the case folding, and the separators */
+static const unsigned char edges[] = {
+  '@', 'A', 'M', 'Z', '[', '`', 'a', 'm', 'z', '{', ' ', '\t', '\r', '\n',
+  '"', ';', '%', '=', ',', 0x01, 0x7f, 0x80, 0xc0, 0xc1, 0xda, 0xe1, 0xfa,
+  0xff
+};
+
+static unsigned int seed = 1;
+
+static unsigned int
+rnd (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+/* a string without '\0' : random bytes, edge bytes or blanks */
+static void
+fill (char *s, size_t len)
+{
+  unsigned int mode = rnd () % 4;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    switch (mode)
+    {
+    case 0:
+      s[i] = 1 + rnd () % 255;
+      break;
+    case 1:
+      s[i] = edges[rnd () % sizeof (edges)];
+      break;
+    case 2:
+      s[i] = 0x20 + rnd () % 0x5f;
+      break;
+    default:
+      s[i] = i < 3 || i + 3 >= len ? " \t\r\n"[rnd () % 4]
+        : edges[rnd () % sizeof (edges)];
+      break;
+    }
+  s[len] = '\0';
+}
+
+static void
+dump (const char *what, const char *s, size_t len)
+{
+  size_t i;
+
+  printf ("  %-6s", what);
+  for (i = 0; i < len; i++)
+    printf (" %02x", (unsigned char) s[i]);
+  printf ("\n");
+}
+
+static int
+check (const def_helper_t *h, const char *in, size_t len, size_t align)
+{
+  /* a guard byte after the string, at an offset of an aligned buffer */
+  unsigned long long b1[(MAXLEN + 16) / 8], b2[(MAXLEN + 16) / 8];
+  char *s1 = (char *) b1 + align, *s2 = (char *) b2 + align;
+
+  memset (b1, 0x55, sizeof (b1));
+  memset (b2, 0x55, sizeof (b2));
+  memcpy (s1, in, len + 1);
+  memcpy (s2, in, len + 1);
+  h->old (s1);
+  h->new (s2);
+  /* the same string, and nothing written past the input */
+  if (!strcmp (s1, s2) && s1[len + 1] == 0x55 && s2[len + 1] == 0x55
+      && (!align || ((char *) b2)[align - 1] == 0x55))
+    return 0;
+
+  printf ("FAIL: %s, %zu bytes at offset %zu\n", h->name, len, align);
+  dump ("input", in, len + 1);
+  dump ("old", s1, len + 2);
+  dump ("new", s2, len + 2);
+  return -1;
+}
+
+static int
+check_n (char *(*conv) (char *, size_t), char *(*old) (char *),
+         const char *name, const char *in, size_t len, size_t n)
+{
+  char s1[MAXLEN + 2], s2[MAXLEN + 2];
+
+  /* a length-aware helper only changes the first n bytes */
+  memcpy (s1, in, len + 1);
+  memcpy (s2, in, len + 1);
+  s1[n] = '\0';
+  old (s1);
+  s1[n] = in[n];
+  conv (s2, n);
+  if (!memcmp (s1, s2, len + 1))
+    return 0;
+  printf ("FAIL: %s, %zu of %zu bytes\n", name, n, len);
+  return -1;
+}
+
+static int
+check_trimn (const char *in, size_t len)
+{
+  char s1[MAXLEN + 2], s2[MAXLEN + 2];
+  size_t n;
+
+  memcpy (s1, in, len + 1);
+  memcpy (s2, in, len + 1);
+  old_trim (s1);
+  n = trimn (s2, len);
+  if (n == strlen (s1) && !strcmp (s1, s2))
+    return 0;
+  printf ("FAIL: trimn, %zu bytes\n", len);
+  return -1;
+}
+
+static double
+bench_one (char *(*fn) (char *), const char *in, size_t len)
+{
+  char s[MAXLEN + 2];
+  unsigned long long t;
+  unsigned int i;
+
+  t = stats_now ();
+  for (i = 0; i < BENCH_LOOPS; i++)
+  {
+    memcpy (s, in, len + 1);
+    fn (s);
+    __asm__ volatile ("" : : "r" (s) : "memory");
+  }
+  return (double) (stats_now () - t) / BENCH_LOOPS;
+}
+
+static void
+bench (void)
+{
+  static const char *lines[] = {
+    "  HKR, Ndi\\params\\EnableRadio, default, 0, \"1\"  \r\n",
+    "\"Realtek RTL8187 Wireless LAN USB NIC\"",
+    "pci\\ven_10ec&dev_8180&subsys_818010ec",
+    "ExcludeFromSelect.NTx86=*"
+  };
+  unsigned int i, k;
+
+  printf ("%-12s %-8s %10s %10s\n", "helper", "length", "old(ns)", "new(ns)");
+  for (k = 0; k < NB_HELPERS; k++)
+    for (i = 0; i < sizeof (lines) / sizeof (lines[0]); i++)
+      printf ("%-12s %-8zu %10.1f %10.1f\n", helpers[k].name,
+              strlen (lines[i]),
+              bench_one (helpers[k].old, lines[i], strlen (lines[i])),
+              bench_one (helpers[k].new, lines[i], strlen (lines[i])));
+}
+
+int
+main (int argc, char **argv)
+{
+  char in[MAXLEN + 2];
+  unsigned int round, k;
+  size_t len, align, n;
+  int res = 0;
+
+  if (argc > 1 && !strcmp (argv[1], "-b"))
+  {
+    bench ();
+    return 0;
+  }
+
+  /* every length around the 8 byte words, at every alignment */
+  for (round = 0; round < ROUNDS && !res; round++)
+  {
+    len = round < 8 * (MAXLEN + 1) ? round % (MAXLEN + 1) : rnd () % MAXLEN;
+    fill (in, len);
+    for (k = 0; k < NB_HELPERS && !res; k++)
+      for (align = 0; align < 8 && !res; align++)
+        res = check (&helpers[k], in, len, align);
+    if (!res)
+    {
+      n = len ? rnd () % (len + 1) : 0;
+      res = check_n (ucn, old_uc, "ucn", in, len, n)
+        || check_n (lcn, old_lc, "lcn", in, len, n) || check_trimn (in, len);
+    }
+  }
+
+  if (!res)
+    printf ("strings: ok\n");
+  return res ? 1 : 0;
+}